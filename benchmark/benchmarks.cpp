@@ -0,0 +1,430 @@
+/**
+ * Micro-benchmarks of the hot stages of the classifier
+ *
+ * Richie Steigerwald
+ *
+ * Copyright 2013 Richie Steigerwald <richie.steigerwald@gmail.com>
+ * This work is free. You can redistribute it and/or modify it under the
+ * terms of the Do What The Fuck You Want To Public License, Version 2,
+ * as published by Sam Hocevar. See http://www.wtfpl.net/ for more details.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <sstream>
+
+#include <opencv2/core/core.hpp> // Mat
+#include <opencv2/highgui/highgui.hpp> // imdecode
+#include <opencv2/ml/ml.hpp> // KNearest
+#include <opencv2/nonfree/features2d.hpp> // SURF
+
+#include "cv/bag_of_features.h"
+#include "cv/feature_extractor.h"
+#include "cv/feature_pipeline.h"
+#include "cv/kmeans.h"
+#include "cv/visual_vocabulary.h"
+#include "ml/classifier.h"
+#include "files.hpp"
+
+using namespace std;
+
+void usage(const string &program);
+
+/**
+ * Times stages and prints one CSV row per measurement, so runs can be
+ * compared by a script. Each measurement repeats the stage until it has run
+ * for a minimum time and reports the fastest repetition, which is the least
+ * disturbed by the rest of the machine. Approximate stages also get a row
+ * with their recall, which leaves the time columns empty.
+ */
+class benchmark_report {
+   double min_seconds;
+
+   public:
+      explicit benchmark_report(double m) : min_seconds(m) {
+         cout << "stage,input,parameters,items,seconds,items_per_second,recall" << endl;
+      }
+
+      /**
+       * Times a stage and prints its row
+       * @param[in]  stage       what is timed
+       * @param[in]  input       "synthetic" or the photos the stage ran on
+       * @param[in]  parameters  the point of the sweep, as key=value pairs
+       * @param[in]  items       the number of items each run processes
+       * @param[in]  run         runs the stage once
+       */
+      void measure(const string &stage, const string &input, const string &parameters,
+            int items, const function<void()> &run) const {
+         double best = 0, total = 0;
+         for (int i = 0; i == 0 || total < min_seconds; i++) {
+            int64 start = cv::getTickCount();
+            run();
+            double seconds = (cv::getTickCount() - start) / cv::getTickFrequency();
+            best = i == 0 ? seconds : min(best, seconds);
+            total += seconds;
+         }
+         cout << stage << "," << input << "," << parameters << "," << items << ","
+              << best << "," << (best > 0 ? items / best : 0) << "," << endl;
+      }
+
+      // Prints the fraction of items an approximate stage got right
+      void recall(const string &stage, const string &input, const string &parameters,
+            int items, int correct) const {
+         cout << stage << "," << input << "," << parameters << "," << items << ",,,"
+              << (items > 0 ? (double)correct / items : 0) << endl;
+      }
+};
+
+// Joins sweep parameters into a single CSV field
+string parameters(const string &name, int value) {
+   ostringstream out;
+   out << name << "=" << value;
+   return out.str();
+}
+
+string parameters(const string &first, int first_value, const string &second, int second_value) {
+   return parameters(first, first_value) + ";" + parameters(second, second_value);
+}
+
+/**
+ * Draws a grayscale image of random shapes, which gives the detector
+ * corners and blobs to find
+ * @param[in]  size  the size of the image
+ * @param[in]  rng   draws the shapes
+ */
+cv::Mat synthetic_image(const cv::Size &size, cv::RNG &rng) {
+   cv::Mat image(size, CV_8U, cv::Scalar(128));
+   for (int i = 0; i < 200; i++) {
+      int x = rng.uniform(0, size.width), y = rng.uniform(0, size.height);
+      int w = rng.uniform(4, 40), h = rng.uniform(4, 40);
+      cv::rectangle(image, cv::Rect(x, y, w, h), cv::Scalar(rng.uniform(0, 256)), -1);
+   }
+   return image;
+}
+
+// Keypoints spread uniformly over an image, one per descriptor row
+vector<cv::KeyPoint> synthetic_keypoints(int count, const cv::Size &size, cv::RNG &rng) {
+   vector<cv::KeyPoint> keypoints(count);
+   for (int i = 0; i < count; i++) {
+      keypoints[i] = cv::KeyPoint(rng.uniform(0.f, (float)size.width),
+            rng.uniform(0.f, (float)size.height), 16);
+   }
+   return keypoints;
+}
+
+// Descriptors shaped like SURF's, 64 floats each
+cv::Mat synthetic_descriptors(int count, cv::RNG &rng) {
+   cv::Mat descriptors(count, 64, CV_32F);
+   rng.fill(descriptors, cv::RNG::UNIFORM, 0, 1);
+   return descriptors;
+}
+
+/**
+ * Decodes images and finds their features, on the synthetic image and on
+ * every photo
+ */
+void benchmark_images(const benchmark_report &report, const list<string> &photos, cv::RNG &rng) {
+   vector<pair<string, vector<uchar> > > inputs(1);
+   inputs[0].first = "synthetic";
+   cv::imencode(".png", synthetic_image(cv::Size(640, 480), rng), inputs[0].second);
+   for (list<string>::const_iterator photo = photos.begin(); photo != photos.end(); photo++) {
+      ifstream file(photo->c_str(), ios::binary);
+      inputs.push_back(make_pair(*photo, vector<uchar>((istreambuf_iterator<char>(file)),
+            istreambuf_iterator<char>())));
+   }
+
+   const char *names[] = { "surf", "orb", "brisk", "dense-surf" };
+   cv::SurfFeatureDetector detector(200);
+   cv::SurfDescriptorExtractor extractor;
+   for (int i = 0; i < inputs.size(); i++) {
+      const vector<uchar> &contents = inputs[i].second;
+      if (contents.empty()) continue;
+
+      cv::Mat image;
+      report.measure("decode", inputs[i].first, parameters("bytes", contents.size()), 1, [&] {
+         image = cv::imdecode(cv::Mat(contents), CV_LOAD_IMAGE_GRAYSCALE);
+      });
+      if (image.empty()) continue;
+
+      vector<cv::KeyPoint> keypoints;
+      cv::Mat descriptors;
+      report.measure("surf_detect", inputs[i].first, parameters("pixels", image.total()), 1, [&] {
+         detector.detect(image, keypoints);
+      });
+      vector<cv::KeyPoint> detected = keypoints;
+      report.measure("surf_compute", inputs[i].first, parameters("keypoints", detected.size()),
+            detected.size(), [&] {
+         keypoints = detected;
+         extractor.compute(image, keypoints, descriptors);
+      });
+
+      for (int j = 0; j < sizeof(names) / sizeof(names[0]); j++) {
+         cv::Ptr<feature_extractor> features = feature_extractor::create(names[j]);
+         report.measure(string("extract_") + names[j], inputs[i].first,
+               parameters("pixels", image.total()), 1, [&] {
+            features->extract(image, keypoints, descriptors);
+         });
+      }
+   }
+}
+
+/**
+ * Runs the feature pipeline over every photo without a cache, with an empty
+ * cache, and with a cache that already holds all of their features
+ */
+void benchmark_pipeline(const benchmark_report &report, const list<string> &photos) {
+   if (photos.empty()) return;
+   vector<string> files(photos.begin(), photos.end());
+   boost::filesystem::path directory =
+      boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+
+   feature_pipeline plain;
+   feature_pipeline::settings settings;
+   settings.cache_directory = directory.string();
+   feature_pipeline cached(settings);
+
+   report.measure("pipeline", "photos", "cache=none", files.size(), [&] {
+      plain.run(files);
+   });
+   report.measure("pipeline", "photos", "cache=cold", files.size(), [&] {
+      boost::filesystem::remove_all(directory);
+      cached.run(files);
+   });
+   report.measure("pipeline", "photos", "cache=warm", files.size(), [&] {
+      cached.run(files);
+   });
+   boost::filesystem::remove_all(directory);
+}
+
+/**
+ * Finds the nearest visual word of every descriptor with an exact scan
+ * @param[in]  vocab        the vocabulary
+ * @param[in]  descriptors  the descriptors, one per row
+ * @return  the index of the nearest word of each descriptor
+ */
+vector<int> nearest_words(const visual_vocabulary &vocab, const cv::Mat &descriptors) {
+   vector<int> words(descriptors.rows);
+   for (int i = 0; i < descriptors.rows; i++) {
+      const float *point = descriptors.ptr<float>(i);
+      float nearest = numeric_limits<float>::infinity();
+      for (int word = 0; word < vocab.centroids.rows; word++) {
+         const float *centroid = vocab.centroids.ptr<float>(word);
+         float distance = 0;
+         for (int j = 0; j < descriptors.cols; j++) {
+            distance += (point[j] - centroid[j]) * (point[j] - centroid[j]);
+         }
+         if (distance < nearest) {
+            nearest = distance;
+            words[i] = word;
+         }
+      }
+   }
+   return words;
+}
+
+/**
+ * Clusters synthetic descriptors into vocabularies of every size with
+ * cv::kmeans and with the clustering the vocabulary uses, and encodes
+ * synthetic images against each of them, with and without an index over
+ * the vocabulary. The recall of the index is the fraction of descriptors
+ * it finds the same nearest word for as an exact scan.
+ *
+ * Vocabularies larger than exact_vocabulary_limit are trained with a few
+ * mini-batches over only as many descriptors as words, since exact k-means
+ * of that many words would take hours, and aren't clustered with
+ * cv::kmeans. Their words are then close to the descriptors k-means++ seeds
+ * them with, which is enough to time and measure the index against.
+ */
+void benchmark_vocabularies(const benchmark_report &report, const vector<int> &vocabulary_sizes,
+      const vector<int> &descriptor_counts, cv::RNG &rng) {
+   const cv::Size image_size(640, 480);
+   const int exact_vocabulary_limit = 1000;
+   cv::Mat queries = synthetic_descriptors(1000, rng);
+
+   for (int v = 0; v < vocabulary_sizes.size(); v++) {
+      visual_vocabulary::settings vv_settings;
+      vv_settings.size = vocabulary_sizes[v];
+
+      bool exact = vv_settings.size <= exact_vocabulary_limit;
+      cv::Mat training = synthetic_descriptors((exact ? 20 : 1) * vv_settings.size, rng);
+      string sweep = parameters("vocabulary", vv_settings.size, "descriptors", training.rows);
+      if (!exact) {
+         vv_settings.minibatch = true;
+         vv_settings.reservoir_size = training.rows;
+         vv_settings.batch_iterations = 10;
+         sweep += ";" + parameters("batches", vv_settings.batch_iterations);
+      }
+
+      visual_vocabulary vocab;
+      report.measure("kmeans", "synthetic", sweep, 1, [&] {
+         visual_vocabulary_factory vv_fact(vv_settings);
+         vv_fact.add_descriptors(training);
+         vocab = vv_fact.compute_visual_vocabulary();
+      });
+
+      // The same clustering as the vocabulary, with OpenCV's k-means
+      if (exact) {
+         cv::TermCriteria criteria(CV_TERMCRIT_ITER | CV_TERMCRIT_EPS, 100, 0.001);
+         report.measure("cv_kmeans", "synthetic",
+               parameters("vocabulary", vv_settings.size, "descriptors", training.rows), 1, [&] {
+            cv::Mat labels, centers;
+            cv::kmeans(training, vv_settings.size, labels, criteria, 5, cv::KMEANS_PP_CENTERS, centers);
+         });
+      }
+
+      visual_vocabulary indexed = vocab;
+      vocabulary_tree::settings tree_settings;
+      tree_settings.branching = 8;
+      tree_settings.checks = 64;
+      indexed.build_index(tree_settings);
+
+      vector<int> exact_words = nearest_words(vocab, queries);
+      int found = 0, word;
+      float distance;
+      for (int i = 0; i < queries.rows; i++) {
+         indexed.index.nearest(queries.ptr<float>(i), 1, &word, &distance);
+         found += word == exact_words[i];
+      }
+      report.recall("nearest_word", "synthetic", parameters("vocabulary", vv_settings.size)
+            + ";" + parameters("branching", tree_settings.branching, "checks", tree_settings.checks)
+            + ";index=tree", queries.rows, found);
+
+      bag_of_features bof;
+      bof.set_vocabulary(vocab);
+      for (int d = 0; d < descriptor_counts.size(); d++) {
+         vector<cv::KeyPoint> keypoints = synthetic_keypoints(descriptor_counts[d], image_size, rng);
+         cv::Mat descriptors = synthetic_descriptors(descriptor_counts[d], rng);
+
+         for (int soft = 0; soft < 2; soft++) {
+            for (int depth = 1; depth <= 3; depth++) {
+               struct bag_of_features::settings bof_settings;
+               bof_settings.soft_kernel = soft;
+               bof_settings.spatial_pyramid_depth = depth;
+               bof.set_settings(bof_settings);
+
+               string sweep = parameters("vocabulary", vv_settings.size, "descriptors", descriptors.rows)
+                     + (soft ? ";kernel=soft;" : ";kernel=hard;") + parameters("depth", depth);
+               report.measure("feature_vector", "synthetic", sweep, descriptors.rows, [&] {
+                  bof.feature_vector(keypoints, descriptors, image_size);
+               });
+            }
+         }
+
+         // Nearest words looked up through the index instead of a scan
+         bag_of_features indexed_bof;
+         indexed_bof.set_vocabulary(indexed);
+         string sweep = parameters("vocabulary", vv_settings.size, "descriptors", descriptors.rows)
+               + ";kernel=hard;depth=1;index=tree";
+         report.measure("feature_vector", "synthetic", sweep, descriptors.rows, [&] {
+            indexed_bof.feature_vector(keypoints, descriptors, image_size);
+         });
+      }
+   }
+}
+
+/**
+ * Adds synthetic feature vectors to classifiers of every training set size,
+ * then trains every backend and classifies a batch of queries with it, and
+ * with cv::KNearest for comparison
+ */
+void benchmark_classifiers(const benchmark_report &report, const vector<int> &training_sizes,
+      int dimensions, cv::RNG &rng) {
+   const int classes = 10, queries = 100;
+   cv::Mat query_rows(queries, dimensions, CV_32F);
+   rng.fill(query_rows, cv::RNG::UNIFORM, 0, 1);
+
+   for (int t = 0; t < training_sizes.size(); t++) {
+      vector<vector<double> > vectors(training_sizes[t], vector<double>(dimensions));
+      for (int i = 0; i < vectors.size(); i++) {
+         for (int j = 0; j < dimensions; j++) {
+            vectors[i][j] = rng.uniform(0., 1.);
+         }
+      }
+
+      report.measure("add_feature_vector", "synthetic",
+            parameters("samples", vectors.size(), "dimensions", dimensions), vectors.size(), [&] {
+         classifier_factory fact;
+         for (int i = 0; i < vectors.size(); i++) {
+            fact.add_feature_vector(vectors[i], i % classes);
+         }
+      });
+
+      classifier_factory fact;
+      for (int i = 0; i < vectors.size(); i++) {
+         fact.add_feature_vector(vectors[i], i % classes);
+      }
+
+      classifier::settings settings[3];
+      settings[1].index.connections = 8;
+      settings[1].index.search = 32;
+      settings[2].backend = classifier::settings::linear_svm_backend;
+      const char *backends[] = { "nearest_neighbor", "hnsw", "linear_svm" };
+      for (int b = 0; b < 3; b++) {
+         string sweep = parameters("samples", vectors.size(), "dimensions", dimensions)
+               + ";backend=" + backends[b];
+         classifier cls;
+         report.measure("train", "synthetic", sweep, vectors.size(), [&] {
+            cls = fact.create_classifier(settings[b]);
+         });
+         report.measure("classify", "synthetic", sweep, queries, [&] {
+            cls.classify(query_rows);
+         });
+      }
+
+      string sweep = parameters("samples", vectors.size(), "dimensions", dimensions)
+            + ";backend=cv_knearest";
+      cv::KNearest knn;
+      knn.train(fact.samples, fact.responses, cv::Mat(), false, settings[0].neighbors);
+      cv::Mat labels(queries, 1, CV_32F);
+      report.measure("classify", "synthetic", sweep, queries, [&] {
+         knn.find_nearest(query_rows, settings[0].neighbors, &labels);
+      });
+   }
+}
+
+/**
+ * Runs every benchmark over its sweep and prints the results as CSV. The
+ * photos are optional, without them only synthetic inputs are used.
+ */
+int main(int argc, char **argv) {
+   // A quick run uses smaller sweeps, for checking that nothing broke
+   bool quick = argc > 1 && string(argv[1]) == "--quick";
+   if (quick) {
+      argv[1] = argv[0];
+      argv++;
+      argc--;
+   }
+   if (argc > 2) { usage(argv[0]); return EXIT_FAILURE; }
+
+   list<string> photos;
+   if (argc == 2) photos = get_files_recursive(argv[1], ".png");
+
+   vector<int> vocabulary_sizes, descriptor_counts, training_sizes;
+   if (quick) {
+      vocabulary_sizes = { 50, 100 };
+      descriptor_counts = { 200 };
+      training_sizes = { 500 };
+   } else {
+      vocabulary_sizes = { 100, 500, 1000, 10000, 50000 };
+      descriptor_counts = { 100, 1000, 5000 };
+      training_sizes = { 1000, 10000 };
+   }
+
+   cv::RNG rng(1);
+   benchmark_report report(quick ? 0.05 : 0.5);
+   benchmark_images(report, photos, rng);
+   benchmark_pipeline(report, photos);
+   benchmark_vocabularies(report, vocabulary_sizes, descriptor_counts, rng);
+   benchmark_classifiers(report, training_sizes, 500, rng);
+   return 0;
+}
+
+// Display usage information
+void usage(const string &program) {
+   cout << "Usage: " << program << " [--quick] [path/to/photos]" << endl;
+}
@@ -9,16 +9,19 @@
  * as published by Sam Hocevar. See http://www.wtfpl.net/ for more details.
  */
 
+#include <cstdlib>
 #include <fstream>
+#include <functional>
 #include <map>
 #include <iostream>
 
 #include <opencv2/core/core.hpp> // Mat
 #include <opencv2/highgui/highgui.hpp> // imread
-#include <opencv2/nonfree/features2d.hpp> // SURF
 
 #include "cv/bag_of_features.h"
+#include "cv/feature_pipeline.h"
 #include "ml/classifier.h"
+#include "util/stage_stats.h"
 #include "files.hpp"
 
 using namespace std;
@@ -47,29 +50,27 @@ map<string, float> image::labels;
 float image::max_label = 0;
 
 /**
- * This function trains a classifier using a list of images and a list of image labels
+ * This function trains a classifier using the images in a directory, each
+ * one labeled with the name of the directory it is in
  */
-classifier generate_classifier(const visual_vocabulary &vocab, const list<image> &images) {
-   cv::SurfFeatureDetector detector(200);
-   cv::SurfDescriptorExtractor extractor;
-
-   vector<cv::KeyPoint> keypoints;
-   cv::Mat descriptors;
-
+classifier generate_classifier(const visual_vocabulary &vocab, const string &directory,
+      const feature_pipeline::settings &settings) {
    bag_of_features bof;
    bof.set_vocabulary(vocab);
 
+   feature_pipeline pipeline(settings);
+   pipeline.set_encoder(bof);
+
+   // Images are processed as the directory is walked, rather than after
+   file_walker files(directory, vector<string>(1, ".png"));
+
    classifier_factory fact;
-   // Compute features for each image and add to the descriptor list
-   for (list<image>::const_iterator image = images.begin(); image != images.end(); image++) {
-      cv::Mat grayscale_image = cv::imread(image->getFile(), CV_LOAD_IMAGE_GRAYSCALE);
-
-      detector.detect(grayscale_image, keypoints);
-      extractor.compute(grayscale_image, keypoints, descriptors);
-      std::vector<double> feature_vector = 
-       bof.feature_vector(keypoints, descriptors);
-      fact.add_feature_vector(feature_vector, image->getLabel());
-   }
+   // Compute the feature vector of each image and label it by its directory
+   pipeline.run(std::ref(files), [&](feature_pipeline::image_features &features) {
+      boost::filesystem::path p(features.file);
+      image labeled(features.file, p.parent_path().leaf().string());
+      fact.add_feature_vector(features.feature_vector, labeled.getLabel());
+   });
 
    classifier cls = fact.create_classifier();
    return cls;
@@ -82,39 +83,68 @@ classifier generate_classifier(const visual_vocabulary &vocab, const list<image>
  * vectors are each used to train a classifier.
  */ 
 int main(int argc, char **argv) {
-   if (argc < 3 || argc > 4) { usage(argv[0]); return 0; }
-
-   list<string> images = get_files_recursive(argv[1], ".png");
+   // Features can be cached between runs, images scaled down first, and
+   // another kind of feature used
+   feature_pipeline::settings settings;
+   string stats_format;
+   while (argc > 2) {
+      string option = argv[1];
+      if (option == "--cache") {
+         settings.cache_directory = argv[2];
+      } else if (option == "--max-size") {
+         settings.scaling.max_dimension = atoi(argv[2]);
+      } else if (option == "--features") {
+         settings.features = argv[2];
+      } else if (option == "--stride") {
+         settings.grid.stride = atoi(argv[2]);
+      } else if (option == "--stats") {
+         stats_format = argv[2];
+      } else {
+         break;
+      }
+      argv[2] = argv[0];
+      argv += 2;
+      argc -= 2;
+   }
 
-   // get the label for each image
-   list<image> image_categories;
-   for (list<string>::iterator im = images.begin(); im != images.end(); im++) {
-      boost::filesystem::path p(*im);
-      string label = p.parent_path().leaf().string();
-      image_categories.push_back(image(*im, label));
+   if (argc < 3 || argc > 4) { usage(argv[0]); return 0; }
+   if (!stats_format.empty() && stats_format != "json" && stats_format != "prometheus") {
+      usage(argv[0]);
+      return 0;
    }
 
-   // Load the visual vocabulary
+   // Load the visual vocabulary, either a binary model file or a text archive
    visual_vocabulary vocab;
-   std::fstream fs;
-   fs.open(argv[2], std::fstream::in);
-   boost::archive::text_iarchive ia(fs);
-   ia >> vocab;
+   if (model_file::is_model_file(argv[2])) {
+      vocab.load_binary(argv[2]);
+   } else {
+      std::fstream fs;
+      fs.open(argv[2], std::fstream::in);
+      boost::archive::text_iarchive ia(fs);
+      ia >> vocab;
+   }
 
    // Create the classifier
-   classifier cls = generate_classifier(vocab, image_categories);
+   classifier cls = generate_classifier(vocab, argv[1], settings);
 
-   // Save the classifier
+   // Save the classifier, as a binary model file if it ends in .bin
    if (argc > 3) {
-      std::fstream fs;
-      fs.open(argv[3], std::fstream::out);
-      boost::archive::text_oarchive oa(fs);
-      oa << cls;
+      if (boost::filesystem::extension(argv[3]) == ".bin") {
+         cls.save_binary(argv[3]);
+      } else {
+         std::fstream fs;
+         fs.open(argv[3], std::fstream::out);
+         boost::archive::text_oarchive oa(fs);
+         oa << cls;
+      }
    }
+
+   // Report where the time went
+   if (!stats_format.empty()) cerr << stage_stats::dump(stats_format);
 }
 
 // Display usage information
 void usage(const string &program) {
-   cout << "Usage: " << program << " path/to/images vocab.vv [classifier.cls]" << endl;
+   cout << "Usage: " << program << " [--cache directory] [--max-size pixels] [--features surf|orb|brisk|dense-surf|dense-brisk] [--stride pixels] [--stats json|prometheus] path/to/images vocab.vv|vocab.bin [classifier.cls|classifier.bin]" << endl;
 }
 
@@ -9,16 +9,32 @@
  * as published by Sam Hocevar. See http://www.wtfpl.net/ for more details.
  */
 
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <map>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include <opencv2/core/core.hpp> // Mat
 #include <opencv2/highgui/highgui.hpp> // imread
-#include <opencv2/nonfree/features2d.hpp> // SURF
 
 #include "cv/bag_of_features.h"
+#include "cv/feature_pipeline.h"
+#include "ml/batch_classifier.h"
 #include "ml/classifier.h"
+#include "util/bounded_queue.h"
+#include "util/stage_stats.h"
 
 #include "files.hpp"
 
@@ -26,49 +42,294 @@ using namespace std;
 
 void usage(const string &program);
 
-float classify_image(const string &image, const visual_vocabulary &vocab, const classifier &cls) {
-   cv::SurfFeatureDetector detector(200);
-   cv::SurfDescriptorExtractor extractor;
+/**
+ * Loads the visual vocabulary and the classifier, each either a binary model
+ * file or a text archive, and sets them up to classify batches of images
+ */
+batch_classifier load_models(const string &vocab_file, const string &cls_file,
+      const feature_pipeline::settings &settings) {
+   visual_vocabulary vocab;
+   if (model_file::is_model_file(vocab_file)) {
+      vocab.load_binary(vocab_file);
+   } else {
+      std::fstream fs;
+      fs.open(vocab_file.c_str(), std::fstream::in);
+      boost::archive::text_iarchive ia(fs);
+      ia >> vocab;
+   }
 
-   vector<cv::KeyPoint> keypoints;
-   cv::Mat descriptors;
+   classifier cls;
+   if (model_file::is_model_file(cls_file)) {
+      cls.load_binary(cls_file);
+   } else {
+      std::fstream fs_cls;
+      fs_cls.open(cls_file.c_str(), std::fstream::in);
+      boost::archive::text_iarchive ia_cls(fs_cls);
+      ia_cls >> cls;
+   }
 
    bag_of_features bof;
    bof.set_vocabulary(vocab);
+   return batch_classifier(bof, cls, settings);
+}
+
+/**
+ * Where the answers to requests are written. Every request from the same
+ * client shares one, and a socket is closed once its last request is answered.
+ */
+class client {
+   int fd;
+   bool owned;
+   mutex lock;
 
-   classifier_factory fact;
+   public:
+   client(int fd, bool owned) : fd(fd), owned(owned) { }
+   ~client() { if (owned) close(fd); }
 
-   cv::Mat grayscale_image = cv::imread(image, CV_LOAD_IMAGE_GRAYSCALE);
+   void reply(const string &line) {
+      lock_guard<mutex> guard(lock);
+      string text = line + "\n";
+      for (size_t sent = 0; sent < text.size(); ) {
+         ssize_t written = write(fd, text.data() + sent, text.size() - sent);
+         if (written < 0 && errno == EINTR) continue;
+         if (written <= 0) return;
+         sent += written;
+      }
+   }
+};
 
-   detector.detect(grayscale_image, keypoints);
-   extractor.compute(grayscale_image, keypoints, descriptors);
+struct request {
+   string file;
+   int64 received;
+   shared_ptr<client> from;
+};
 
-   return cls.classify(bof.mat_feature_vector(keypoints, descriptors))[0];
+/**
+ * Reads newline separated image paths from a file descriptor and queues them
+ * @param[in]  fd        where the paths are read from
+ * @param[in]  from      where the answers go
+ * @param[in]  requests  the queue of pending requests
+ */
+void read_requests(int fd, shared_ptr<client> from, bounded_queue<request> &requests) {
+   string line;
+   char buffer[4096];
+   ssize_t count;
+   while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+      for (ssize_t i = 0; i < count; i++) {
+         if (buffer[i] != '\n') {
+            line += buffer[i];
+            continue;
+         }
+         if (!line.empty()) {
+            request r = { line, cv::getTickCount(), from };
+            if (!requests.push(std::move(r))) return;
+         }
+         line.clear();
+      }
+   }
+   if (!line.empty()) {
+      request r = { line, cv::getTickCount(), from };
+      requests.push(std::move(r));
+   }
+}
+
+/**
+ * Accepts connections on a Unix socket forever, each of them sending image
+ * paths and receiving the answers
+ */
+void listen_for_requests(const string &path, bounded_queue<request> &requests) {
+   int server = socket(AF_UNIX, SOCK_STREAM, 0);
+   sockaddr_un address;
+   memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+   unlink(path.c_str());
+   if (server < 0 || ::bind(server, (sockaddr *)&address, sizeof(address)) != 0 || listen(server, 16) != 0) {
+      throw std::runtime_error("Could not listen on socket: " + path);
+   }
+
+   int connection;
+   while ((connection = accept(server, NULL, NULL)) >= 0) {
+      shared_ptr<client> from = make_shared<client>(connection, true);
+      thread([connection, from, &requests] {
+         read_requests(connection, from, requests);
+      }).detach();
+   }
+}
+
+/**
+ * Whether a request is for the stage statistics instead of an image, when
+ * they were asked for
+ * @param[in]  r             the request
+ * @param[in]  stats_format  the format of the statistics, empty if disabled
+ */
+bool stats_request(const request &r, const string &stats_format) {
+   return !stats_format.empty() && r.file == "stats";
+}
+
+/**
+ * Answers requests until the queue is closed. Their images go through one
+ * feature pipeline that stays up the whole time, and whatever images it has
+ * finished are classified together with one call. Each answer is the image
+ * path, its label, and the milliseconds since the request arrived.
+ */
+void serve(bounded_queue<request> &requests, const batch_classifier &models,
+      int batch_size, const string &stats_format) {
+   // The requests not answered yet, in the order they came in. Requests for
+   // statistics don't go through the pipeline, but wait here for the ones
+   // before them so every client gets its answers in order. Answers are
+   // written with the lock held for the same reason.
+   mutex in_flight_lock;
+   deque<request> in_flight;
+
+   // Answers the requests for statistics at the front, with the lock held
+   auto answer_stats = [&] {
+      while (!in_flight.empty() && stats_request(in_flight.front(), stats_format)) {
+         string dump = stage_stats::dump(stats_format);
+         in_flight.front().from->reply(dump.substr(0, dump.size() - 1));
+         in_flight.pop_front();
+      }
+   };
+
+   auto next_file = [&](string &file) {
+      request r;
+      while (requests.pop(r)) {
+         lock_guard<mutex> guard(in_flight_lock);
+         bool stats = stats_request(r, stats_format);
+         in_flight.push_back(std::move(r));
+         if (stats) {
+            answer_stats();
+            continue;
+         }
+         file = in_flight.back().file;
+         return true;
+      }
+      return false;
+   };
+
+   // Images that could not be read are answered with an error instead of
+   // a label
+   auto answer = [&](bool classified, float label) {
+      lock_guard<mutex> guard(in_flight_lock);
+      const request &r = in_flight.front();
+      ostringstream line;
+      line << r.file << " ";
+      if (classified) {
+         line << label;
+      } else {
+         line << "error";
+      }
+      line << " " << (cv::getTickCount() - r.received) * 1000. / cv::getTickFrequency();
+      r.from->reply(line.str());
+      in_flight.pop_front();
+      answer_stats();
+   };
+
+   // A failure shuts the pipeline down, so the requests still in it are
+   // answered with an error and it is started again
+   for (;;) {
+      try {
+         models.classify(next_file, [&](const string &, bool classified, float label) {
+            answer(classified, label);
+         }, batch_size);
+         return;
+      } catch (const exception &e) {
+         cerr << e.what() << endl;
+      }
+      for (;;) {
+         {
+            lock_guard<mutex> guard(in_flight_lock);
+            if (in_flight.empty()) break;
+         }
+         answer(false, 0);
+      }
+   }
 }
 
 
 int main(int argc, char **argv) {
-   if (argc != 4) { usage(argv[0]); return 0; }
+   // Images should be scaled and described the same way as the ones the
+   // classifier was trained on
+   feature_pipeline::settings settings;
+   string stats_format;
+   while (argc > 2) {
+      string option = argv[1];
+      if (option == "--max-size") {
+         settings.scaling.max_dimension = atoi(argv[2]);
+      } else if (option == "--features") {
+         settings.features = argv[2];
+      } else if (option == "--stride") {
+         settings.grid.stride = atoi(argv[2]);
+      } else if (option == "--stats") {
+         stats_format = argv[2];
+      } else {
+         break;
+      }
+      argv[2] = argv[0];
+      argv += 2;
+      argc -= 2;
+   }
 
-   // Load the visual vocabulary
-   visual_vocabulary vocab;
-   std::fstream fs;
-   fs.open(argv[2], std::fstream::in);
-   boost::archive::text_iarchive ia(fs);
-   ia >> vocab;
+   if (argc < 4 || argc > 5) { usage(argv[0]); return 0; }
+   if (!stats_format.empty() && stats_format != "json" && stats_format != "prometheus") {
+      usage(argv[0]);
+      return 0;
+   }
 
-   // Load the classifier
-   classifier cls;
-   std::fstream fs_cls;
-   fs_cls.open(argv[3], std::fstream::in);
-   boost::archive::text_iarchive ia_cls(fs_cls);
-   ia_cls >> cls;
+   string mode = argv[1];
+   if (mode != "--serve") {
+      if (argc != 4) { usage(argv[0]); return 0; }
+
+      batch_classifier models = load_models(argv[2], argv[3], settings);
+      batch_classifier::result result = models.classify(vector<string>(1, argv[1]));
+      if (!stats_format.empty()) cerr << stage_stats::dump(stats_format);
+      if (!result.classified[0]) {
+         cerr << "Could not read image: " << argv[1] << endl;
+         return EXIT_FAILURE;
+      }
+
+      std::cout << result.labels[0] << std::endl;
+      return 0;
+   }
+
+   // Load the models once and answer requests until stdin is closed, or
+   // forever when listening on a socket. A client that goes away before its
+   // answer is written only fails that write instead of killing the server.
+   signal(SIGPIPE, SIG_IGN);
+   batch_classifier models = load_models(argv[2], argv[3], settings);
+
+   const int batch_size = 32;
+   bounded_queue<request> requests(4 * batch_size);
+
+   thread reader;
+   if (argc == 5) {
+      reader = thread([&] {
+         try {
+            listen_for_requests(argv[4], requests);
+         } catch (const exception &e) {
+            cerr << e.what() << endl;
+         }
+         requests.close();
+      });
+   } else {
+      reader = thread([&] {
+         read_requests(STDIN_FILENO, make_shared<client>(STDOUT_FILENO, false), requests);
+         requests.close();
+      });
+   }
 
-   std::cout << classify_image(argv[1], vocab, cls) << std::endl;
+   serve(requests, models, batch_size, stats_format);
+   reader.join();
+   if (!stats_format.empty()) cerr << stage_stats::dump(stats_format);
 }
 
 // Display usage information
 void usage(const string &program) {
-   cout << "Usage: " << program << " path/to/image vocab.vv classifier.cls" << endl;
+   cout << "Usage: " << program << " [--max-size pixels] [--features surf|orb|brisk|dense-surf|dense-brisk] [--stride pixels] [--stats json|prometheus] path/to/image vocab.vv|vocab.bin classifier.cls|classifier.bin" << endl;
+   cout << "       " << program << " [--max-size pixels] [--features surf|orb|brisk|dense-surf|dense-brisk] [--stride pixels] [--stats json|prometheus] --serve vocab.vv|vocab.bin classifier.cls|classifier.bin [socket]" << endl;
+   cout << "Serving reads one image path per line from stdin, or from each" << endl;
+   cout << "connection to the Unix socket, and answers each with a line of" << endl;
+   cout << "\"path label milliseconds\". With --stats, a line of \"stats\" is" << endl;
+   cout << "answered with the time spent in each stage so far." << endl;
 }
 
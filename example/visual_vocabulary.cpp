@@ -9,13 +9,16 @@
  * as published by Sam Hocevar. See http://www.wtfpl.net/ for more details.
  */
 
+#include <cstdlib>
 #include <fstream>
+#include <functional>
 
 #include <opencv2/core/core.hpp> // Mat
 #include <opencv2/highgui/highgui.hpp> // imread
-#include <opencv2/nonfree/features2d.hpp> // SURF
 
+#include "cv/feature_pipeline.h"
 #include "cv/visual_vocabulary.h"
+#include "util/stage_stats.h"
 #include "files.hpp"
 
 using namespace std;
@@ -28,43 +31,79 @@ void usage(const string &program);
  * compiled into a visual vocabulary.
  */
 int main(int argc, char **argv) {
+   // Images can be scaled down before their features are computed, and
+   // another kind of feature used
+   feature_pipeline::settings settings;
+   visual_vocabulary::settings vocabulary_settings;
+   string stats_format;
+   while (argc > 2) {
+      string option = argv[1];
+      if (option == "--minibatch") {
+         // The only option without a value
+         vocabulary_settings.minibatch = true;
+         argv[1] = argv[0];
+         argv++;
+         argc--;
+         continue;
+      } else if (option == "--reservoir") {
+         vocabulary_settings.reservoir_size = atoi(argv[2]);
+      } else if (option == "--max-size") {
+         settings.scaling.max_dimension = atoi(argv[2]);
+      } else if (option == "--features") {
+         settings.features = argv[2];
+      } else if (option == "--stride") {
+         settings.grid.stride = atoi(argv[2]);
+      } else if (option == "--stats") {
+         stats_format = argv[2];
+      } else {
+         break;
+      }
+      argv[2] = argv[0];
+      argv += 2;
+      argc -= 2;
+   }
+
    if (argc < 2 || argc > 3) { usage(argv[0]); return 0; }
+   if (!stats_format.empty() && stats_format != "json" && stats_format != "prometheus") {
+      usage(argv[0]);
+      return 0;
+   }
 
-   // Get all files in directory recursively
-   list<string> images = get_files_recursive(argv[1], ".png");
+   // Images are processed as the directory is walked, rather than after
+   file_walker files(argv[1], vector<string>(1, ".png"));
    
-   visual_vocabulary_factory vv_fact; 
-   cv::SurfFeatureDetector detector(200);
-   cv::SurfDescriptorExtractor extractor;
-
-   vector<cv::KeyPoint> keypoints;
-   cv::Mat descriptors;
+   // With --minibatch only a bounded sample of the descriptors is kept
+   visual_vocabulary_factory vv_fact(vocabulary_settings);
+   feature_pipeline pipeline(settings);
 
    // Compute features for each image and add to the descriptor list
-   for (list<string>::iterator image = images.begin(); image != images.end(); image++) {
-      cv::Mat grayscale_image = cv::imread(*image, CV_LOAD_IMAGE_GRAYSCALE);
-
-      detector.detect(grayscale_image, keypoints);
-      extractor.compute(grayscale_image, keypoints, descriptors);
-      vv_fact.add_descriptors(descriptors);
-   }
+   pipeline.run(std::ref(files), [&vv_fact](feature_pipeline::image_features &image) {
+      vv_fact.add_descriptors(image.descriptors);
+   });
 
    // Generate a visual vocabulary
-   visual_vocabulary vocab = vv_fact.compute_visual_vocabulary(visual_vocabulary::settings());
+   visual_vocabulary vocab = vv_fact.compute_visual_vocabulary();
 
-   // Save the visual vocabulary
+   // Save the visual vocabulary, as a binary model file if it ends in .bin
    if (argc > 2) {
-      std::fstream fs;
-      fs.open(argv[2], std::fstream::out);
-
-      boost::archive::text_oarchive oa(fs);
-      oa << vocab;
+      if (boost::filesystem::extension(argv[2]) == ".bin") {
+         vocab.save_binary(argv[2]);
+      } else {
+         std::fstream fs;
+         fs.open(argv[2], std::fstream::out);
+
+         boost::archive::text_oarchive oa(fs);
+         oa << vocab;
+      }
    }
+
+   // Report where the time went
+   if (!stats_format.empty()) cerr << stage_stats::dump(stats_format);
 }
 
 
 // Display usage information
 void usage(const string &program) {
-   cout << "Usage: " << program << " path/to/images [output.vv]" << endl;
+   cout << "Usage: " << program << " [--minibatch] [--reservoir descriptors] [--max-size pixels] [--features surf|orb|brisk|dense-surf|dense-brisk] [--stride pixels] [--stats json|prometheus] path/to/images [output.vv|output.bin]" << endl;
 }
 
@@ -1,108 +1,522 @@
 #include "bag_of_features.h"
 
+#include <algorithm>
+#include <utility>
+
 #include <opencv2/core/core.hpp>
 
+#include "../util/fast_exp.h"
+#include "../util/hamming.h"
+#include "../util/hash.h"
+#include "../util/stage_stats.h"
+
 using namespace std;
 
+// Number of descriptors whose distances to the vocabulary are computed at
+// once. Small enough that a block of distances stays in cache while it is
+// turned into histogram contributions.
+static const int assignment_block_size = 256;
+
+// Version of the computation of feature vectors, part of their hash. Raise it
+// whenever the same settings and vocabulary start giving different vectors,
+// so vectors cached by an older version aren't reused. Version 2 computes
+// the soft kernel weights in single precision.
+static const int encoder_version = 2;
+
 /**
- * Computes soft assignment of a descriptor to the visual vocabulary
- * @param[in]  point  the descriptor for which to calculate the bag of features
- * @param[in]  vocab  the visual vocabulary to use for the bag of features
+ * Computes the squared distance from each descriptor to each visual word
+ * using ||a||^2 + ||b||^2 - 2ab so that the bulk of the work is one matrix
+ * multiplication instead of a norm per descriptor and word. Binary
+ * descriptors are compared with a popcount instead.
+ * @param[in]  descriptors  a block of row-descriptors
+ * @param[out] distances    one row per descriptor, one column per visual word
  */
-cv::Mat bag_of_features::soft_assign(const cv::Mat &point) const {
-   assert(point.cols == vocabulary.centroids.cols);
+void bag_of_features::squared_distances(const cv::Mat &descriptors, cv::Mat &distances) const {
+   assert(descriptors.cols == vocabulary.centroids.cols);
 
-   cv::Mat feature_weights(1, vocabulary.centroids.rows, CV_64F);  
+   if (vocabulary.binary()) {
+      const cv::Mat &words = vocabulary.centroids;
+      const float scale = 1.f / (8 * words.cols);
+      distances.create(descriptors.rows, words.rows, CV_32F);
+      for (int feature_num = 0; feature_num < descriptors.rows; feature_num++) {
+         const uchar *point = descriptors.ptr(feature_num);
+         float *row = distances.ptr<float>(feature_num);
+         for (int cluster_num = 0; cluster_num < words.rows; cluster_num++) {
+            row[cluster_num] = hamming_distance(point, words.ptr(cluster_num), words.cols) * scale;
+         }
+      }
+      return;
+   }
 
-   // Calculate the contribution of this feature to each of the visual word counts
-   for (int cluster_num = 0; cluster_num < vocabulary.centroids.rows; cluster_num++) {
+   cv::gemm(descriptors, vocabulary.centroids, -2.0, cv::Mat(), 0.0, distances, cv::GEMM_2_T);
+
+   const float *centroid_norms = vocabulary.centroid_norms.ptr<float>(0);
+   for (int feature_num = 0; feature_num < distances.rows; feature_num++) {
+      const float *point = descriptors.ptr<float>(feature_num);
+      float point_norm = 0;
+      for (int i = 0; i < descriptors.cols; i++) {
+         point_norm += point[i] * point[i];
+      }
 
-      // Weight neighbor value with gaussian kernel function for soft kernel
-      double distance = cv::norm(point, vocabulary.centroids.row(cluster_num));
+      // Rounding can push the distance of near duplicates slightly negative
+      float *row = distances.ptr<float>(feature_num);
+      for (int cluster_num = 0; cluster_num < distances.cols; cluster_num++) {
+         row[cluster_num] = std::max(row[cluster_num] + point_norm + centroid_norms[cluster_num], 0.f);
+      }
+   }
+}
 
-      double inv_sigma_squared = 1.f / settings.kernel_distance_squared;
-      double gaussian = exp(-pow(distance, 2.0) * inv_sigma_squared);
+/**
+ * Computes soft assignment of a descriptor to the visual vocabulary. The
+ * kernel is taken relative to the nearest word, which cancels out once the
+ * weights are normalized but keeps the nearest word at a weight of one, so
+ * the weights can't all underflow to zero. Each step is a loop of its own
+ * without branches or calls, so the compiler can vectorize it.
+ * @param[in]  distances     squared distances from the descriptor to the visual words
+ * @param[in]  count         the number of visual words
+ * @param[in]  kernel_scale  the factor of the squared distances in the exponent
+ * @param[out] weights       the weight of each visual word, summing to one
+ */
+void bag_of_features::soft_assign(const float *distances, int count, float kernel_scale,
+      float *weights) const {
+   if (count == 0) return;
+   float nearest = *std::min_element(distances, distances + count);
 
-      // Add neighbor to weights list
-      feature_weights.at<double>(0, cluster_num) = gaussian;
+   // Weight each visual word with gaussian kernel function for soft kernel
+   for (int i = 0; i < count; i++) {
+      weights[i] = std::max((distances[i] - nearest) * kernel_scale, fast_exp_min);
+   }
+   for (int i = 0; i < count; i++) {
+      weights[i] = fast_exp(weights[i]);
    }
 
    // Make sure the weight contributed by each feature is equivalent for soft kernel
-   cv::normalize(feature_weights, feature_weights, feature_weights.cols, cv::NORM_L1);
-
-   return feature_weights;
+   float total_weight = 0;
+   for (int i = 0; i < count; i++) {
+      total_weight += weights[i];
+   }
+   float scale = 1 / total_weight;
+   for (int i = 0; i < count; i++) {
+      weights[i] *= scale;
+   }
 }
 
 /**
  * Computes hard assignment of a descriptor to the visual vocabulary
- * @param[in]  point  the descriptor for which to calculate the bag of features
- * @param[in]  vocab  the visual vocabulary to use for the bag of features
+ * @param[in]  distances  squared distances from the descriptor to each visual word
+ * @return  the nearest visual word
  */
-cv::Mat bag_of_features::hard_assign(const cv::Mat &point) const {
-   assert(point.cols == vocabulary.centroids.cols);
+int bag_of_features::hard_assign(const float *distances) const {
+   const int words = vocabulary.centroids.rows;
 
-   cv::Mat feature_weights = cv::Mat::zeros(1, vocabulary.centroids.rows, CV_32F);  
    int smallest_index = 0;
-   double smallest_distance = numeric_limits<double>::infinity();
+   float smallest_distance = distances[0];
+   for (int cluster_num = 1; cluster_num < words; cluster_num++) {
+      if (distances[cluster_num] < smallest_distance) {
+         smallest_distance = distances[cluster_num];
+         smallest_index = cluster_num;
+      }
+   }
+   return smallest_index;
+}
 
-   // Calculate the contribution of this feature to each of the visual word counts
-   for (int cluster_num = 0; cluster_num < vocabulary.centroids.rows; cluster_num++) {
+/**
+ * Finds the nearest visual words of a descriptor, for soft assignment that
+ * is constrained to them. Equally distant words are taken in order.
+ * @param[in]  distances  squared distances from the descriptor to each visual word
+ * @param[in]  k          the number of words to find
+ * @param[out] words      the nearest words, nearest first
+ * @param[out] nearest    the distance of each of them
+ * @return  the number of words found, k unless the vocabulary is smaller
+ */
+int bag_of_features::nearest_words(const float *distances, int k, int *words, float *nearest) const {
+   const int count = vocabulary.centroids.rows;
 
-      // Weight neighbor value with gaussian kernel function for soft kernel
-      double distance = cv::norm(point, vocabulary.centroids.row(cluster_num));
-      if (distance < smallest_distance) {
-         smallest_distance = distance;
-         smallest_index = cluster_num;
+   // Insertion into the sorted list of the best so far, which most words
+   // are too far away to enter
+   int found = 0;
+   for (int cluster_num = 0; cluster_num < count; cluster_num++) {
+      float distance = distances[cluster_num];
+      if (found == k && distance >= nearest[k - 1]) continue;
+
+      int i = found < k ? found++ : k - 1;
+      for (; i > 0 && nearest[i - 1] > distance; i--) {
+         nearest[i] = nearest[i - 1];
+         words[i] = words[i - 1];
       }
+      nearest[i] = distance;
+      words[i] = cluster_num;
    }
+   return found;
+}
 
-   // Add neighbor to weights list
-   feature_weights.at<double>(0, smallest_index) = 1;
+/**
+ * Adds the contribution of each descriptor to the histogram by comparing it
+ * against every visual word. Soft assignment weights every word, or only the
+ * soft_neighbors nearest ones when it is set.
+ * @param[in]     descriptors    a list of row-descriptors
+ * @param[in]     cells          the pyramid cell offsets of each descriptor
+ * @param[in]     level_weights  the weight of each pyramid level
+ * @param[in,out] histogram      the histogram the descriptors contribute to
+ */
+void bag_of_features::exact_assign(const cv::Mat &descriptors, const vector<int> &cells,
+      const vector<double> &level_weights, double *histogram) const {
+   const int words = vocabulary.centroids.rows;
+   const int levels = level_weights.size();
+   const float scale = kernel_scale();
 
-   return feature_weights;
+   // Only the nearest words are weighted when the assignment is constrained
+   const int constrained = settings.soft_kernel && settings.soft_neighbors > 0
+         ? std::min(settings.soft_neighbors, words) : 0;
+   vector<float> weights(settings.soft_kernel ? words : 0), nearest(constrained);
+   vector<int> nearest_word(constrained);
+   cv::Mat distances;
+   for (int block_start = 0; block_start < descriptors.rows; block_start += assignment_block_size) {
+      int block_end = std::min(block_start + assignment_block_size, descriptors.rows);
+      squared_distances(descriptors.rowRange(block_start, block_end), distances);
+
+      for (int feature_num = 0; feature_num < distances.rows; feature_num++) {
+         const int *feature_cells = &cells[(block_start + feature_num) * levels];
+
+         if (constrained) {
+            int found = nearest_words(distances.ptr<float>(feature_num), constrained,
+                  &nearest_word[0], &nearest[0]);
+            soft_assign(&nearest[0], found, scale, &weights[0]);
+            for (int level = 0; level < levels; level++) {
+               double *cell = histogram + feature_cells[level];
+               for (int i = 0; i < found; i++) {
+                  cell[nearest_word[i]] += level_weights[level] * weights[i];
+               }
+            }
+         } else if (settings.soft_kernel) {
+            soft_assign(distances.ptr<float>(feature_num), words, scale, &weights[0]);
+            for (int level = 0; level < levels; level++) {
+               double *cell = histogram + feature_cells[level];
+               for (int cluster_num = 0; cluster_num < words; cluster_num++) {
+                  cell[cluster_num] += level_weights[level] * weights[cluster_num];
+               }
+            }
+         } else {
+            int word = hard_assign(distances.ptr<float>(feature_num));
+            for (int level = 0; level < levels; level++) {
+               histogram[feature_cells[level] + word] += level_weights[level];
+            }
+         }
+      }
+   }
+}
+
+/**
+ * Adds the contribution of each descriptor to the histogram using the
+ * vocabulary index instead of comparing against every visual word
+ * @param[in]     descriptors    a list of row-descriptors
+ * @param[in]     cells          the pyramid cell offsets of each descriptor
+ * @param[in]     level_weights  the weight of each pyramid level
+ * @param[in,out] histogram      the histogram the descriptors contribute to
+ */
+void bag_of_features::indexed_assign(const cv::Mat &descriptors, const vector<int> &cells,
+      const vector<double> &level_weights, double *histogram) const {
+   const int levels = level_weights.size();
+
+   int count = 1;
+   if (settings.soft_kernel) {
+      count = settings.soft_neighbors > 0 ? settings.soft_neighbors
+                                          : vocabulary.index.get_settings().checks;
+   }
+
+   const float scale = kernel_scale();
+   vector<int> words(count);
+   vector<float> distances(count);
+   vector<float> weights(count, 1.f);
+   for (int feature_num = 0; feature_num < descriptors.rows; feature_num++) {
+      int found = vocabulary.index.nearest(descriptors.ptr<float>(feature_num),
+            count, &words[0], &distances[0]);
+      if (settings.soft_kernel) {
+         soft_assign(&distances[0], found, scale, &weights[0]);
+      }
+
+      const int *feature_cells = &cells[feature_num * levels];
+      for (int level = 0; level < levels; level++) {
+         double *cell = histogram + feature_cells[level];
+         for (int i = 0; i < found; i++) {
+            cell[words[i]] += level_weights[level] * weights[i];
+         }
+      }
+   }
+}
+
+/**
+ * Lists the contribution of each descriptor to the histogram, for hard
+ * assignment or for soft assignment through the vocabulary index or to the
+ * soft_neighbors nearest words, all of which only touch a few visual words
+ * per descriptor
+ * @param[in]  descriptors    a list of row-descriptors
+ * @param[in]  cells          the pyramid cell offsets of each descriptor
+ * @param[in]  level_weights  the weight of each pyramid level
+ * @param[out] contributions  the histogram bin and weight of every contribution
+ */
+void bag_of_features::sparse_assign(const cv::Mat &descriptors, const vector<int> &cells,
+      const vector<double> &level_weights, vector<pair<int, double> > &contributions) const {
+   assert(!settings.soft_kernel || !vocabulary.index.empty() || settings.soft_neighbors > 0);
+   const int levels = level_weights.size();
+   const float scale = kernel_scale();
+
+   int count = 1;
+   if (settings.soft_kernel) {
+      count = settings.soft_neighbors > 0 ? settings.soft_neighbors
+                                          : vocabulary.index.get_settings().checks;
+   }
+
+   vector<int> words(count);
+   vector<float> distances(count);
+   vector<float> weights(count, 1.f);
+   cv::Mat block_distances;
+   contributions.clear();
+   contributions.reserve(descriptors.rows * levels * count);
+   for (int feature_num = 0; feature_num < descriptors.rows; feature_num++) {
+      int found = 1;
+      if (!vocabulary.index.empty()) {
+         found = vocabulary.index.nearest(descriptors.ptr<float>(feature_num),
+               count, &words[0], &distances[0]);
+         if (settings.soft_kernel) {
+            soft_assign(&distances[0], found, scale, &weights[0]);
+         }
+      } else {
+         int block_row = feature_num % assignment_block_size;
+         if (block_row == 0) {
+            int block_end = std::min(feature_num + assignment_block_size, descriptors.rows);
+            squared_distances(descriptors.rowRange(feature_num, block_end), block_distances);
+         }
+         if (settings.soft_kernel) {
+            found = nearest_words(block_distances.ptr<float>(block_row), count, &words[0], &distances[0]);
+            soft_assign(&distances[0], found, scale, &weights[0]);
+         } else {
+            words[0] = hard_assign(block_distances.ptr<float>(block_row));
+         }
+      }
+
+      const int *feature_cells = &cells[feature_num * levels];
+      for (int level = 0; level < levels; level++) {
+         for (int i = 0; i < found; i++) {
+            contributions.push_back(make_pair(feature_cells[level] + words[i],
+                     level_weights[level] * weights[i]));
+         }
+      }
+   }
 }
 
 /**
- * Computes the feature vector for a set of features
+ * Finds the cell each feature falls in at every level of the spatial pyramid
+ * @param[in]  features    the list of features
+ * @param[in]  image_size  the size of the image the features were found in
+ * @param[out] cells       for each feature and level, the histogram offset of its cell
+ */
+void bag_of_features::pyramid_cells(const vector<cv::KeyPoint> &features,
+      const cv::Size &image_size, vector<int> &cells) const {
+   const int words = vocabulary.centroids.rows;
+   const int levels = settings.spatial_pyramid_depth;
+
+   cells.resize(features.size() * levels);
+   for (int feature_num = 0; feature_num < features.size(); feature_num++) {
+      float x = features[feature_num].pt.x / std::max(image_size.width, 1);
+      float y = features[feature_num].pt.y / std::max(image_size.height, 1);
+
+      for (int level = 0; level < levels; level++) {
+         int side = pyramid_level_size(level);
+         int cell_x = std::min(std::max((int)(x * side), 0), side - 1);
+         int cell_y = std::min(std::max((int)(y * side), 0), side - 1);
+         cells[feature_num * levels + level] =
+            words * (pyramid_size(level) + cell_y * side + cell_x);
+      }
+   }
+}
+
+/**
+ * Computes the feature vector for a set of features. The spatial pyramid
+ * spans the extent of the features.
  * @param[in]  features      the list of features used to generate the descriptors
  * @param[in]  descriptors   a list of row-features to create a histogram for
- * @param[in]  vocab_list    a list of row-features to be used as the visual vocabulary
  * @return  a feature vector
  */
 vector<double> bag_of_features::feature_vector(const vector<cv::KeyPoint>
       &features, const cv::Mat &descriptors) const {
+   cv::Size extent(1, 1);
+   for (int i = 0; i < features.size(); i++) {
+      extent.width = std::max(extent.width, (int)features[i].pt.x + 1);
+      extent.height = std::max(extent.height, (int)features[i].pt.y + 1);
+   }
+   return feature_vector(features, descriptors, extent);
+}
+
+/**
+ * Computes the feature vector for a set of features. Each descriptor is
+ * assigned to the visual vocabulary once and that assignment is added to the
+ * cell containing the feature at every level of the spatial pyramid.
+ * @param[in]  features      the list of features used to generate the descriptors
+ * @param[in]  descriptors   a list of row-features to create a histogram for
+ * @param[in]  image_size    the size of the image the features were found in
+ * @return  a feature vector
+ */
+vector<double> bag_of_features::feature_vector(const vector<cv::KeyPoint>
+      &features, const cv::Mat &descriptors, const cv::Size &image_size) const {
 
    assert(descriptors.rows == features.size());
+   stage_timer timer("encode", descriptors.rows);
 
    // Create an empty histogram
    std::vector<double> image_histogram;
    image_histogram.resize(vocabulary.centroids.rows * pyramid_size(settings.spatial_pyramid_depth));
    std::fill(image_histogram.begin(), image_histogram.end(), 0);
 
-   // For each feature, add its contribution to the histogram
-   for (int feature_num = 0; feature_num < descriptors.rows; feature_num++) {
-      cv::Mat feature_weight = soft_assign(descriptors.row(feature_num));
+   std::vector<int> cells;
+   pyramid_cells(features, image_size, cells);
+
+   std::vector<double> level_weights(settings.spatial_pyramid_depth);
+   for (int level = 0; level < level_weights.size(); level++) {
+      level_weights[level] = pyramid_weight(level);
+   }
 
-      std::transform(feature_weight.begin<double>(),     // input 1
-            feature_weight.end<double>(),
-            image_histogram.begin(),                     // input 2
-            image_histogram.begin(),                     // output
-            std::plus<double>());                        // operator
+   cv::Mat points = descriptors;
+   if (descriptors.type() != CV_32F && !vocabulary.binary()) {
+      descriptors.convertTo(points, CV_32F);
    }
 
-   // TODO: Add contribution to each of the spatial histograms
+   // Add the contribution of each feature to the histogram
+   if (!vocabulary.index.empty()) {
+      indexed_assign(points, cells, level_weights, &image_histogram[0]);
+   } else {
+      exact_assign(points, cells, level_weights, &image_histogram[0]);
+   }
 
    cv::normalize(image_histogram, image_histogram, image_histogram.size(), cv::NORM_L1);
    return image_histogram;
 }
 
-cv::Mat bag_of_features::mat_feature_vector(const vector<cv::KeyPoint>
+/**
+ * Computes the sparse feature vector for a set of features. The spatial
+ * pyramid spans the extent of the features.
+ * @param[in]  features      the list of features used to generate the descriptors
+ * @param[in]  descriptors   a list of row-features to create a histogram for
+ * @return  the non-zero bins of the feature vector
+ */
+sparse_vector bag_of_features::sparse_feature_vector(const vector<cv::KeyPoint>
       &features, const cv::Mat &descriptors) const {
-   std::vector<double> fv(feature_vector(features, descriptors));
-   
+   cv::Size extent(1, 1);
+   for (int i = 0; i < features.size(); i++) {
+      extent.width = std::max(extent.width, (int)features[i].pt.x + 1);
+      extent.height = std::max(extent.height, (int)features[i].pt.y + 1);
+   }
+   return sparse_feature_vector(features, descriptors, extent);
+}
+
+/**
+ * Computes the non-zero bins of the feature vector. The contributions of the
+ * descriptors are sorted by bin and summed, so the cost and the memory grow
+ * with the number of descriptors instead of the size of the vocabulary.
+ * @param[in]  features      the list of features used to generate the descriptors
+ * @param[in]  descriptors   a list of row-features to create a histogram for
+ * @param[in]  image_size    the size of the image the features were found in
+ * @return  the non-zero bins of the feature vector
+ */
+sparse_vector bag_of_features::sparse_feature_vector(const vector<cv::KeyPoint>
+      &features, const cv::Mat &descriptors, const cv::Size &image_size) const {
+
+   assert(descriptors.rows == features.size());
+
+   sparse_vector histogram;
+   histogram.size = vocabulary.centroids.rows * pyramid_size(settings.spatial_pyramid_depth);
+
+   // Soft assignment over the whole vocabulary weights every bin anyway
+   if (settings.soft_kernel && vocabulary.index.empty() && settings.soft_neighbors <= 0) {
+      vector<double> dense = feature_vector(features, descriptors, image_size);
+      for (int i = 0; i < dense.size(); i++) {
+         if (dense[i] != 0) {
+            histogram.columns.push_back(i);
+            histogram.values.push_back(dense[i]);
+         }
+      }
+      return histogram;
+   }
+
+   stage_timer timer("encode", descriptors.rows);
+   std::vector<int> cells;
+   pyramid_cells(features, image_size, cells);
+
+   std::vector<double> level_weights(settings.spatial_pyramid_depth);
+   for (int level = 0; level < level_weights.size(); level++) {
+      level_weights[level] = pyramid_weight(level);
+   }
+
+   cv::Mat points = descriptors;
+   if (descriptors.type() != CV_32F && !vocabulary.binary()) {
+      descriptors.convertTo(points, CV_32F);
+   }
+
+   vector<pair<int, double> > contributions;
+   sparse_assign(points, cells, level_weights, contributions);
+
+   // Sum the contributions to each bin in the order they were made, like
+   // the dense histogram does
+   std::stable_sort(contributions.begin(), contributions.end(),
+         [](const pair<int, double> &a, const pair<int, double> &b) { return a.first < b.first; });
+   vector<double> sums;
+   double total = 0;
+   for (int i = 0; i < contributions.size(); i++) {
+      if (histogram.columns.empty() || histogram.columns.back() != contributions[i].first) {
+         histogram.columns.push_back(contributions[i].first);
+         sums.push_back(0);
+      }
+      sums.back() += contributions[i].second;
+      total += contributions[i].second;
+   }
+
+   // Normalize the same way as the dense feature vector, to an L1 norm of
+   // its size
+   double scale = total > 0 ? histogram.size / total : 0;
+   histogram.values.resize(sums.size());
+   for (int i = 0; i < sums.size(); i++) {
+      histogram.values[i] = sums[i] * scale;
+   }
+   return histogram;
+}
+
+/**
+ * Hashes everything that changes the feature vectors: the settings, the
+ * visual words, and how the nearest words are looked up
+ */
+uint64_t bag_of_features::hash() const {
+   uint64_t h = hash_value(encoder_version);
+   h = hash_value(settings.kernel_distance_squared, h);
+   h = hash_value(settings.soft_kernel, h);
+   h = hash_value(settings.spatial_pyramid_depth, h);
+   h = hash_value(settings.soft_neighbors, h);
+
+   const cv::Mat &centroids = vocabulary.centroids;
+   h = hash_value(vocabulary.index.get_settings().branching, h);
+   h = hash_value(vocabulary.index.get_settings().checks, h);
+   h = hash_value(centroids.rows, h);
+   h = hash_value(centroids.cols, h);
+   for (int row = 0; row < centroids.rows; row++) {
+      h = hash_bytes(centroids.ptr(row), centroids.cols * centroids.elemSize(), h);
+   }
+   return h;
+}
+
+// Copies a feature vector into a single row matrix
+static cv::Mat row_feature_vector(const vector<double> &fv) {
    cv::Mat output(1, fv.size(), CV_32F);
    for (int i = 0; i < fv.size(); i++) {
       output.at<float>(0, i) = fv[i];
    }
    return output;
 }
+
+cv::Mat bag_of_features::mat_feature_vector(const vector<cv::KeyPoint>
+      &features, const cv::Mat &descriptors) const {
+   return row_feature_vector(feature_vector(features, descriptors));
+}
+
+cv::Mat bag_of_features::mat_feature_vector(const vector<cv::KeyPoint>
+      &features, const cv::Mat &descriptors, const cv::Size &image_size) const {
+   return row_feature_vector(feature_vector(features, descriptors, image_size));
+}
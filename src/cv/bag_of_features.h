@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <list>
 #include <vector>
 
@@ -7,10 +8,12 @@
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
+#include <boost/serialization/version.hpp>
 #include <boost/smart_ptr/shared_ptr.hpp>
 
 #include "serialize_cvmat.h"
 #include "visual_vocabulary.h"
+#include "../util/sparse_rows.h"
 
 class bag_of_features {
 
@@ -21,7 +24,8 @@ class bag_of_features {
        */
       struct settings {
          // expected squared distance between visual word and associated visual
-         // vocab used for soft feature assignment
+         // vocab used for soft feature assignment. Binary words measure it
+         // as the fraction of bits that differ.
          float kernel_distance_squared = 0.25f;  
 
          // whether or not soft feature assignment is used
@@ -30,12 +34,20 @@ class bag_of_features {
          // how many spatial pyramid levels are used
          int spatial_pyramid_depth = 1;
 
+         // how many of the nearest visual words a descriptor is softly
+         // assigned to, 0 uses every word the index compared against, or
+         // every word when the vocabulary has no index
+         int soft_neighbors = 0;
+
          friend class boost::serialization::access;
          template<class archive>
          void serialize(archive &ar, const unsigned int version) {
             ar &kernel_distance_squared;
             ar &soft_kernel;
             ar &spatial_pyramid_depth;
+            if (version > 0) {
+               ar &soft_neighbors;
+            }
          }
       };
    protected:
@@ -49,9 +61,38 @@ class bag_of_features {
          ar &vocabulary;
       }
 
+      // computes squared distances from a block of descriptors to every
+      // visual word, or the fraction of differing bits for binary words
+      void squared_distances(const cv::Mat &descriptors, cv::Mat &distances) const;
+
       // computes assignment of descriptor to visual vocabulary
-      cv::Mat soft_assign(const cv::Mat &point) const;
-      cv::Mat hard_assign(const cv::Mat &point) const;
+      void soft_assign(const float *distances, int count, float kernel_scale, float *weights) const;
+      int hard_assign(const float *distances) const;
+
+      // finds the k nearest visual words of a descriptor, nearest first
+      int nearest_words(const float *distances, int k, int *words, float *nearest) const;
+
+      // the factor of the squared distances in the exponent of the gaussian
+      // kernel, taken once per feature vector
+      float kernel_scale() const { return -1.f / settings.kernel_distance_squared; }
+
+      // adds the contribution of each descriptor to every pyramid level,
+      // either by scanning the whole vocabulary or through its index
+      void exact_assign(const cv::Mat &descriptors, const std::vector<int> &cells,
+            const std::vector<double> &level_weights, double *histogram) const;
+      void indexed_assign(const cv::Mat &descriptors, const std::vector<int> &cells,
+            const std::vector<double> &level_weights, double *histogram) const;
+
+      // lists the histogram bin and weight of every contribution of each
+      // descriptor, for the assignments that only touch a few words
+      void sparse_assign(const cv::Mat &descriptors, const std::vector<int> &cells,
+            const std::vector<double> &level_weights,
+            std::vector<std::pair<int, double> > &contributions) const;
+
+      // finds the histogram offset of the cell containing each feature at
+      // each level of the spatial pyramid
+      void pyramid_cells(const std::vector<cv::KeyPoint> &features,
+            const cv::Size &image_size, std::vector<int> &cells) const;
 
       // gets the size of the spatial pyramid representation
       int pyramid_size(int depth) const { return ((1 << (2 * depth)) - 1) / 3; }
@@ -67,9 +108,31 @@ class bag_of_features {
       void set_vocabulary(const visual_vocabulary &vv) { vocabulary = vv; }
       void set_settings(const struct settings &s) { settings = s; }
 
-      // Computes the feature vector for a set of features
+      // The number of bins of every feature vector
+      int size() const { return vocabulary.centroids.rows * pyramid_size(settings.spatial_pyramid_depth); }
+
+      // Hashes the settings and the vocabulary, which together decide every
+      // feature vector, so that cached feature vectors can be told apart
+      uint64_t hash() const;
+
+      // Computes the feature vector for a set of features. Without the image
+      // size the spatial pyramid spans the extent of the features.
       cv::Mat mat_feature_vector(const std::vector<cv::KeyPoint>
             &features, const cv::Mat &descriptors) const;
       std::vector<double> feature_vector(const std::vector<cv::KeyPoint>
             &features, const cv::Mat &descriptors) const;
+      cv::Mat mat_feature_vector(const std::vector<cv::KeyPoint>
+            &features, const cv::Mat &descriptors, const cv::Size &image_size) const;
+      std::vector<double> feature_vector(const std::vector<cv::KeyPoint>
+            &features, const cv::Mat &descriptors, const cv::Size &image_size) const;
+
+      // Computes the same feature vector keeping only its non-zero bins,
+      // without ever filling a dense histogram unless soft assignment
+      // weights every visual word
+      sparse_vector sparse_feature_vector(const std::vector<cv::KeyPoint>
+            &features, const cv::Mat &descriptors) const;
+      sparse_vector sparse_feature_vector(const std::vector<cv::KeyPoint>
+            &features, const cv::Mat &descriptors, const cv::Size &image_size) const;
 };
+
+BOOST_CLASS_VERSION(struct bag_of_features::settings, 1)
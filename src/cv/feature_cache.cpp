@@ -0,0 +1,164 @@
+#include "feature_cache.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <boost/filesystem.hpp>
+
+#include "../util/hash.h"
+
+using namespace std;
+
+// Columns of the keypoint matrix: x, y, size, angle, response, octave, class
+static const int keypoint_fields = 7;
+
+// A single row header over a vector, which has to outlive it
+template<class T>
+static cv::Mat row(const vector<T> &values, int type) {
+   return values.empty() ? cv::Mat() : cv::Mat(1, values.size(), type, (void *)&values[0]);
+}
+
+feature_cache::feature_cache(const string &d) : directory(d) {
+   boost::filesystem::create_directories(directory);
+}
+
+/**
+ * The file of an entry
+ */
+string feature_cache::path(uint64_t key, const string &extension) const {
+   char name[32];
+   snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+   return (boost::filesystem::path(directory) / (name + extension)).string();
+}
+
+/**
+ * Writes an entry under a temporary name and moves it into place
+ */
+void feature_cache::write(const model_writer &writer, const string &file) const {
+   ostringstream temporary;
+   temporary << file << ".tmp" << this_thread::get_id();
+   writer.write(temporary.str());
+   if (rename(temporary.str().c_str(), file.c_str()) != 0) {
+      remove(temporary.str().c_str());
+      throw runtime_error("Could not write cache entry: " + file);
+   }
+}
+
+/**
+ * Reads a whole file and hashes it
+ * @param[in]  file      the file to read
+ * @param[out] contents  the bytes of the file
+ * @return  the hash of the bytes
+ */
+uint64_t feature_cache::hash_file(const string &file, vector<uchar> &contents) {
+   ifstream in(file.c_str(), ios::binary | ios::ate);
+   contents.clear();
+   if (!in) return 0;
+
+   contents.resize(in.tellg());
+   in.seekg(0);
+   if (!contents.empty() && !in.read((char *)&contents[0], contents.size())) {
+      contents.clear();
+      return 0;
+   }
+   return contents.empty() ? 0 : hash_bytes(&contents[0], contents.size());
+}
+
+bool feature_cache::load_features(uint64_t key, cv::Size &size, vector<cv::KeyPoint> &keypoints,
+      cv::Mat &descriptors) const {
+   string file = path(key, ".features");
+   if (!boost::filesystem::exists(file)) return false;
+
+   try {
+      model_file entry(file);
+      cv::Mat image_size = entry.get("size");
+      cv::Mat points = entry.get("keypoints");
+
+      size = cv::Size(image_size.at<int>(0, 0), image_size.at<int>(0, 1));
+      keypoints.resize(points.rows);
+      for (int i = 0; i < points.rows; i++) {
+         const float *p = points.ptr<float>(i);
+         keypoints[i] = cv::KeyPoint(p[0], p[1], p[2], p[3], p[4], (int)p[5], (int)p[6]);
+      }
+
+      // Copied out so the mapping can go away with the entry
+      descriptors = entry.get("descriptors").clone();
+      return true;
+   } catch (const exception &) {
+      // A damaged entry is a miss, and gets written again
+      return false;
+   }
+}
+
+void feature_cache::save_features(uint64_t key, const cv::Size &size,
+      const vector<cv::KeyPoint> &keypoints, const cv::Mat &descriptors) const {
+   cv::Mat points(keypoints.size(), keypoint_fields, CV_32F);
+   for (int i = 0; i < keypoints.size(); i++) {
+      const cv::KeyPoint &k = keypoints[i];
+      float *p = points.ptr<float>(i);
+      p[0] = k.pt.x;
+      p[1] = k.pt.y;
+      p[2] = k.size;
+      p[3] = k.angle;
+      p[4] = k.response;
+      p[5] = k.octave;
+      p[6] = k.class_id;
+   }
+
+   cv::Mat image_size = (cv::Mat_<int>(1, 2) << size.width, size.height);
+   model_writer writer;
+   writer.add("size", image_size);
+   writer.add("keypoints", points);
+   writer.add("descriptors", descriptors);
+   write(writer, path(key, ".features"));
+}
+
+bool feature_cache::load_vector(uint64_t key, vector<double> &feature_vector) const {
+   string file = path(key, ".vector");
+   if (!boost::filesystem::exists(file)) return false;
+
+   try {
+      model_file entry(file);
+      cv::Mat values = entry.get("vector");
+      if (!values.empty() && values.type() != CV_64F) return false;
+      feature_vector.assign((const double *)values.data, (const double *)values.data + values.total());
+      return true;
+   } catch (const exception &) {
+      return false;
+   }
+}
+
+bool feature_cache::load_vector(uint64_t key, sparse_vector &feature_vector) const {
+   string file = path(key, ".sparse");
+   if (!boost::filesystem::exists(file)) return false;
+
+   try {
+      model_file entry(file);
+      cv::Mat columns = entry.get("columns");
+      cv::Mat values = entry.get("values");
+      feature_vector.size = entry.get("size").at<int>(0, 0);
+      feature_vector.columns.assign((const int *)columns.data, (const int *)columns.data + columns.total());
+      feature_vector.values.assign((const float *)values.data, (const float *)values.data + values.total());
+      return true;
+   } catch (const exception &) {
+      return false;
+   }
+}
+
+void feature_cache::save_vector(uint64_t key, const vector<double> &feature_vector) const {
+   model_writer writer;
+   writer.add("vector", row(feature_vector, CV_64F));
+   write(writer, path(key, ".vector"));
+}
+
+void feature_cache::save_vector(uint64_t key, const sparse_vector &feature_vector) const {
+   cv::Mat size = (cv::Mat_<int>(1, 1) << feature_vector.size);
+   model_writer writer;
+   writer.add("size", size);
+   writer.add("columns", row(feature_vector.columns, CV_32S));
+   writer.add("values", row(feature_vector.values, CV_32F));
+   write(writer, path(key, ".sparse"));
+}
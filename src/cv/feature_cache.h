@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+
+#include "../util/model_file.h"
+#include "../util/sparse_rows.h"
+
+/**
+ * An on-disk cache of the keypoints and descriptors of images and of their
+ * bag of features vectors. Each entry is a binary model file in the cache
+ * directory named after its key. Keys are hashes of whatever decides the
+ * entry, such as the contents of the image file and the encoder, so an entry
+ * never has to be invalidated: when its inputs change it is simply no longer
+ * looked up. Entries are written to a temporary file first and renamed into
+ * place, so readers on other threads or processes never see half of one.
+ */
+class feature_cache {
+   std::string directory;
+
+   std::string path(uint64_t key, const std::string &extension) const;
+   void write(const model_writer &writer, const std::string &path) const;
+
+   public:
+   // Uses a directory for the cache, creating it if needed
+   explicit feature_cache(const std::string &directory);
+
+   // Hashes the contents of a file and keeps them, both are empty if the
+   // file could not be read
+   static uint64_t hash_file(const std::string &path, std::vector<uchar> &contents);
+
+   // Looks up or stores the features of an image. Lookups return false when
+   // there is no usable entry.
+   bool load_features(uint64_t key, cv::Size &size, std::vector<cv::KeyPoint> &keypoints,
+         cv::Mat &descriptors) const;
+   void save_features(uint64_t key, const cv::Size &size,
+         const std::vector<cv::KeyPoint> &keypoints, const cv::Mat &descriptors) const;
+
+   // Looks up or stores a bag of features vector
+   bool load_vector(uint64_t key, std::vector<double> &feature_vector) const;
+   bool load_vector(uint64_t key, sparse_vector &feature_vector) const;
+   void save_vector(uint64_t key, const std::vector<double> &feature_vector) const;
+   void save_vector(uint64_t key, const sparse_vector &feature_vector) const;
+};
@@ -0,0 +1,102 @@
+#include "feature_extractor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+
+#include <opencv2/nonfree/features2d.hpp> // SURF
+
+#include "../util/stage_stats.h"
+
+using namespace std;
+
+/**
+ * Lays the grid out over an image
+ * @param[in]  size  the size of the image
+ */
+vector<cv::KeyPoint> dense_grid::keypoints(const cv::Size &size) const {
+   CV_Assert(stride > 0 && !scales.empty());
+   int border = margin > 0 ? margin : (int)ceil(*max_element(scales.begin(), scales.end()));
+
+   vector<cv::KeyPoint> points;
+   for (int y = border; y < size.height - border; y += stride) {
+      for (int x = border; x < size.width - border; x += stride) {
+         for (int i = 0; i < scales.size(); i++) {
+            points.push_back(cv::KeyPoint((float)x, (float)y, scales[i]));
+         }
+      }
+   }
+   return points;
+}
+
+string dense_grid::name() const {
+   ostringstream out;
+   out << stride << "-" << margin;
+   for (int i = 0; i < scales.size(); i++) {
+      out << "-" << scales[i];
+   }
+   return out.str();
+}
+
+/**
+ * Creates an extractor with the parameters the tools have always used
+ * @param[in]  name  "surf", "orb" or "brisk", or "dense-surf" or "dense-brisk"
+ * @param[in]  grid  the grid of the dense extractors
+ */
+cv::Ptr<feature_extractor> feature_extractor::create(const string &name, const dense_grid &grid) {
+   if (name == "dense-surf") {
+      return cv::Ptr<feature_extractor>(new dense_extractor(
+            cv::Ptr<cv::DescriptorExtractor>(new cv::SurfDescriptorExtractor()), grid, false, name));
+   }
+   if (name == "dense-brisk") {
+      return cv::Ptr<feature_extractor>(new dense_extractor(
+            cv::Ptr<cv::DescriptorExtractor>(new cv::BRISK()), grid, true, name));
+   }
+   if (name == "surf") {
+      return cv::Ptr<feature_extractor>(new float_extractor(
+            cv::Ptr<cv::FeatureDetector>(new cv::SurfFeatureDetector(200)),
+            cv::Ptr<cv::DescriptorExtractor>(new cv::SurfDescriptorExtractor()), "surf-200"));
+   }
+   if (name == "orb") {
+      return cv::Ptr<feature_extractor>(new binary_extractor(
+            cv::Ptr<cv::Feature2D>(new cv::ORB(500)), "orb-500"));
+   }
+   if (name == "brisk") {
+      return cv::Ptr<feature_extractor>(new binary_extractor(
+            cv::Ptr<cv::Feature2D>(new cv::BRISK()), "brisk"));
+   }
+   throw invalid_argument("Unknown feature extractor: " + name);
+}
+
+void float_extractor::extract(const cv::Mat &image, vector<cv::KeyPoint> &keypoints,
+      cv::Mat &descriptors) {
+   {
+      stage_timer timer("detect", 1);
+      detector->detect(image, keypoints);
+   }
+   stage_timer timer("describe");
+   extractor->compute(image, keypoints, descriptors);
+   timer.add(descriptors.rows);
+}
+
+void binary_extractor::extract(const cv::Mat &image, vector<cv::KeyPoint> &keypoints,
+      cv::Mat &descriptors) {
+   stage_timer timer("detect_describe");
+   (*features)(image, cv::Mat(), keypoints, descriptors);
+   timer.add(descriptors.rows);
+}
+
+void dense_extractor::extract(const cv::Mat &image, vector<cv::KeyPoint> &keypoints,
+      cv::Mat &descriptors) {
+   pair<int, int> size(image.cols, image.rows);
+   map<pair<int, int>, vector<cv::KeyPoint> >::iterator found = grids.find(size);
+   if (found == grids.end()) {
+      found = grids.insert(make_pair(size, grid.keypoints(image.size()))).first;
+   }
+
+   stage_timer timer("describe");
+   keypoints = found->second;
+   extractor->compute(image, keypoints, descriptors);
+   timer.add(descriptors.rows);
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+
+/**
+ * Keypoints on a regular grid, used instead of detecting them. Every image
+ * of the same size gets the same keypoints, so it always gives the same
+ * number of descriptors and every cell of the spatial pyramid is covered
+ * evenly.
+ */
+struct dense_grid {
+   // pixels between neighboring grid points
+   int stride = 8;
+
+   // diameters of the keypoints, one keypoint per scale at every grid point
+   std::vector<float> scales = std::vector<float>(1, 16.f);
+
+   // distance of the grid from the image border, 0 uses the largest scale
+   // so that no descriptor reaches outside the image
+   int margin = 0;
+
+   // The keypoints of an image of a size
+   std::vector<cv::KeyPoint> keypoints(const cv::Size &size) const;
+
+   // Names the grid, for cache keys
+   std::string name() const;
+};
+
+/**
+ * Finds keypoints in a grayscale image and describes each of them. Float
+ * extractors such as SURF give CV_32F descriptors compared by euclidean
+ * distance. Binary extractors such as ORB and BRISK give CV_8U bit strings
+ * compared by Hamming distance, which are much cheaper to compute and to
+ * compare, and which visual vocabularies cluster with k-majority.
+ *
+ * Extractors are not shared between threads, each thread creates its own.
+ */
+class feature_extractor {
+   public:
+      virtual ~feature_extractor() { }
+
+      // Finds and describes the keypoints of an image, one descriptor per row
+      virtual void extract(const cv::Mat &image, std::vector<cv::KeyPoint> &keypoints,
+            cv::Mat &descriptors) = 0;
+
+      // Whether the descriptors are bit strings
+      virtual bool binary() const = 0;
+
+      // Names the extractor and its parameters, for cache keys
+      virtual std::string name() const = 0;
+
+      // Creates an extractor by name: "surf", "orb" or "brisk", or
+      // "dense-surf" or "dense-brisk" to describe the points of a grid.
+      // Throws std::invalid_argument for any other name.
+      static cv::Ptr<feature_extractor> create(const std::string &name,
+            const dense_grid &grid = dense_grid());
+};
+
+/**
+ * A separate detector and descriptor extractor giving float descriptors
+ */
+class float_extractor : public feature_extractor {
+   cv::Ptr<cv::FeatureDetector> detector;
+   cv::Ptr<cv::DescriptorExtractor> extractor;
+   std::string my_name;
+
+   public:
+      float_extractor(const cv::Ptr<cv::FeatureDetector> &d,
+            const cv::Ptr<cv::DescriptorExtractor> &e, const std::string &name)
+            : detector(d), extractor(e), my_name(name) { }
+
+      void extract(const cv::Mat &image, std::vector<cv::KeyPoint> &keypoints,
+            cv::Mat &descriptors);
+      bool binary() const { return false; }
+      std::string name() const { return my_name; }
+};
+
+/**
+ * A binary descriptor that detects and describes keypoints in one pass
+ */
+class binary_extractor : public feature_extractor {
+   cv::Ptr<cv::Feature2D> features;
+   std::string my_name;
+
+   public:
+      binary_extractor(const cv::Ptr<cv::Feature2D> &f, const std::string &name)
+            : features(f), my_name(name) { }
+
+      void extract(const cv::Mat &image, std::vector<cv::KeyPoint> &keypoints,
+            cv::Mat &descriptors);
+      bool binary() const { return true; }
+      std::string name() const { return my_name; }
+};
+
+/**
+ * Describes the points of a dense grid instead of detecting keypoints. The
+ * grid of each image size is built once and reused.
+ */
+class dense_extractor : public feature_extractor {
+   cv::Ptr<cv::DescriptorExtractor> extractor;
+   dense_grid grid;
+   bool binary_descriptors;
+   std::string my_name;
+
+   std::map<std::pair<int, int>, std::vector<cv::KeyPoint> > grids;
+
+   public:
+      dense_extractor(const cv::Ptr<cv::DescriptorExtractor> &e, const dense_grid &g,
+            bool binary, const std::string &name)
+            : extractor(e), grid(g), binary_descriptors(binary), my_name(name + "-" + g.name()) { }
+
+      void extract(const cv::Mat &image, std::vector<cv::KeyPoint> &keypoints,
+            cv::Mat &descriptors);
+      bool binary() const { return binary_descriptors; }
+      std::string name() const { return my_name; }
+};
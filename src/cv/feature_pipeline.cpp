@@ -0,0 +1,278 @@
+#include "feature_pipeline.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "feature_cache.h"
+#include "../util/bounded_queue.h"
+#include "../util/hash.h"
+
+using namespace std;
+
+namespace {
+   // An image on its way through the pipeline
+   struct job {
+      size_t index;
+      cv::Mat image;
+      feature_pipeline::image_features features;
+
+      // the cache keys of the features and the feature vector, only valid
+      // when cacheable
+      bool cacheable = false;
+      uint64_t feature_key = 0;
+      uint64_t vector_key = 0;
+
+      // whether the features and the feature vector came from the cache
+      bool described = false;
+      bool encoded = false;
+   };
+
+   // State shared by the threads of one run
+   struct run_state {
+      bounded_queue<job> listed;
+      bounded_queue<job> decoded;
+      bounded_queue<job> described;
+      bounded_queue<job> finished;
+
+      mutex error_lock;
+      exception_ptr error;
+
+      // Images are only listed while fewer than window of them are between
+      // listing and output, which bounds the results waiting to be handed
+      // back in order behind one slow image
+      mutex window_lock;
+      condition_variable window_moved;
+      size_t window;
+      size_t delivered = 0;
+      bool stopped = false;
+
+      run_state(int capacity, size_t w) : listed(capacity), decoded(capacity), described(capacity),
+         finished(capacity), window(w) { }
+
+      // Waits until an image can be listed, returns false if the run failed
+      bool wait_to_list(size_t index) {
+         unique_lock<mutex> guard(window_lock);
+         window_moved.wait(guard, [&] { return stopped || index < delivered + window; });
+         return !stopped;
+      }
+
+      void deliver() {
+         lock_guard<mutex> guard(window_lock);
+         delivered++;
+         window_moved.notify_all();
+      }
+
+      // Remembers the first error and shuts every stage down
+      void fail() {
+         {
+            lock_guard<mutex> guard(error_lock);
+            if (!error) error = current_exception();
+         }
+         {
+            lock_guard<mutex> guard(window_lock);
+            stopped = true;
+            window_moved.notify_all();
+         }
+         listed.close();
+         decoded.close();
+         described.close();
+         finished.close();
+      }
+   };
+}
+
+feature_pipeline::feature_pipeline(const settings &s) : my_settings(s), encode(false), sparse(false) { }
+
+/**
+ * Decodes, describes and optionally encodes every image
+ * @param[in]  files   the image files to process
+ * @param[in]  output  called with the features of each image, in the order of files
+ */
+void feature_pipeline::run(const vector<string> &files, const consumer &output) const {
+   size_t next_file = 0;
+   run([&](string &file) {
+      if (next_file == files.size()) return false;
+      file = files[next_file++];
+      return true;
+   }, output);
+}
+
+/**
+ * Decodes, describes and optionally encodes every image a source produces
+ * @param[in]  files   produces the image files to process
+ * @param[in]  output  called with the features of each image, in the order
+ *                     the source produced them
+ */
+void feature_pipeline::run(const source &files, const consumer &output) const {
+   int feature_threads = my_settings.feature_threads;
+   if (feature_threads <= 0) {
+      feature_threads = max(1u, thread::hardware_concurrency());
+   }
+   int decode_threads = max(1, my_settings.decode_threads);
+   int encode_threads = encode ? max(1, my_settings.encode_threads) : 0;
+
+   // Every thread can be busy with an image while queue_capacity more wait
+   // in the queues or to be handed back
+   int capacity = max(1, my_settings.queue_capacity);
+   run_state state(capacity, capacity + decode_threads + feature_threads + encode_threads);
+
+   unique_ptr<feature_cache> cache;
+   uint64_t encoder_hash = 0;
+   const string feature_name = feature_extractor::create(my_settings.features, my_settings.grid)->name();
+   if (!my_settings.cache_directory.empty()) {
+      cache.reset(new feature_cache(my_settings.cache_directory));
+      encoder_hash = hash_value(sparse, encode ? encoder.hash() : 0);
+   }
+   bounded_queue<job> &described = encode ? state.described : state.finished;
+
+   // Each stage closes its output once its last thread is done
+   atomic<int> decoding(decode_threads), describing(feature_threads), encoding(encode_threads);
+   vector<thread> threads;
+
+   // Files are numbered in the order they are listed
+   threads.push_back(thread([&] {
+      try {
+         job j;
+         for (j.index = 0; state.wait_to_list(j.index) && files(j.features.file); j.index++) {
+            if (!state.listed.push(j)) break;
+         }
+      } catch (...) {
+         state.fail();
+      }
+      state.listed.close();
+   }));
+
+   for (int i = 0; i < decode_threads; i++) {
+      threads.push_back(thread([&] {
+         try {
+            job j;
+            while (state.listed.pop(j)) {
+               const string &file = j.features.file;
+               if (!cache) {
+                  j.image = my_settings.scaling.read(file);
+                  j.features.size = j.image.size();
+               } else {
+                  // Keys cover the image contents, its scaling, the detector
+                  // and extractor, and for feature vectors the encoder as well
+                  vector<uchar> contents;
+                  uint64_t content_hash = feature_cache::hash_file(file, contents);
+                  j.cacheable = !contents.empty();
+                  j.feature_key = hash_bytes(feature_name.data(), feature_name.size(),
+                        my_settings.scaling.hash(content_hash));
+                  j.vector_key = hash_value(encoder_hash, j.feature_key);
+
+                  image_features &f = j.features;
+                  j.described = j.cacheable &&
+                     cache->load_features(j.feature_key, f.size, f.keypoints, f.descriptors);
+                  if (j.described && encode) {
+                     j.encoded = sparse ? cache->load_vector(j.vector_key, f.sparse_feature_vector)
+                                        : cache->load_vector(j.vector_key, f.feature_vector);
+                  }
+
+                  if (!j.described && j.cacheable) {
+                     j.image = my_settings.scaling.decode(contents);
+                  }
+                  j.features.size = j.described ? f.size : j.image.size();
+                  j.cacheable = j.cacheable && j.features.size.area() > 0;
+               }
+               if (!state.decoded.push(std::move(j))) break;
+            }
+         } catch (...) {
+            state.fail();
+         }
+         if (--decoding == 0) state.decoded.close();
+      }));
+   }
+
+   for (int i = 0; i < feature_threads; i++) {
+      threads.push_back(thread([&] {
+         try {
+            cv::Ptr<feature_extractor> extractor = feature_extractor::create(my_settings.features, my_settings.grid);
+
+            job j;
+            while (state.decoded.pop(j)) {
+               // Images that failed to decode come out with no features
+               if (!j.described && !j.image.empty()) {
+                  extractor->extract(j.image, j.features.keypoints, j.features.descriptors);
+                  if (j.cacheable) {
+                     cache->save_features(j.feature_key, j.features.size,
+                           j.features.keypoints, j.features.descriptors);
+                  }
+               }
+               j.image.release();
+               if (!described.push(std::move(j))) break;
+            }
+         } catch (...) {
+            state.fail();
+         }
+         if (--describing == 0) described.close();
+      }));
+   }
+
+   for (int i = 0; i < encode_threads; i++) {
+      threads.push_back(thread([&] {
+         try {
+            job j;
+            while (state.described.pop(j)) {
+               image_features &f = j.features;
+               if (!j.encoded && sparse) {
+                  f.sparse_feature_vector = encoder.sparse_feature_vector(f.keypoints, f.descriptors, f.size);
+                  if (j.cacheable) cache->save_vector(j.vector_key, f.sparse_feature_vector);
+               } else if (!j.encoded) {
+                  f.feature_vector = encoder.feature_vector(f.keypoints, f.descriptors, f.size);
+                  if (j.cacheable) cache->save_vector(j.vector_key, f.feature_vector);
+               }
+               if (!state.finished.push(std::move(j))) break;
+            }
+         } catch (...) {
+            state.fail();
+         }
+         if (--encoding == 0) state.finished.close();
+      }));
+   }
+
+   // Hand the results back in input order
+   try {
+      map<size_t, image_features> pending;
+      size_t next_index = 0;
+      job j;
+      while (state.finished.pop(j)) {
+         pending[j.index] = std::move(j.features);
+         while (!pending.empty() && pending.begin()->first == next_index) {
+            output(pending.begin()->second);
+            pending.erase(pending.begin());
+            next_index++;
+            state.deliver();
+         }
+      }
+   } catch (...) {
+      state.fail();
+   }
+
+   for (int i = 0; i < threads.size(); i++) {
+      threads[i].join();
+   }
+
+   if (state.error) {
+      rethrow_exception(state.error);
+   }
+}
+
+/**
+ * Decodes, describes and optionally encodes every image
+ * @param[in]  files  the image files to process
+ * @return  the features of each image, in the order of files
+ */
+vector<feature_pipeline::image_features> feature_pipeline::run(const vector<string> &files) const {
+   vector<image_features> results;
+   results.reserve(files.size());
+   run(files, [&results](image_features &features) {
+      results.push_back(std::move(features));
+   });
+   return results;
+}
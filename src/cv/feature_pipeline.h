@@ -0,0 +1,110 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+
+#include "bag_of_features.h"
+#include "feature_extractor.h"
+#include "image_scaling.h"
+
+/**
+ * Computes the features of a list of images on several threads. Decoding,
+ * keypoint detection and description, and bag of features encoding each run
+ * as their own stage, connected by bounded queues so that a slow stage holds
+ * back the stages in front of it instead of piling up decoded images. Every
+ * feature thread owns its own feature_extractor. Results are handed
+ * back in the order of the input files no matter which thread finished first.
+ *
+ * Files can also come from a source that produces them one at a time, such
+ * as a file_walker. The source runs on a thread of its own ahead of the
+ * decoding threads, so images are processed while it is still looking for
+ * more of them.
+ *
+ * With a cache directory, each image file is hashed as it is read, and
+ * images whose features or feature vectors are already cached skip the
+ * stages that would compute them.
+ */
+class feature_pipeline {
+
+   public:
+      struct settings {
+         // threads decoding image files
+         int decode_threads = 2;
+
+         // threads detecting and describing keypoints, 0 uses one per core
+         int feature_threads = 0;
+
+         // threads computing bag of features vectors, only used with an encoder
+         int encode_threads = 2;
+
+         // number of images waiting between two stages, and at most waiting
+         // to be handed back in order behind a slow one
+         int queue_capacity = 16;
+
+         // how images are scaled down as they are decoded
+         image_scaling scaling;
+
+         // the feature_extractor each feature thread creates, by name
+         std::string features = "surf";
+
+         // the grid of the "dense-" features
+         dense_grid grid;
+
+         // directory of the feature_cache, empty disables caching
+         std::string cache_directory;
+      };
+
+      // The features computed for one image
+      struct image_features {
+         std::string file;
+
+         // the size of the image after scaling, which keypoints are in
+         cv::Size size;
+         std::vector<cv::KeyPoint> keypoints;
+         cv::Mat descriptors;
+
+         // empty unless the pipeline has an encoder, only one of them is
+         // filled depending on whether the encoder is sparse
+         std::vector<double> feature_vector;
+         sparse_vector sparse_feature_vector;
+      };
+
+      // Receives the features of each image, in input order, on the thread
+      // that called run
+      typedef std::function<void(image_features &)> consumer;
+
+      // Produces the next file to process, returns false once there are
+      // none left. Only ever called from one thread at a time.
+      typedef std::function<bool(std::string &)> source;
+
+   protected:
+      settings my_settings;
+      bag_of_features encoder;
+      bool encode;
+      bool sparse;
+
+   public:
+      // Default settings can't be a default argument, since the member
+      // initializers of settings can't be used before the end of this class
+      feature_pipeline() : feature_pipeline(settings()) { }
+      feature_pipeline(const settings &s);
+
+      // Also compute the bag of features vector of every image, keeping only
+      // its non-zero bins when sparse
+      void set_encoder(const bag_of_features &bof, bool sparse_vectors = false) {
+         encoder = bof;
+         encode = true;
+         sparse = sparse_vectors;
+      }
+
+      // Processes every file, calling the consumer with each result in order
+      void run(const std::vector<std::string> &files, const consumer &output) const;
+      void run(const source &files, const consumer &output) const;
+
+      // Processes every file and collects the results in order
+      std::vector<image_features> run(const std::vector<std::string> &files) const;
+};
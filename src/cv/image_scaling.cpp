@@ -0,0 +1,139 @@
+#include "image_scaling.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+
+#include <opencv2/highgui/highgui.hpp> // imdecode
+#include <opencv2/imgproc/imgproc.hpp> // resize
+
+#include "../util/hash.h"
+#include "../util/stage_stats.h"
+
+using namespace std;
+
+// Reduced decoding arrived in OpenCV 3.2
+#if CV_MAJOR_VERSION > 3 || (CV_MAJOR_VERSION == 3 && CV_MINOR_VERSION >= 2)
+#define REDUCED_DECODE 1
+#endif
+
+namespace {
+   inline int big_endian(const uchar *bytes, int size) {
+      int value = 0;
+      for (int i = 0; i < size; i++) {
+         value = (value << 8) | bytes[i];
+      }
+      return value;
+   }
+
+   /**
+    * Reads the size of a PNG or JPEG image from its header, without decoding
+    * @param[in]  c     the contents of the image file
+    * @param[out] size  the width and height of the image
+    * @return  false for other formats or a header that can't be read
+    */
+   bool encoded_size(const vector<uchar> &c, cv::Size &size) {
+      static const uchar png[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+      if (c.size() >= 24 && equal(png, png + 8, c.begin())) {
+         size = cv::Size(big_endian(&c[16], 4), big_endian(&c[20], 4));
+         return size.area() > 0;
+      }
+
+      // JPEG segments are walked to the start of frame, which holds the size
+      if (c.size() < 4 || c[0] != 0xff || c[1] != 0xd8) return false;
+      for (size_t i = 2; i + 9 < c.size(); ) {
+         if (c[i] != 0xff) return false;
+         uchar marker = c[i + 1];
+         if (marker == 0xff) {
+            i++;
+            continue;
+         }
+         if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+            size = cv::Size(big_endian(&c[i + 7], 2), big_endian(&c[i + 5], 2));
+            return size.area() > 0;
+         }
+         i += 2 + big_endian(&c[i + 2], 2);
+      }
+      return false;
+   }
+
+   int decode_flags(int reduction) {
+#ifdef REDUCED_DECODE
+      switch (reduction) {
+         case 2: return cv::IMREAD_REDUCED_GRAYSCALE_2;
+         case 4: return cv::IMREAD_REDUCED_GRAYSCALE_4;
+         case 8: return cv::IMREAD_REDUCED_GRAYSCALE_8;
+      }
+#endif
+      return CV_LOAD_IMAGE_GRAYSCALE;
+   }
+}
+
+/**
+ * The scale of an image, no larger than needed to fit max_dimension
+ * @param[in]  size  the full size of the image
+ */
+double image_scaling::scale_for(const cv::Size &size) const {
+   double s = scale;
+   int largest = max(size.width, size.height);
+   if (max_dimension > 0 && largest * s > max_dimension) {
+      s = (double)max_dimension / largest;
+   }
+   return s;
+}
+
+/**
+ * Reads an image file and decodes it at its scaled size
+ * @param[in]  file  the image file
+ */
+cv::Mat image_scaling::read(const string &file) const {
+   if (!enabled()) {
+      stage_timer timer("decode", 1);
+      return cv::imread(file, CV_LOAD_IMAGE_GRAYSCALE);
+   }
+
+   ifstream in(file.c_str(), ios::binary | ios::ate);
+   if (!in) return cv::Mat();
+   vector<uchar> contents(in.tellg());
+   in.seekg(0);
+   if (contents.empty() || !in.read((char *)&contents[0], contents.size())) return cv::Mat();
+   return decode(contents);
+}
+
+/**
+ * Decodes an image at its scaled size, reducing it while decoding when the
+ * codec can
+ * @param[in]  contents  the contents of the image file
+ */
+cv::Mat image_scaling::decode(const vector<uchar> &contents) const {
+   stage_timer timer("decode", 1, contents.size());
+   if (!enabled()) return cv::imdecode(cv::Mat(contents), CV_LOAD_IMAGE_GRAYSCALE);
+
+   // Without a header to read, the size is only known after decoding
+   cv::Size full;
+   int reduction = 1;
+   if (encoded_size(contents, full)) {
+      double s = scale_for(full);
+#ifdef REDUCED_DECODE
+      while (reduction < 8 && 2 * reduction * s <= 1) {
+         reduction *= 2;
+      }
+#endif
+   }
+
+   cv::Mat image = cv::imdecode(cv::Mat(contents), decode_flags(reduction));
+   if (image.empty()) return image;
+   if (full.area() == 0) full = image.size();
+
+   double s = scale_for(full);
+   cv::Size target(max(1, (int)lround(full.width * s)), max(1, (int)lround(full.height * s)));
+   if (image.size() == target) return image;
+
+   cv::Mat scaled;
+   cv::resize(image, scaled, target, 0, 0, target.area() < image.size().area() ? cv::INTER_AREA : cv::INTER_LINEAR);
+   return scaled;
+}
+
+uint64_t image_scaling::hash(uint64_t seed) const {
+   return enabled() ? hash_value(scale, hash_value(max_dimension, seed)) : seed;
+}
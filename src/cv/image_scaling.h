@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+/**
+ * How images are scaled down before their features are computed. Detection
+ * time and decoding memory grow with the number of pixels, and features
+ * don't need the full resolution of large photos.
+ *
+ * Images are decoded in grayscale. When OpenCV can decode at a reduced
+ * resolution, which JPEG does by scaling its DCT, the largest reduction of
+ * 2, 4 or 8 that stays at or above the target size is decoded and only the
+ * rest is resized. Otherwise the whole image is decoded and then resized.
+ * Keypoints are found in the scaled image, so they and the image size given
+ * to the spatial pyramid are both in scaled coordinates.
+ */
+struct image_scaling {
+   // images with a larger width or height are scaled down to it, 0 for no
+   // limit
+   int max_dimension = 0;
+
+   // scale of every image, applied before max_dimension
+   double scale = 1;
+
+   bool enabled() const { return max_dimension > 0 || scale != 1; }
+
+   // The scale an image of a size ends up at
+   double scale_for(const cv::Size &size) const;
+
+   // Reads or decodes an image file in grayscale at its scaled size, empty
+   // if it can't be decoded
+   cv::Mat read(const std::string &file) const;
+   cv::Mat decode(const std::vector<uchar> &contents) const;
+
+   // Hashes the policy together with a seed, giving the seed back when
+   // scaling is disabled so cache keys don't change
+   uint64_t hash(uint64_t seed) const;
+};
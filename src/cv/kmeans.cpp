@@ -0,0 +1,418 @@
+#include "kmeans.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "../util/hamming.h"
+
+using namespace std;
+
+static inline float squared_distance(const float *a, const float *b, int dimensions) {
+   float distance = 0;
+   for (int i = 0; i < dimensions; i++) {
+      float diff = a[i] - b[i];
+      distance += diff * diff;
+   }
+   return distance;
+}
+
+/**
+ * Finds the nearest center of every row of a block using one matrix
+ * multiplication for the ||a||^2 + ||b||^2 - 2ab distance expansion. The
+ * ||a||^2 term is the same for every center so it is left out.
+ * @param[in]  block         the rows to assign
+ * @param[in]  centers       the current centers
+ * @param[in]  center_norms  the squared norm of each center
+ * @param[out] labels        the nearest center of each row
+ */
+static void nearest_centers(const cv::Mat &block, const cv::Mat &centers,
+      const vector<float> &center_norms, vector<int> &labels) {
+   cv::Mat products;
+   cv::gemm(block, centers, -2.0, cv::Mat(), 0.0, products, cv::GEMM_2_T);
+
+   labels.resize(block.rows);
+   for (int i = 0; i < block.rows; i++) {
+      const float *row = products.ptr<float>(i);
+      int nearest = 0;
+      float nearest_distance = row[0] + center_norms[0];
+      for (int c = 1; c < centers.rows; c++) {
+         float distance = row[c] + center_norms[c];
+         if (distance < nearest_distance) {
+            nearest_distance = distance;
+            nearest = c;
+         }
+      }
+      labels[i] = nearest;
+   }
+}
+
+static void squared_norms(const cv::Mat &rows, vector<float> &norms) {
+   norms.resize(rows.rows);
+   for (int i = 0; i < rows.rows; i++) {
+      const float *row = rows.ptr<float>(i);
+      norms[i] = 0;
+      for (int j = 0; j < rows.cols; j++) {
+         norms[i] += row[j] * row[j];
+      }
+   }
+}
+
+/**
+ * Picks initial centers with k-means++, where each new center is drawn with
+ * probability proportional to its squared distance from the centers so far
+ * @param[in]  data     the samples, one per row
+ * @param[in]  k        the number of centers
+ * @param[in]  rng      the random number generator to draw with
+ * @param[out] centers  the chosen rows of data
+ */
+void kmeans_pp_centers(const cv::Mat &data, int k, cv::RNG &rng, cv::Mat &centers) {
+   CV_Assert(data.type() == CV_32F && data.rows >= k && k > 0);
+   const int dimensions = data.cols;
+
+   centers.create(k, dimensions, CV_32F);
+   data.row(rng.uniform(0, data.rows)).copyTo(centers.row(0));
+
+   vector<float> distances(data.rows);
+   double total = 0;
+   for (int i = 0; i < data.rows; i++) {
+      distances[i] = squared_distance(data.ptr<float>(i), centers.ptr<float>(0), dimensions);
+      total += distances[i];
+   }
+
+   for (int c = 1; c < k; c++) {
+      // Draw a row weighted by its distance to the nearest chosen center
+      double target = rng.uniform(0., total);
+      int chosen = 0;
+      for (double cumulative = 0; chosen < data.rows - 1; chosen++) {
+         cumulative += distances[chosen];
+         if (cumulative > target) break;
+      }
+      data.row(chosen).copyTo(centers.row(c));
+
+      total = 0;
+      const float *center = centers.ptr<float>(c);
+      for (int i = 0; i < data.rows; i++) {
+         distances[i] = min(distances[i], squared_distance(data.ptr<float>(i), center, dimensions));
+         total += distances[i];
+      }
+   }
+}
+
+/**
+ * Clusters the rows of data with mini-batch k-means
+ * @param[in]  data        the samples, one per row
+ * @param[in]  k           the number of clusters
+ * @param[in]  batch_size  the number of rows drawn per iteration
+ * @param[in]  iterations  the number of batches
+ * @param[out] centers     the cluster centers
+ */
+void minibatch_kmeans(const cv::Mat &data, int k, int batch_size, int iterations,
+      cv::Mat &centers) {
+   CV_Assert(data.type() == CV_32F && data.rows >= k && k > 0 && batch_size > 0);
+   const int dimensions = data.cols;
+
+   cv::RNG rng;
+   kmeans_pp_centers(data, k, rng, centers);
+
+   vector<int> counts(k, 0);
+   vector<float> center_norms;
+   vector<int> labels;
+   cv::Mat batch(batch_size, dimensions, CV_32F);
+
+   for (int iteration = 0; iteration < iterations; iteration++) {
+      for (int i = 0; i < batch_size; i++) {
+         data.row(rng.uniform(0, data.rows)).copyTo(batch.row(i));
+      }
+
+      // Assign the whole batch against the centers as they were at its start
+      squared_norms(centers, center_norms);
+      nearest_centers(batch, centers, center_norms, labels);
+
+      // Move each center toward its rows, slowing down as it sees more of them
+      for (int i = 0; i < batch_size; i++) {
+         int c = labels[i];
+         float rate = 1.f / ++counts[c];
+         float *center = centers.ptr<float>(c);
+         const float *row = batch.ptr<float>(i);
+         for (int j = 0; j < dimensions; j++) {
+            center[j] += rate * (row[j] - center[j]);
+         }
+      }
+   }
+}
+
+/**
+ * Finds the nearest and second nearest center of a row
+ */
+static void two_nearest(const float *row, const cv::Mat &centers, int &nearest,
+      float &nearest_distance, float &second_distance) {
+   nearest = 0;
+   nearest_distance = second_distance = numeric_limits<float>::infinity();
+   for (int c = 0; c < centers.rows; c++) {
+      float distance = squared_distance(row, centers.ptr<float>(c), centers.cols);
+      if (distance < nearest_distance) {
+         second_distance = nearest_distance;
+         nearest_distance = distance;
+         nearest = c;
+      } else if (distance < second_distance) {
+         second_distance = distance;
+      }
+   }
+   nearest_distance = sqrt(nearest_distance);
+   second_distance = sqrt(second_distance);
+}
+
+/**
+ * Runs one attempt of Hamerly's k-means
+ * @param[in]  data      the samples, one per row
+ * @param[in]  k         the number of clusters
+ * @param[in]  criteria  when to stop iterating
+ * @param[in]  seed      the seed of the k-means++ initialization
+ * @param[out] centers   the cluster centers
+ * @param[out] labels    the cluster of each row
+ * @return  the sum of squared distances from each row to its center
+ */
+static double hamerly_attempt(const cv::Mat &data, int k, cv::TermCriteria criteria,
+      uint64 seed, cv::Mat &centers, vector<int> &labels) {
+   const int rows = data.rows, dimensions = data.cols;
+   const int max_iterations = (criteria.type & cv::TermCriteria::COUNT) ? max(criteria.maxCount, 2) : 100;
+   const double epsilon = (criteria.type & cv::TermCriteria::EPS) ? criteria.epsilon * criteria.epsilon : -1;
+
+   cv::RNG rng(seed);
+   kmeans_pp_centers(data, k, rng, centers);
+
+   // upper bound on the distance to the assigned center, lower bound on the
+   // distance to every other center
+   vector<float> upper(rows), lower(rows);
+   labels.resize(rows);
+   for (int i = 0; i < rows; i++) {
+      two_nearest(data.ptr<float>(i), centers, labels[i], upper[i], lower[i]);
+   }
+
+   cv::Mat previous;
+   vector<double> sums(k * dimensions);
+   vector<int> counts(k);
+   vector<float> half_separation(k), moved(k);
+   for (int iteration = 0; iteration < max_iterations; iteration++) {
+
+      // Move every center to the mean of its rows
+      centers.copyTo(previous);
+      fill(sums.begin(), sums.end(), 0.);
+      fill(counts.begin(), counts.end(), 0);
+      for (int i = 0; i < rows; i++) {
+         const float *row = data.ptr<float>(i);
+         double *sum = &sums[labels[i] * dimensions];
+         for (int j = 0; j < dimensions; j++) sum[j] += row[j];
+         counts[labels[i]]++;
+      }
+      for (int c = 0; c < k; c++) {
+         float *center = centers.ptr<float>(c);
+         if (counts[c]) {
+            for (int j = 0; j < dimensions; j++) center[j] = sums[c * dimensions + j] / counts[c];
+         } else {
+            // Restart an empty cluster at the row furthest from its center
+            int furthest = max_element(upper.begin(), upper.end()) - upper.begin();
+            data.row(furthest).copyTo(centers.row(c));
+            labels[furthest] = c;
+            upper[furthest] = lower[furthest] = 0;
+         }
+      }
+
+      // Update the bounds by how far the centers moved
+      int most_moved = 0, second_most_moved = -1;
+      float max_shift = 0;
+      for (int c = 0; c < k; c++) {
+         float shift = squared_distance(previous.ptr<float>(c), centers.ptr<float>(c), dimensions);
+         max_shift = max(max_shift, shift);
+         moved[c] = sqrt(shift);
+         if (moved[c] > moved[most_moved]) {
+            second_most_moved = most_moved;
+            most_moved = c;
+         } else if (c != most_moved && (second_most_moved < 0 || moved[c] > moved[second_most_moved])) {
+            second_most_moved = c;
+         }
+      }
+      for (int i = 0; i < rows; i++) {
+         upper[i] += moved[labels[i]];
+         int other = labels[i] == most_moved ? second_most_moved : most_moved;
+         lower[i] -= other >= 0 ? moved[other] : 0;
+      }
+      if (max_shift <= epsilon) break;
+
+      // Half the distance from each center to its closest neighbor
+      for (int c = 0; c < k; c++) {
+         float closest = numeric_limits<float>::infinity();
+         for (int other = 0; other < k; other++) {
+            if (other == c) continue;
+            closest = min(closest, squared_distance(centers.ptr<float>(c), centers.ptr<float>(other), dimensions));
+         }
+         half_separation[c] = sqrt(closest) / 2;
+      }
+
+      // Only rows whose bounds overlap need their distances recomputed
+      for (int i = 0; i < rows; i++) {
+         float bound = max(half_separation[labels[i]], lower[i]);
+         if (upper[i] <= bound) continue;
+
+         const float *row = data.ptr<float>(i);
+         upper[i] = sqrt(squared_distance(row, centers.ptr<float>(labels[i]), dimensions));
+         if (upper[i] <= bound) continue;
+
+         two_nearest(row, centers, labels[i], upper[i], lower[i]);
+      }
+   }
+
+   double compactness = 0;
+   for (int i = 0; i < rows; i++) {
+      compactness += squared_distance(data.ptr<float>(i), centers.ptr<float>(labels[i]), dimensions);
+   }
+   return compactness;
+}
+
+/**
+ * Clusters the rows of data with exact k-means
+ * @param[in]  data      the samples, one per row
+ * @param[in]  k         the number of clusters
+ * @param[out] labels    the cluster of each row
+ * @param[in]  criteria  when to stop iterating
+ * @param[in]  attempts  the number of restarts, the most compact is kept
+ * @param[out] centers   the cluster centers
+ * @return  the sum of squared distances from each row to its center
+ */
+double hamerly_kmeans(const cv::Mat &data, int k, cv::Mat &labels,
+      cv::TermCriteria criteria, int attempts, cv::Mat &centers) {
+   CV_Assert(data.type() == CV_32F && data.rows >= k && k > 0);
+   attempts = max(attempts, 1);
+
+   vector<cv::Mat> attempt_centers(attempts);
+   vector<vector<int> > attempt_labels(attempts);
+   vector<double> compactness(attempts);
+
+   // Every attempt is seeded by its number so results don't depend on timing
+   vector<thread> threads;
+   for (int attempt = 0; attempt < attempts; attempt++) {
+      threads.push_back(thread([&, attempt] {
+         compactness[attempt] = hamerly_attempt(data, k, criteria, attempt + 1,
+               attempt_centers[attempt], attempt_labels[attempt]);
+      }));
+   }
+   for (int i = 0; i < threads.size(); i++) {
+      threads[i].join();
+   }
+
+   int best = min_element(compactness.begin(), compactness.end()) - compactness.begin();
+   centers = attempt_centers[best];
+   labels.create(data.rows, 1, CV_32S);
+   for (int i = 0; i < data.rows; i++) {
+      labels.at<int>(i, 0) = attempt_labels[best][i];
+   }
+   return compactness[best];
+}
+
+/**
+ * Clusters binary rows with k-majority. Centers start as distinct random
+ * rows, and a center left without rows takes the row furthest from its own
+ * center.
+ * @param[in]  data        CV_8U bit strings, one per row
+ * @param[in]  k           the number of clusters
+ * @param[in]  iterations  the most assignment passes
+ * @param[out] labels      CV_32S, the center of each row
+ * @param[out] centers     CV_8U, the cluster centers
+ * @return  the sum of the Hamming distances of the rows to their centers
+ */
+double kmajority(const cv::Mat &data, int k, int iterations, cv::Mat &labels,
+      cv::Mat &centers) {
+   CV_Assert(data.type() == CV_8U && data.rows >= k && k > 0);
+   const int bytes = data.cols;
+
+   cv::RNG rng;
+   vector<int> order(data.rows);
+   for (int i = 0; i < data.rows; i++) {
+      order[i] = i;
+   }
+   centers.create(k, bytes, CV_8U);
+   for (int c = 0; c < k; c++) {
+      swap(order[c], order[rng.uniform(c, data.rows)]);
+      data.row(order[c]).copyTo(centers.row(c));
+   }
+
+   labels = cv::Mat(data.rows, 1, CV_32S, cv::Scalar(-1));
+   vector<int> distances(data.rows);
+   int thread_count = max(1u, thread::hardware_concurrency());
+   const int block = 1024;
+
+   double compactness = 0;
+   for (int iteration = 0; iteration < iterations; iteration++) {
+      // Assign blocks of rows on every thread
+      atomic<int> next_block(0), changed(0);
+      auto assign = [&] {
+         int start;
+         while ((start = block * next_block++) < data.rows) {
+            int moved = 0;
+            for (int i = start; i < min(start + block, data.rows); i++) {
+               const uchar *row = data.ptr(i);
+               int nearest = 0, nearest_distance = hamming_distance(row, centers.ptr(0), bytes);
+               for (int c = 1; c < k; c++) {
+                  int distance = hamming_distance(row, centers.ptr(c), bytes);
+                  if (distance < nearest_distance) {
+                     nearest_distance = distance;
+                     nearest = c;
+                  }
+               }
+               moved += labels.at<int>(i) != nearest;
+               labels.at<int>(i) = nearest;
+               distances[i] = nearest_distance;
+            }
+            changed += moved;
+         }
+      };
+      vector<thread> threads;
+      for (int i = 1; i < thread_count; i++) {
+         threads.push_back(thread(assign));
+      }
+      assign();
+      for (int i = 0; i < threads.size(); i++) {
+         threads[i].join();
+      }
+
+      compactness = 0;
+      for (int i = 0; i < data.rows; i++) {
+         compactness += distances[i];
+      }
+      if (changed == 0) break;
+
+      // Every bit of a center is the majority vote of its rows
+      vector<int> members(k, 0);
+      vector<int> votes(k * bytes * 8, 0);
+      for (int i = 0; i < data.rows; i++) {
+         int c = labels.at<int>(i);
+         const uchar *row = data.ptr(i);
+         int *center_votes = &votes[c * bytes * 8];
+         members[c]++;
+         for (int bit = 0; bit < bytes * 8; bit++) {
+            center_votes[bit] += (row[bit >> 3] >> (bit & 7)) & 1;
+         }
+      }
+
+      for (int c = 0; c < k; c++) {
+         uchar *center = centers.ptr(c);
+         if (members[c] == 0) {
+            int furthest = max_element(distances.begin(), distances.end()) - distances.begin();
+            data.row(furthest).copyTo(centers.row(c));
+            distances[furthest] = 0;
+            continue;
+         }
+         const int *center_votes = &votes[c * bytes * 8];
+         memset(center, 0, bytes);
+         for (int bit = 0; bit < bytes * 8; bit++) {
+            if (2 * center_votes[bit] > members[c]) center[bit >> 3] |= 1 << (bit & 7);
+         }
+      }
+   }
+   return compactness;
+}
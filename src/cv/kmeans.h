@@ -0,0 +1,36 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+
+/**
+ * Clustering routines used to build visual vocabularies. Each of them takes
+ * CV_32F row samples and produces CV_32F row centers in the same format as
+ * cv::kmeans.
+ */
+
+// Picks k rows of data as initial centers using k-means++ seeding
+void kmeans_pp_centers(const cv::Mat &data, int k, cv::RNG &rng, cv::Mat &centers);
+
+// Sculley's mini-batch k-means. Each iteration assigns a random batch of
+// rows to their nearest centers and moves those centers toward them with a
+// per-center learning rate, so the cost of an iteration does not depend on
+// the number of rows.
+void minibatch_kmeans(const cv::Mat &data, int k, int batch_size, int iterations,
+      cv::Mat &centers);
+
+// Lloyd's k-means with Hamerly's bounds. Every row keeps an upper bound on
+// the distance to its center and a lower bound on the distance to any other
+// center, and once the centers settle those bounds rule out most distance
+// computations. Each attempt starts from its own k-means++ seeding and the
+// attempts run on separate threads. Returns the compactness of the best
+// attempt, like cv::kmeans.
+double hamerly_kmeans(const cv::Mat &data, int k, cv::Mat &labels,
+      cv::TermCriteria criteria, int attempts, cv::Mat &centers);
+
+// k-majority clustering of CV_8U binary descriptors. Rows are assigned to
+// the center with the smallest Hamming distance, and each bit of a center is
+// set when most of its rows have it set, so centers stay binary and can be
+// compared with a popcount. Returns the sum of the distances of the rows to
+// their centers.
+double kmajority(const cv::Mat &data, int k, int iterations, cv::Mat &labels,
+      cv::Mat &centers);
@@ -1,36 +1,131 @@
 #include "visual_vocabulary.h"
 
+#include "kmeans.h"
+#include "../util/stage_stats.h"
+
 /**
  * Compute the visual vocabulary from the list of descriptors
  */
 visual_vocabulary::visual_vocabulary(const cv::Mat &descriptors, const
       visual_vocabulary::settings &s) : my_settings(s) { 
+   stage_timer timer("vocabulary", descriptors.rows);
+
+   if (descriptors.type() == CV_8U) {
+      cv::Mat labels;
+      kmajority(descriptors,            // Binary descriptors, one row per sample
+            my_settings.size,           // K -- Number of clusters to split the set by
+            100,                        // Most number of iterations
+            labels,                     // output integer array that stores the cluster indices
+            centroids);                 // The output bit string centers
+   } else if (my_settings.minibatch) {
+      minibatch_kmeans(descriptors,     // Matrix of input samples, one row per sample
+            my_settings.size,           // K -- Number of clusters to split the set by
+            my_settings.batch_size,     // Samples drawn per iteration
+            my_settings.batch_iterations, // Number of iterations
+            centroids);                 // The output centers
+   } else {
+      cv::Mat labels;
+
+      hamerly_kmeans(descriptors,       // Matrix of input samples, one row per sample
+            my_settings.size,           // K -- Number of clusters to split the set by
+            labels,                     // output integer array that stores the cluster indices
+            cv::TermCriteria(           // When to stop the algorithm:
+               CV_TERMCRIT_ITER |       //   after a desired number of iterations, or
+               CV_TERMCRIT_EPS,         //   after a desired level of accuracy
+               100,                     // number of iterations
+               0.001),                  // desired accuracy
+            5,                          // The number of times the algorithm is attempted, in parallel
+            centroids);                 // The output centers
+   }
 
-   cv::Mat labels;
-
-   cv::kmeans(descriptors,              // Matrix of input samples, one row per sample
-         my_settings.size,              // K -- Number of clusters to split the set by
-         labels,                        // output integer array that stores the cluster indices
-         cv::TermCriteria(              // When to stop the algorithm:
-            CV_TERMCRIT_ITER |          //   after a desired number of iterations, or
-            CV_TERMCRIT_EPS,            //   after a desired level of accuracy
-            100,                        // number of iterations
-            0.001),                     // desired accuracy
-         5,                             // The number of times the algorithm is attempted
-         cv::KMEANS_PP_CENTERS,         // Efficient initial labeling criteria
-         centroids);                    // The output centers 
+   compute_norms();
+   build_index(my_settings.index);
 }
 
+/**
+ * Builds the index used to look up the nearest visual words without a
+ * linear scan of the centroids
+ */
+void visual_vocabulary::build_index(const vocabulary_tree::settings &s) {
+   my_settings.index = s;
+
+   // The tree averages words, which binary words can't be
+   if (binary()) {
+      index = vocabulary_tree();
+      return;
+   }
+   index.build(centroids, s);
+}
+
+/**
+ * Caches the squared norm of every centroid so that descriptor to word
+ * distances can be computed as ||a||^2 + ||b||^2 - 2ab
+ */
+void visual_vocabulary::compute_norms() {
+   if (binary()) {
+      centroid_norms.release();
+      return;
+   }
+   centroid_norms.create(1, centroids.rows, CV_32F);
+   for (int cluster_num = 0; cluster_num < centroids.rows; cluster_num++) {
+      const float *centroid = centroids.ptr<float>(cluster_num);
+      float norm = 0;
+      for (int i = 0; i < centroids.cols; i++) {
+         norm += centroid[i] * centroid[i];
+      }
+      centroid_norms.at<float>(0, cluster_num) = norm;
+   }
+}
+
+/**
+ * Writes the vocabulary to a binary model file
+ * @param[in]  path  the file to write
+ */
+void visual_vocabulary::save_binary(const std::string &path) const {
+   model_writer writer;
+   writer.add_object("settings", my_settings);
+   writer.add("centroids", centroids);
+   index.save(writer, "index.");
+   writer.write(path);
+}
+
+/**
+ * Maps a binary model file written by save_binary. The centroids are used in
+ * place from the mapping instead of being copied.
+ * @param[in]  path  the file to load
+ */
+void visual_vocabulary::load_binary(const std::string &path) {
+   std::shared_ptr<const model_file> file = std::make_shared<model_file>(path);
+   file->get_object("settings", my_settings);
+   centroids = file->get("centroids");
+   index.load(*file, "index.");
+   mapped_file = file;
+   compute_norms();
+}
 
 /**
  * Add descriptors for visual vocab compilation
  */
 void visual_vocabulary_factory::add_descriptors(const cv::Mat &descriptors) {
-   if (this->descriptors.data == NULL) {
-      this->descriptors = descriptors;
-   } else {
-      assert(descriptors.cols == this->descriptors.cols);
-      cv::vconcat(this->descriptors, descriptors, this->descriptors);
+   assert(descriptors.rows == 0 || this->descriptors.empty() ||
+          descriptors.cols == this->descriptors.mat().cols);
+
+   if (!my_settings.minibatch) {
+      this->descriptors.append(descriptors);
+      return;
    }
-}
 
+   // Keep a uniform sample of every descriptor seen so far, so memory stays
+   // bounded no matter how many are added
+   for (int i = 0; i < descriptors.rows; i++) {
+      seen++;
+      if (this->descriptors.rows() < my_settings.reservoir_size) {
+         this->descriptors.append(descriptors.row(i));
+      } else {
+         uint64 slot = (((uint64)rng.next() << 32) | rng.next()) % seen;
+         if (slot < (uint64)my_settings.reservoir_size) {
+            descriptors.row(i).copyTo(this->descriptors.mat().row(slot));
+         }
+      }
+   }
+}
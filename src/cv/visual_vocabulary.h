@@ -1,12 +1,25 @@
 #pragma once
 
+#include <memory>
+#include <string>
+
 #include <opencv2/core/core.hpp>
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
+#include <boost/serialization/version.hpp>
 
 #include "serialize_cvmat.h"
+#include "vocabulary_tree.h"
+#include "../util/model_file.h"
+#include "../util/row_buffer.h"
 
+/**
+ * The visual words that descriptors are counted against. Float descriptors
+ * are clustered with k-means into CV_32F words. Binary descriptors, CV_8U
+ * bit strings such as ORB or BRISK, are clustered with k-majority into
+ * binary words compared by Hamming distance, which have no index.
+ */
 struct visual_vocabulary {
    /**
     * These are options for the visual vocabulary
@@ -15,41 +28,115 @@ struct visual_vocabulary {
       // number of words in the visual vocabulary
       int size = 500;
 
+      // optional index used to find the nearest visual words
+      vocabulary_tree::settings index;
+
+      // train with mini-batch k-means instead of k-means over all of the
+      // descriptors. The mini-batches are drawn from the uniform sample of
+      // at most reservoir_size descriptors the factory keeps, not from every
+      // descriptor added, so memory and time depend on the sample size
+      // rather than on the number of images.
+      bool minibatch = false;
+
+      // descriptors drawn per mini-batch and number of mini-batches
+      int batch_size = 1000;
+      int batch_iterations = 300;
+
+      // most descriptors a factory keeps when training with mini-batches
+      int reservoir_size = 100000;
+
       friend class boost::serialization::access;
       template<class archive>
       void serialize(archive &ar, const unsigned int version) {
          ar &size;
+         if (version > 0) {
+            ar &index;
+         }
+         if (version > 1) {
+            ar &minibatch;
+            ar &batch_size;
+            ar &batch_iterations;
+            ar &reservoir_size;
+         }
       }
    };
 
+   // CV_32F, or CV_8U for binary descriptors
    cv::Mat centroids;
 
+   // squared L2 norm of each centroid, one column per visual word, empty for
+   // binary words
+   cv::Mat centroid_norms;
+
+   // approximate nearest word lookup, empty unless enabled in the settings
+   vocabulary_tree index;
+
    protected:
    settings my_settings;
 
+   // the binary model file the centroids were loaded from, kept open for as
+   // long as any copy of the vocabulary refers to it
+   std::shared_ptr<const model_file> mapped_file;
+
+   // caches the centroid norms used for batched distance computation
+   void compute_norms();
+
    friend class boost::serialization::access;
 
    template<class archive>
    void serialize(archive &ar, const unsigned int version) {
       ar &my_settings;
       ar &centroids;
+      if (version > 0) {
+         ar &index;
+      }
+      if (archive::is_loading::value) {
+         compute_norms();
+      }
    }
 
    public:
    visual_vocabulary(const cv::Mat &descriptors, const settings &s);
-   visual_vocabulary(const visual_vocabulary &v) { }
    visual_vocabulary() { }
+
+   // (Re)builds the nearest word index over the existing centroids
+   void build_index(const vocabulary_tree::settings &s);
+
+   // Whether the words are bit strings compared by Hamming distance
+   bool binary() const { return centroids.type() == CV_8U; }
+
+   // Saves to or loads from a binary model file, which is much faster to
+   // load than a text archive since the centroids are mapped, not parsed
+   void save_binary(const std::string &path) const;
+   void load_binary(const std::string &path);
 };
 
+BOOST_CLASS_VERSION(visual_vocabulary::settings, 2)
+BOOST_CLASS_VERSION(visual_vocabulary, 1)
+
 struct visual_vocabulary_factory {
 
+   // With mini-batch settings only a bounded sample of the descriptors is kept
+   visual_vocabulary_factory(const visual_vocabulary::settings &s = visual_vocabulary::settings())
+         : my_settings(s), seen(0) { }
+
    // Add descriptors used to compute the cluster centers
    void add_descriptors(const cv::Mat &descriptors);
 
+   // Make room for a total number of descriptors ahead of time
+   void reserve(int rows, int cols, int type = CV_32F) { descriptors.reserve(rows, cols, type); }
+
    // Compute the visual vocabulary
-   visual_vocabulary compute_visual_vocabulary(const visual_vocabulary::settings &s = visual_vocabulary::settings()) 
-         { return visual_vocabulary(descriptors, s); }
+   visual_vocabulary compute_visual_vocabulary() 
+         { return visual_vocabulary(descriptors.mat(), my_settings); }
+   visual_vocabulary compute_visual_vocabulary(const visual_vocabulary::settings &s) 
+         { return visual_vocabulary(descriptors.mat(), s); }
 
    protected:
-      cv::Mat descriptors;
+      visual_vocabulary::settings my_settings;
+      row_buffer descriptors;
+
+      // reservoir sampling state for mini-batch training
+      uint64 seen;
+      cv::RNG rng;
 };
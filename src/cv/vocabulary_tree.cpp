@@ -0,0 +1,217 @@
+#include "vocabulary_tree.h"
+
+#include <functional>
+#include <limits>
+#include <queue>
+
+using namespace std;
+
+static inline float squared_distance(const float *a, const float *b, int dimensions) {
+   float distance = 0;
+   for (int i = 0; i < dimensions; i++) {
+      float diff = a[i] - b[i];
+      distance += diff * diff;
+   }
+   return distance;
+}
+
+/**
+ * Builds the tree over a set of visual words
+ * @param[in]  centroids  the visual words, one per row
+ * @param[in]  s          the shape of the tree
+ */
+void vocabulary_tree::build(const cv::Mat &centroids, const settings &s) {
+   my_settings = s;
+   node_centers.release();
+   first_child.clear();
+   child_count.clear();
+   word.clear();
+
+   if (my_settings.branching < 2 || centroids.rows == 0) return;
+   assert(centroids.type() == CV_32F);
+
+   vector<int> words(centroids.rows);
+   for (int i = 0; i < centroids.rows; i++) {
+      words[i] = i;
+   }
+
+   // The root is never compared against, so its center is just the mean
+   vector<float> centers;
+   cv::Mat mean;
+   cv::reduce(centroids, mean, 0, CV_REDUCE_AVG);
+   int root = add_node(mean.ptr<float>(0), centroids.cols, centers);
+   build_children(root, centroids, words, centers);
+
+   node_centers = cv::Mat(word.size(), centroids.cols, CV_32F, &centers[0]).clone();
+}
+
+/**
+ * Appends a node with no children to the tree
+ */
+int vocabulary_tree::add_node(const float *center, int dimensions, vector<float> &centers) {
+   centers.insert(centers.end(), center, center + dimensions);
+   first_child.push_back(-1);
+   child_count.push_back(0);
+   word.push_back(-1);
+   return word.size() - 1;
+}
+
+/**
+ * Recursively splits a set of visual words into the children of a node
+ * @param[in]  node       the node the words belong to
+ * @param[in]  centroids  all of the visual words
+ * @param[in]  words      the indices of the words below this node
+ */
+void vocabulary_tree::build_children(int node, const cv::Mat &centroids,
+      const vector<int> &words, vector<float> &centers) {
+   const int branching = my_settings.branching;
+   const int dimensions = centroids.cols;
+
+   // Few enough words left that each of them becomes a leaf
+   if (words.size() <= branching) {
+      first_child[node] = word.size();
+      child_count[node] = words.size();
+      for (int i = 0; i < words.size(); i++) {
+         int leaf = add_node(centroids.ptr<float>(words[i]), dimensions, centers);
+         word[leaf] = words[i];
+      }
+      return;
+   }
+
+   // Cluster the words below this node
+   cv::Mat points(words.size(), dimensions, CV_32F);
+   for (int i = 0; i < words.size(); i++) {
+      centroids.row(words[i]).copyTo(points.row(i));
+   }
+
+   cv::Mat labels, cluster_centers;
+   cv::kmeans(points, branching, labels,
+         cv::TermCriteria(CV_TERMCRIT_ITER | CV_TERMCRIT_EPS, 10, 0.001),
+         1, cv::KMEANS_PP_CENTERS, cluster_centers);
+
+   vector<vector<int> > groups(branching);
+   for (int i = 0; i < words.size(); i++) {
+      groups[labels.at<int>(i, 0)].push_back(words[i]);
+   }
+
+   // Duplicate words can all land in one cluster, split them evenly instead
+   for (int g = 0; g < branching; g++) {
+      if (groups[g].size() == words.size()) {
+         for (int i = 0; i < branching; i++) groups[i].clear();
+         for (int i = 0; i < words.size(); i++) {
+            groups[i * branching / words.size()].push_back(words[i]);
+         }
+         break;
+      }
+   }
+
+   // Children are stored contiguously, so add them all before recursing
+   vector<int> children;
+   vector<float> center(dimensions);
+   first_child[node] = word.size();
+   for (int g = 0; g < branching; g++) {
+      if (groups[g].empty()) continue;
+
+      std::fill(center.begin(), center.end(), 0.f);
+      for (int i = 0; i < groups[g].size(); i++) {
+         const float *w = centroids.ptr<float>(groups[g][i]);
+         for (int j = 0; j < dimensions; j++) center[j] += w[j];
+      }
+      for (int j = 0; j < dimensions; j++) center[j] /= groups[g].size();
+
+      children.push_back(add_node(&center[0], dimensions, centers));
+   }
+   child_count[node] = children.size();
+
+   int child = 0;
+   for (int g = 0; g < branching; g++) {
+      if (groups[g].empty()) continue;
+      build_children(children[child++], centroids, groups[g], centers);
+   }
+}
+
+/**
+ * Finds the nearest visual words to a descriptor. The tree is descended to
+ * the closest leaf and the branches not taken are remembered, then the
+ * closest remembered branch is descended until enough words are compared.
+ * @param[in]  point      the descriptor to look up
+ * @param[in]  count      the maximum number of words to return
+ * @param[out] words      the nearest words, closest first
+ * @param[out] distances  the squared distance to each of the returned words
+ * @return  the number of words found
+ */
+int vocabulary_tree::nearest(const float *point, int count, int *words, float *distances) const {
+   if (empty() || count <= 0) return 0;
+
+   const int dimensions = node_centers.cols;
+
+   typedef pair<float, int> branch;
+   priority_queue<branch, vector<branch>, greater<branch> > branches;
+   branches.push(branch(0.f, 0));
+
+   int found = 0, checked = 0;
+   while (!branches.empty() && (checked < my_settings.checks || found < count)) {
+      float node_distance = branches.top().first;
+      int node = branches.top().second;
+      branches.pop();
+
+      // Descend to the closest leaf, remembering the other branches
+      while (word[node] < 0) {
+         int closest = -1;
+         float closest_distance = numeric_limits<float>::infinity();
+         for (int child = first_child[node]; child < first_child[node] + child_count[node]; child++) {
+            float distance = squared_distance(point, node_centers.ptr<float>(child), dimensions);
+            if (distance < closest_distance) {
+               if (closest >= 0) branches.push(branch(closest_distance, closest));
+               closest = child;
+               closest_distance = distance;
+            } else {
+               branches.push(branch(distance, child));
+            }
+         }
+         node = closest;
+         node_distance = closest_distance;
+      }
+      checked++;
+
+      // Keep the results sorted by distance
+      if (found < count || node_distance < distances[found - 1]) {
+         int i = found < count ? found++ : count - 1;
+         while (i > 0 && distances[i - 1] > node_distance) {
+            distances[i] = distances[i - 1];
+            words[i] = words[i - 1];
+            i--;
+         }
+         distances[i] = node_distance;
+         words[i] = word[node];
+      }
+   }
+
+   return found;
+}
+
+/**
+ * Adds the tree to a binary model file
+ * @param[in]  writer  the model file being written
+ * @param[in]  prefix  prepended to the name of every block
+ */
+void vocabulary_tree::save(model_writer &writer, const string &prefix) const {
+   writer.add_object(prefix + "settings", my_settings);
+   writer.add(prefix + "node_centers", node_centers);
+   writer.add(prefix + "first_child", int_row(first_child));
+   writer.add(prefix + "child_count", int_row(child_count));
+   writer.add(prefix + "word", int_row(word));
+}
+
+/**
+ * Loads a tree saved with save. The node centers stay in the mapped file.
+ * @param[in]  file    the mapped model file
+ * @param[in]  prefix  prepended to the name of every block
+ */
+void vocabulary_tree::load(const model_file &file, const string &prefix) {
+   file.get_object(prefix + "settings", my_settings);
+   node_centers = file.get(prefix + "node_centers");
+   int_vector(file.get(prefix + "first_child"), first_child);
+   int_vector(file.get(prefix + "child_count"), child_count);
+   int_vector(file.get(prefix + "word"), word);
+}
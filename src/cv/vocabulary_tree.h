@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/archive/text_iarchive.hpp>
+
+#include "serialize_cvmat.h"
+#include "../util/model_file.h"
+
+/**
+ * A hierarchical k-means tree built over the words of a visual vocabulary.
+ * Each inner node splits its words into a fixed number of clusters, and the
+ * leaves are the visual words themselves. Looking up a descriptor descends
+ * the tree best bin first, so only a small number of words are compared
+ * against it instead of the entire vocabulary.
+ */
+class vocabulary_tree {
+
+   public:
+      struct settings {
+         // number of children of each node, 0 disables the index
+         int branching = 0;
+
+         // number of visual words compared against a descriptor per lookup
+         int checks = 64;
+
+         friend class boost::serialization::access;
+         template<class archive>
+         void serialize(archive &ar, const unsigned int version) {
+            ar &branching;
+            ar &checks;
+         }
+      };
+
+   protected:
+      settings my_settings;
+
+      // one row per node: the cluster mean for inner nodes and the visual
+      // word itself for leaves
+      cv::Mat node_centers;
+
+      // the children of a node are stored contiguously starting at first_child
+      std::vector<int> first_child;
+      std::vector<int> child_count;
+
+      // the visual word a leaf refers to, -1 for inner nodes
+      std::vector<int> word;
+
+      int add_node(const float *center, int dimensions, std::vector<float> &centers);
+      void build_children(int node, const cv::Mat &centroids, const std::vector<int> &words,
+            std::vector<float> &centers);
+
+      friend class boost::serialization::access;
+      template<class archive>
+      void serialize(archive &ar, const unsigned int version) {
+         ar &my_settings;
+         ar &node_centers;
+         ar &first_child;
+         ar &child_count;
+         ar &word;
+      }
+
+   public:
+      // Builds the tree over a set of row-centroids
+      void build(const cv::Mat &centroids, const settings &s);
+
+      bool empty() const { return word.empty(); }
+      const settings &get_settings() const { return my_settings; }
+
+      // Finds up to count of the nearest visual words to a descriptor, sorted by
+      // increasing squared distance. Returns the number of words found.
+      int nearest(const float *point, int count, int *words, float *distances) const;
+
+      // Saves or loads the tree as blocks of a binary model file, with every
+      // block name starting with prefix
+      void save(model_writer &writer, const std::string &prefix) const;
+      void load(const model_file &file, const std::string &prefix);
+};
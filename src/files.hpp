@@ -12,32 +12,76 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cctype>
 #include <string>
 #include <list>
+#include <stdexcept>
+#include <vector>
 
 #include <boost/filesystem.hpp>
 
-// Recursively get all of the files in the directory
-std::list<std::string> get_files_recursive(const std::string &dir, 
- const std::string &extension) {
-   std::list<std::string> file_names;
-   if (!boost::filesystem::exists(dir)) {
-      throw std::runtime_error(std::string("Path not found: ")+dir);
+/**
+ * Walks a directory tree one entry at a time and hands out the files with
+ * one of a set of extensions as it finds them, so the files near the start
+ * can be processed while the rest of the tree is still being read.
+ * Extensions match regardless of case. Files come out in the same order a
+ * depth-first walk of the tree visits them.
+ */
+class file_walker {
+   boost::filesystem::recursive_directory_iterator current;
+   std::vector<std::string> extensions;
+
+   static std::string lowercase(std::string s) {
+      std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+      return s;
+   }
+
+   public:
+   file_walker(const std::string &dir, const std::vector<std::string> &e) {
+      if (!boost::filesystem::exists(dir)) {
+         throw std::runtime_error(std::string("Path not found: ")+dir);
+      }
+      current = boost::filesystem::recursive_directory_iterator(dir);
+      for (int i = 0; i < e.size(); i++) {
+         extensions.push_back(lowercase(e[i]));
+      }
    }
-   boost::filesystem::directory_iterator end_itr;
-   for (boost::filesystem::directory_iterator itr(dir); itr != end_itr; itr++) {
-      if (boost::filesystem::is_directory(itr->status())) {
-         // Search subdirectories for images
-         std::list<std::string> nested_files = 
-          get_files_recursive(itr->path().string(), extension);
-         file_names.insert(file_names.end(), nested_files.begin(), nested_files.end());
-      } else {
-         // Add files if they match the extensions in the list
-         if (boost::filesystem::extension(itr->path()).compare(extension) == 0) {
-            file_names.push_back(itr->path().string());
+
+   // Gets the next matching file, false once the whole tree was walked
+   bool next(std::string &path) {
+      boost::filesystem::recursive_directory_iterator end;
+      for (; current != end; current++) {
+         if (boost::filesystem::is_directory(current->status())) continue;
+
+         std::string extension = lowercase(boost::filesystem::extension(current->path()));
+         if (std::find(extensions.begin(), extensions.end(), extension) != extensions.end()) {
+            path = current->path().string();
+            current++;
+            return true;
          }
       }
+      return false;
+   }
+
+   // Lets a walker be used as a feature_pipeline::source
+   bool operator()(std::string &path) { return next(path); }
+};
+
+// Recursively get all of the files in the directory with any of the extensions
+inline std::list<std::string> get_files_recursive(const std::string &dir,
+ const std::vector<std::string> &extensions) {
+   std::list<std::string> file_names;
+   file_walker files(dir, extensions);
+   std::string file;
+   while (files.next(file)) {
+      file_names.push_back(file);
    }
    return file_names;
 }
 
+// Recursively get all of the files in the directory
+inline std::list<std::string> get_files_recursive(const std::string &dir, 
+ const std::string &extension) {
+   return get_files_recursive(dir, std::vector<std::string>(1, extension));
+}
@@ -0,0 +1,230 @@
+/**
+ * OpenCV image classifier
+ *
+ * Richie Steigerwald
+ *
+ * Copyright 2013 Richie Steigerwald <richie.steigerwald@gmail.com>
+ * This work is free. You can redistribute it and/or modify it under the
+ * terms of the Do What The Fuck You Want To Public License, Version 2,
+ * as published by Sam Hocevar. See http://www.wtfpl.net/ for more details.
+ */
+
+#include "batch_classifier.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "../cv/feature_extractor.h"
+#include "../util/bounded_queue.h"
+
+using namespace std;
+
+namespace {
+   // Copies a feature vector into a CV_32F row
+   void copy_row(const vector<double> &feature_vector, float *row) {
+      for (int j = 0; j < feature_vector.size(); j++) {
+         row[j] = feature_vector[j];
+      }
+   }
+}
+
+batch_classifier::batch_classifier(const bag_of_features &bof, const classifier &c,
+      const feature_pipeline::settings &s) : my_settings(s), pipeline(s), encoder(bof), cls(c) {
+   pipeline.set_encoder(encoder);
+}
+
+/**
+ * Fills one row of feature vectors per image, then classifies the rows of
+ * the images that could be encoded with a single call
+ * @param[in]  count           the number of images
+ * @param[in]  with_neighbors  whether to keep the nearest samples of each image
+ * @param[in]  encode          fills the rows of a CV_32F matrix, one per
+ *                             image, and marks the ones it could encode
+ */
+template<class encode_rows>
+batch_classifier::result batch_classifier::classify_rows(int count, bool with_neighbors,
+      const encode_rows &encode) const {
+   result r;
+   r.labels.assign(count, 0);
+   r.classified.assign(count, 0);
+
+   int64 start = cv::getTickCount();
+   cv::Mat samples(count, encoder.size(), CV_32F);
+   encode(samples, r.classified);
+   int64 encoded = cv::getTickCount();
+
+   // Rows that couldn't be encoded are left out, copying the others only
+   // when there are any
+   vector<int> rows;
+   for (int i = 0; i < count; i++) {
+      if (r.classified[i]) rows.push_back(i);
+   }
+   cv::Mat queries = samples;
+   if (rows.size() < count) {
+      queries.create(rows.size(), samples.cols, CV_32F);
+      for (int i = 0; i < rows.size(); i++) {
+         samples.row(rows[i]).copyTo(queries.row(i));
+      }
+   }
+
+   cv::Mat indices, distances;
+   vector<float> labels;
+   if (!rows.empty()) {
+      labels = cls.classify(queries, indices, distances);
+   }
+   for (int i = 0; i < rows.size(); i++) {
+      r.labels[rows[i]] = labels[i];
+   }
+
+   if (with_neighbors && !indices.empty()) {
+      r.neighbors.create(count, indices.cols, CV_32S);
+      r.neighbors.setTo(cv::Scalar(-1));
+      r.distances = cv::Mat::zeros(count, distances.cols, CV_32F);
+      for (int i = 0; i < rows.size(); i++) {
+         indices.row(i).copyTo(r.neighbors.row(rows[i]));
+         distances.row(i).copyTo(r.distances.row(rows[i]));
+      }
+   }
+
+   double frequency = cv::getTickFrequency();
+   r.encode_seconds = (encoded - start) / frequency;
+   r.classify_seconds = (cv::getTickCount() - encoded) / frequency;
+   return r;
+}
+
+/**
+ * Classifies image files, which go through the feature pipeline
+ * @param[in]  files           the image files
+ * @param[in]  with_neighbors  whether to keep the nearest samples of each image
+ */
+batch_classifier::result batch_classifier::classify(const vector<string> &files,
+      bool with_neighbors) const {
+   return classify_rows(files.size(), with_neighbors,
+         [&](cv::Mat &samples, vector<unsigned char> &encoded) {
+      int index = 0;
+      pipeline.run(files, [&](feature_pipeline::image_features &features) {
+         if (features.size.area() > 0) {
+            copy_row(features.feature_vector, samples.ptr<float>(index));
+            encoded[index] = 1;
+         }
+         index++;
+      });
+   });
+}
+
+/**
+ * Classifies decoded images, describing and encoding them on as many
+ * threads as the pipeline settings give its feature stage
+ * @param[in]  images          grayscale images, empty ones are not classified
+ * @param[in]  with_neighbors  whether to keep the nearest samples of each image
+ */
+batch_classifier::result batch_classifier::classify(const vector<cv::Mat> &images,
+      bool with_neighbors) const {
+   return classify_rows(images.size(), with_neighbors,
+         [&](cv::Mat &samples, vector<unsigned char> &encoded) {
+      int thread_count = my_settings.feature_threads;
+      if (thread_count <= 0) {
+         thread_count = max(1u, thread::hardware_concurrency());
+      }
+      thread_count = max(1, min<int>(thread_count, images.size()));
+
+      // Images are handed out to threads as they finish, and the first
+      // error is rethrown once they all have
+      atomic<int> next_image(0);
+      exception_ptr error;
+      mutex error_lock;
+      auto encode_images = [&] {
+         try {
+            cv::Ptr<feature_extractor> extractor =
+                  feature_extractor::create(my_settings.features, my_settings.grid);
+            vector<cv::KeyPoint> keypoints;
+            cv::Mat descriptors;
+            int i;
+            while ((i = next_image++) < images.size()) {
+               if (images[i].empty()) continue;
+               extractor->extract(images[i], keypoints, descriptors);
+               copy_row(encoder.feature_vector(keypoints, descriptors, images[i].size()),
+                     samples.ptr<float>(i));
+               encoded[i] = 1;
+            }
+         } catch (...) {
+            lock_guard<mutex> guard(error_lock);
+            if (!error) error = current_exception();
+         }
+      };
+
+      vector<thread> threads;
+      for (int t = 1; t < thread_count; t++) {
+         threads.push_back(thread(encode_images));
+      }
+      encode_images();
+      for (int t = 0; t < threads.size(); t++) {
+         threads[t].join();
+      }
+      if (error) rethrow_exception(error);
+   });
+}
+
+/**
+ * Runs one feature pipeline over every file of a source, while another
+ * thread classifies the images it finishes in batches. A failure in either
+ * shuts both down and is rethrown.
+ * @param[in]  files       produces the image files to classify
+ * @param[in]  output      called with the answer for each image, in the
+ *                         order of the source, on the classifying thread
+ * @param[in]  batch_size  the most images classified with one call
+ */
+void batch_classifier::classify(const feature_pipeline::source &files, const answer &output,
+      int batch_size) const {
+   bounded_queue<feature_pipeline::image_features> ready(max(1, batch_size));
+   exception_ptr error;
+
+   thread classifying([&] {
+      try {
+         feature_pipeline::image_features next;
+         while (ready.pop(next)) {
+            vector<feature_pipeline::image_features> batch(1, std::move(next));
+            while (batch.size() < batch_size && ready.try_pop(next)) {
+               batch.push_back(std::move(next));
+            }
+
+            result r = classify_rows(batch.size(), false,
+                  [&](cv::Mat &samples, vector<unsigned char> &encoded) {
+               for (int i = 0; i < batch.size(); i++) {
+                  if (batch[i].size.area() == 0) continue;
+                  copy_row(batch[i].feature_vector, samples.ptr<float>(i));
+                  encoded[i] = 1;
+               }
+            });
+            for (int i = 0; i < batch.size(); i++) {
+               output(batch[i].file, r.classified[i], r.labels[i]);
+            }
+         }
+      } catch (...) {
+         error = current_exception();
+         ready.close();
+      }
+   });
+
+   // The pipeline stops as soon as the classifying thread can't take any
+   // more images
+   try {
+      pipeline.run(files, [&ready](feature_pipeline::image_features &features) {
+         if (!ready.push(std::move(features))) {
+            throw runtime_error("Classification stopped");
+         }
+      });
+   } catch (...) {
+      ready.close();
+      classifying.join();
+      if (error) rethrow_exception(error);
+      throw;
+   }
+   ready.close();
+   classifying.join();
+   if (error) rethrow_exception(error);
+}
@@ -0,0 +1,87 @@
+/**
+ * OpenCV image classifier
+ *
+ * Richie Steigerwald
+ *
+ * Copyright 2013 Richie Steigerwald <richie.steigerwald@gmail.com>
+ * This work is free. You can redistribute it and/or modify it under the
+ * terms of the Do What The Fuck You Want To Public License, Version 2,
+ * as published by Sam Hocevar. See http://www.wtfpl.net/ for more details.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "../cv/bag_of_features.h"
+#include "../cv/feature_pipeline.h"
+#include "classifier.h"
+
+/**
+ * Classifies many images with one call. The feature vectors of all of them
+ * are computed in parallel into the rows of one matrix, which is then
+ * classified at once, so the detectors, the encoder and the classifier are
+ * set up once per batch instead of once per image and the neighbor search
+ * can work through blocks of queries.
+ *
+ * Image files go through a feature_pipeline, so they are decoded, scaled and
+ * cached according to its settings. Images that are already decoded are
+ * described as they are, without scaling.
+ *
+ * Images that arrive one at a time, as requests to a server do, can be
+ * classified as they come through a single pipeline that stays up for as
+ * long as they keep coming, so its threads and feature extractors are only
+ * set up once.
+ */
+class batch_classifier {
+   public:
+      struct result {
+         // the label of each image, only meaningful where classified is set,
+         // which it isn't for images that could not be decoded
+         std::vector<float> labels;
+         std::vector<unsigned char> classified;
+
+         // CV_32S and CV_32F, one row per image with the indices of its
+         // nearest samples and their squared distances when they were asked
+         // for and the classifier is nearest neighbor. The rows of images
+         // that were not classified hold indices of -1.
+         cv::Mat neighbors;
+         cv::Mat distances;
+
+         // seconds spent computing the feature vectors and classifying them
+         double encode_seconds = 0;
+         double classify_seconds = 0;
+      };
+
+      // Receives the answer for each image from a source, in the order the
+      // source produced them. The label is only meaningful when classified.
+      typedef std::function<void(const std::string &file, bool classified, float label)> answer;
+
+   protected:
+      feature_pipeline::settings my_settings;
+      feature_pipeline pipeline;
+      bag_of_features encoder;
+      classifier cls;
+
+      template<class encode_rows>
+      result classify_rows(int count, bool with_neighbors, const encode_rows &encode) const;
+
+   public:
+      // Classifies with a bag of features that already has its vocabulary
+      batch_classifier(const bag_of_features &bof, const classifier &c,
+            const feature_pipeline::settings &s = feature_pipeline::settings());
+
+      // Classifies image files, or decoded grayscale images
+      result classify(const std::vector<std::string> &files, bool with_neighbors = false) const;
+      result classify(const std::vector<cv::Mat> &images, bool with_neighbors = false) const;
+
+      // Classifies the image files a source produces until it has no more.
+      // Whatever images are ready when the classifier gets to them, up to
+      // batch_size, are classified with one call.
+      void classify(const feature_pipeline::source &files, const answer &output,
+            int batch_size) const;
+};
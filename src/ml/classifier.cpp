@@ -11,64 +11,475 @@
 
 #include "classifier.h"
 
+#include <stdexcept>
+
+#include "../util/stage_stats.h"
+
+namespace {
+   // Copies rows into CV_32F, the type the row buffers hold
+   cv::Mat float_rows(const cv::Mat &m) {
+      cv::Mat f;
+      m.convertTo(f, CV_32F);
+      return f;
+   }
+
+   // Copies responses into a single CV_32F column
+   cv::Mat response_column(const cv::Mat &r) {
+      cv::Mat f = float_rows(r);
+      return f.reshape(1, f.total());
+   }
+
+   // Appends sparse rows to the buffers of others, moving their offsets past
+   // the entries already there
+   void append_sparse(const sparse_rows &s, row_buffer &offsets, row_buffer &columns,
+         row_buffer &values) {
+      if (offsets.empty()) {
+         *offsets.append_row<int>(1, CV_32S) = 0;
+      }
+      int end = columns.rows();
+      for (int i = 0; i < s.rows(); i++) {
+         end += s.row_size(i);
+         *offsets.append_row<int>(1, CV_32S) = end;
+      }
+      columns.append(s.columns);
+      values.append(s.values);
+   }
+
+   sparse_rows buffered_sparse(int cols, const row_buffer &offsets, const row_buffer &columns,
+         const row_buffer &values) {
+      sparse_rows s;
+      s.cols = cols;
+      s.offsets = offsets.mat();
+      s.columns = columns.rows() ? columns.mat() : cv::Mat(0, 1, CV_32S);
+      s.values = values.rows() ? values.mat() : cv::Mat(0, 1, CV_32F);
+      return s;
+   }
+
+   void add_sparse(model_writer &writer, const sparse_rows &s) {
+      cv::Mat cols = (cv::Mat_<int>(1, 1) << s.cols);
+      writer.add("sparse.cols", cols.clone());
+      writer.add("sparse.offsets", s.offsets);
+      writer.add("sparse.columns", s.columns);
+      writer.add("sparse.values", s.values);
+   }
+
+   sparse_rows get_sparse(const model_file &file) {
+      sparse_rows s;
+      s.cols = file.get("sparse.cols").at<int>(0, 0);
+      s.offsets = file.get("sparse.offsets");
+      s.columns = file.get("sparse.columns");
+      s.values = file.get("sparse.values");
+      return s;
+   }
+}
+
 void classifier::set_settings(const settings &s) { 
+   // Switching backends or changing how the SVM is trained needs the samples
+   // to be trained on again, if they are still around
+   bool retrain = s.backend != my_settings.backend ||
+                  (s.backend == settings::linear_svm_backend &&
+                   (s.svm.c != my_settings.svm.c ||
+                    s.svm.iterations != my_settings.svm.iterations ||
+                    s.svm.tolerance != my_settings.svm.tolerance));
+   bool has_samples = !samples.empty() || !sparse_samples.empty();
+   settings previous = my_settings;
+
+   // The exact neighbor search does not depend on the settings, and the
+   // index only needs rebuilding when the shape of its graph changes
+   bool rebuild = s.index.connections != my_settings.index.connections ||
+                  s.index.construction != my_settings.index.construction;
    my_settings = s;
-   train();
+
+   // A trained SVM has let its samples go, so it keeps its backend and the
+   // settings it was trained with until it is trained again
+   if (retrain && !has_samples && !svm.empty()) {
+      my_settings.backend = previous.backend;
+      my_settings.svm = previous.svm;
+   }
+   if (retrain && has_samples) {
+      train();
+   } else if (rebuild) {
+      build_index();
+   } else {
+      index.set_search(s.index.search);
+   }
 }
 
 void classifier::train(const cv::Mat &s, const cv::Mat &r) {
    samples = s;
+   sparse_samples = sparse_rows();
+   responses = r;
+   clear_updates();
+   train();
+}
+
+void classifier::train(const sparse_rows &s, const cv::Mat &r) {
+   samples.release();
+   sparse_samples = s;
    responses = r;
+   clear_updates();
    train();
 }
 
 void classifier::train() {
-   if (samples.data != NULL) {
-      nearest_neighbors.train(
-       samples,                // train data, row sample
-       responses,              // responses
-       cv::Mat(),              // sample index
-       false,                  // regression
-       my_settings.neighbors); // number of neighbors
+   // The SVM only needs its weights, so the samples are let go once it is
+   // trained
+   if (my_settings.backend == settings::linear_svm_backend) {
+      if (!removed_samples.empty()) {
+         drop_removed();
+      }
+      if (!sparse_samples.empty()) {
+         svm.train(sparse_samples, responses, my_settings.svm);
+      } else {
+         svm.train(samples, responses, my_settings.svm);
+      }
+      samples.release();
+      sparse_samples = sparse_rows();
+      responses.release();
+      mapped_file.reset();
+      clear_updates();
+      neighbors = nearest_neighbors();
+      index = hnsw_index();
+      return;
+   }
+
+   // Indexing uses the samples in place, so this is only the sample norms
+   svm = linear_svm();
+   if (!sparse_samples.empty()) {
+      neighbors.train(sparse_samples, responses);
+   } else {
+      neighbors.train(samples, responses);
+   }
+   build_index();
+}
+
+void classifier::build_index() {
+   index.build(samples, my_settings.index);
+   for (int i = 0; i < removed_samples.size(); i++) {
+      index.remove(removed_samples[i]);
+   }
+}
+
+void classifier::clear_updates() {
+   sample_rows = row_buffer();
+   response_rows = row_buffer();
+   offset_rows = row_buffer();
+   column_rows = row_buffer();
+   value_rows = row_buffer();
+   removed_samples.clear();
+   saved_path.clear();
+   saved_rows = saved_removals = 0;
+}
+
+/**
+ * Copies the samples that were not removed, and their responses, into the
+ * row buffers. The samples after a removed one move down.
+ */
+void classifier::drop_removed() {
+   std::vector<unsigned char> removed(responses.total(), 0);
+   for (int i = 0; i < removed_samples.size(); i++) {
+      removed[removed_samples[i]] = 1;
+   }
+
+   row_buffer kept_samples, kept_responses, kept_offsets, kept_columns, kept_values;
+   cv::Mat r = response_column(responses);
+   for (int i = 0; i < removed.size(); i++) {
+      if (removed[i]) continue;
+      if (!sparse_samples.empty()) {
+         append_sparse(sparse_samples.slice(i, i + 1), kept_offsets, kept_columns, kept_values);
+      } else {
+         kept_samples.append(float_rows(samples.row(i)));
+      }
+      kept_responses.append(r.row(i));
+   }
+
+   clear_updates();
+   response_rows = kept_responses;
+   responses = response_rows.mat();
+   if (!sparse_samples.empty()) {
+      offset_rows = kept_offsets;
+      column_rows = kept_columns;
+      value_rows = kept_values;
+      sparse_samples = buffered_sparse(sparse_samples.cols, offset_rows, column_rows, value_rows);
+   } else {
+      sample_rows = kept_samples;
+      samples = sample_rows.mat();
+   }
+}
+
+/**
+ * Adds samples to a trained nearest neighbor classifier and inserts them
+ * into its index
+ * @param[in]  s  the new samples, one per row
+ * @param[in]  r  the response of each new sample
+ */
+void classifier::add(const cv::Mat &s, const cv::Mat &r) {
+   if (s.rows == 0) return;
+   CV_Assert(my_settings.backend == settings::nearest_neighbor_backend && sparse_samples.empty());
+   CV_Assert((int)r.total() == s.rows && (samples.empty() || s.cols == samples.cols));
+
+   // The samples may be the caller's or mapped from a file, so they are
+   // copied into storage that can grow the first time
+   if (response_rows.rows() != (int)responses.total()) {
+      sample_rows = row_buffer();
+      response_rows = row_buffer();
+      sample_rows.append(float_rows(samples));
+      response_rows.append(response_column(responses));
+   }
+   sample_rows.append(float_rows(s));
+   response_rows.append(response_column(r));
+   samples = sample_rows.mat();
+   responses = response_rows.mat();
+
+   neighbors.add(samples, responses);
+   if (index.empty()) {
+      build_index();
+   } else {
+      index.add(samples);
+   }
+}
+
+/**
+ * Adds sparse samples to a trained nearest neighbor classifier
+ * @param[in]  s  the new samples
+ * @param[in]  r  the response of each new sample
+ */
+void classifier::add(const sparse_rows &s, const cv::Mat &r) {
+   if (s.empty()) return;
+   CV_Assert(my_settings.backend == settings::nearest_neighbor_backend && samples.empty());
+   CV_Assert((int)r.total() == s.rows() && (sparse_samples.empty() || s.cols == sparse_samples.cols));
+
+   if (response_rows.rows() != (int)responses.total()) {
+      offset_rows = row_buffer();
+      column_rows = row_buffer();
+      value_rows = row_buffer();
+      response_rows = row_buffer();
+      append_sparse(sparse_samples, offset_rows, column_rows, value_rows);
+      response_rows.append(response_column(responses));
+   }
+   append_sparse(s, offset_rows, column_rows, value_rows);
+   response_rows.append(response_column(r));
+   sparse_samples = buffered_sparse(s.cols, offset_rows, column_rows, value_rows);
+   responses = response_rows.mat();
+
+   neighbors.add(sparse_samples, responses);
+}
+
+/**
+ * Leaves samples out of classification. They keep their place, so the
+ * indices of the other samples don't change.
+ * @param[in]  indices  the samples to remove
+ */
+void classifier::remove(const std::vector<int> &indices) {
+   CV_Assert(my_settings.backend == settings::nearest_neighbor_backend);
+   for (int i = 0; i < indices.size(); i++) {
+      CV_Assert(indices[i] >= 0 && indices[i] < size());
+      if (neighbors.is_removed(indices[i])) continue;
+      neighbors.remove(indices[i]);
+      index.remove(indices[i]);
+      removed_samples.push_back(indices[i]);
    }
 }
 
 std::vector<float> classifier::classify(const cv::Mat &samples) const {
-   cv::Mat results(samples.rows, 1, CV_32F);
-   nearest_neighbors.find_nearest(samples, my_settings.neighbors, &results);
+   cv::Mat indices, distances;
+   return classify(samples, indices, distances);
+}
+
+std::vector<float> classifier::classify(const cv::Mat &samples, cv::Mat &indices,
+      cv::Mat &distances) const {
+   stage_timer timer("classify", samples.rows);
+   if (my_settings.backend == settings::linear_svm_backend) {
+      indices.release();
+      distances.release();
+      return svm.predict(samples);
+   }
+
+   if (index.empty()) {
+      neighbors.find_nearest(samples, my_settings.neighbors, indices, distances);
+   } else {
+      index.find_nearest(samples, my_settings.neighbors, indices, distances);
+   }
+   return neighbors.vote(indices);
+}
+
+std::vector<float> classifier::classify(const sparse_rows &samples) const {
+   if (!index.empty() && my_settings.backend != settings::linear_svm_backend) {
+      return classify(samples.dense());
+   }
 
-   std::vector<float> responses;
-   for (int i = 0; i < results.rows; i++) {
-      responses.push_back(results.at<float>(i,0));
+   stage_timer timer("classify", samples.rows());
+   if (my_settings.backend == settings::linear_svm_backend) {
+      return svm.predict(samples);
    }
-   return responses;
+   return neighbors.predict(samples, my_settings.neighbors);
 }
 
+/**
+ * Writes the classifier to a binary model file
+ * @param[in]  path  the file to write
+ */
+void classifier::save_binary(const std::string &path) const {
+   model_writer writer;
+   writer.add_object("settings", my_settings);
+   writer.add("samples", samples);
+   writer.add("responses", responses);
+   if (!sparse_samples.empty()) {
+      add_sparse(writer, sparse_samples);
+   }
+   if (!removed_samples.empty()) {
+      writer.add("removed", int_row(removed_samples));
+   }
+   index.save(writer, "index.");
+   if (!svm.empty()) {
+      svm.save(writer, "svm.");
+   }
+   writer.write(path);
+
+   saved_path = path;
+   saved_rows = size();
+   saved_removals = removed_samples.size();
+}
+
+/**
+ * Appends the samples added and removed since the file was saved or loaded
+ * as another model in it, which load_binary applies after the others
+ * @param[in]  path  the file the classifier was saved to or loaded from
+ */
+void classifier::append_delta(const std::string &path) const {
+   if (saved_path.empty() || path != saved_path) {
+      throw std::runtime_error("Deltas can only be appended to the model file last saved or loaded: " + path);
+   }
+   CV_Assert(my_settings.backend == settings::nearest_neighbor_backend && saved_rows <= size());
+   if (saved_rows == size() && saved_removals == removed_samples.size()) return;
+
+   model_writer writer;
+   if (!sparse_samples.empty()) {
+      add_sparse(writer, sparse_samples.slice(saved_rows, size()));
+   } else {
+      writer.add("samples", samples.rowRange(saved_rows, size()));
+   }
+   writer.add("responses", response_column(responses).rowRange(saved_rows, size()));
+   writer.add("removed", int_row(removed_samples, saved_removals));
+   writer.append(path);
+
+   saved_rows = size();
+   saved_removals = removed_samples.size();
+}
+
+/**
+ * Maps a binary model file written by save_binary and trains on the mapped
+ * samples and responses. A saved neighbor index is reused, not rebuilt, and
+ * deltas appended to the file are added to it.
+ * @param[in]  path  the file to load
+ */
+void classifier::load_binary(const std::string &path) {
+   std::vector<model_file> models = model_file::read_all(path);
+   std::shared_ptr<const model_file> file = std::make_shared<model_file>(models[0]);
+   file->get_object("settings", my_settings);
+   samples = file->get("samples");
+   responses = file->get("responses");
+   sparse_samples = sparse_rows();
+   mapped_file = file;
+   clear_updates();
+
+   // An SVM only has its weights
+   if (my_settings.backend == settings::linear_svm_backend) {
+      svm.load(*file, "svm.");
+      neighbors = nearest_neighbors();
+      index = hnsw_index();
+      return;
+   }
+   svm = linear_svm();
+
+   if (file->has("sparse.cols")) {
+      sparse_samples = get_sparse(*file);
+      neighbors.train(sparse_samples, responses);
+   } else {
+      neighbors.train(samples, responses);
+   }
+
+   // Files written before the index existed have no graph to load
+   if (file->has("index.settings")) {
+      index.load(*file, "index.");
+      index.attach(samples);
+   } else {
+      build_index();
+   }
+   std::vector<int> removed;
+   if (file->has("removed")) {
+      int_vector(file->get("removed"), removed);
+      remove(removed);
+   }
+
+   for (int i = 1; i < models.size(); i++) {
+      const model_file &delta = models[i];
+      if (delta.has("sparse.cols")) {
+         add(get_sparse(delta), delta.get("responses"));
+      } else {
+         add(delta.get("samples"), delta.get("responses"));
+      }
+      int_vector(delta.get("removed"), removed);
+      remove(removed);
+   }
+   saved_path = path;
+   saved_rows = size();
+   saved_removals = removed_samples.size();
+}
 
 void classifier_factory::add_feature_vector(const std::vector<double> &feature_vector, float response) {
-   cv::Mat temp(1, feature_vector.size(), CV_32F);
-   cv::Mat resp(1, 1, CV_32F);
-   
+   assert(offset_rows.empty());
+   assert(sample_rows.empty() || feature_vector.size() == samples.cols);
+
+   // Write the new row straight into the sample storage
+   float *sample = sample_rows.append_row<float>(feature_vector.size(), CV_32F);
    for (int i = 0; i < feature_vector.size(); i++) {
-      temp.at<float>(0, i) = feature_vector[i];
+      sample[i] = feature_vector[i];
    }
-   resp.at<float>(0,0) = response;
+   *response_rows.append_row<float>(1, CV_32F) = response;
 
-   if (this->samples.data == NULL) {
-      temp.copyTo(this->samples);
-      resp.copyTo(this->responses);
-   } else {
-      assert(temp.cols == this->samples.cols);
-      cv::vconcat(this->samples, temp, this->samples);
-      cv::vconcat(this->responses, resp, this->responses);
+   samples = sample_rows.mat();
+   responses = response_rows.mat();
+}
+
+void classifier_factory::add_feature_vector(const sparse_vector &feature_vector, float response) {
+   assert(sample_rows.empty());
+   assert(offset_rows.empty() || feature_vector.size == sparse_samples.cols);
+
+   // Only the non-zero entries are stored, each row ending where the next
+   // one starts
+   if (offset_rows.empty()) {
+      *offset_rows.append_row<int>(1, CV_32S) = 0;
+   }
+   int nonzeros = feature_vector.nonzeros();
+   if (nonzeros) {
+      column_rows.append(cv::Mat(nonzeros, 1, CV_32S, (void *)&feature_vector.columns[0]));
+      value_rows.append(cv::Mat(nonzeros, 1, CV_32F, (void *)&feature_vector.values[0]));
    }
+   *offset_rows.append_row<int>(1, CV_32S) = column_rows.rows();
+   *response_rows.append_row<float>(1, CV_32F) = response;
+
+   sparse_samples.cols = feature_vector.size;
+   sparse_samples.offsets = offset_rows.mat();
+   sparse_samples.columns = column_rows.rows() ? column_rows.mat() : cv::Mat(0, 1, CV_32S);
+   sparse_samples.values = value_rows.rows() ? value_rows.mat() : cv::Mat(0, 1, CV_32F);
+   responses = response_rows.mat();
+}
+
+void classifier_factory::reserve(int rows, int cols) {
+   sample_rows.reserve(rows, cols, CV_32F);
+   response_rows.reserve(rows, 1, CV_32F);
 }
 
  
 classifier classifier_factory::create_classifier(const classifier::settings &s) {
    classifier cls;
    cls.set_settings(s);
-   cls.train(samples, responses);
+   if (!sparse_samples.empty()) {
+      cls.train(sparse_samples, responses);
+   } else {
+      cls.train(samples, responses);
+   }
    return cls;
 }
 
@@ -13,27 +13,58 @@
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
+#include <boost/serialization/vector.hpp>
+#include <boost/serialization/version.hpp>
 
 #include <opencv2/core/core.hpp>
-#include <opencv2/ml/ml.hpp>
 
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "../cv/serialize_cvmat.h"
+#include "../util/model_file.h"
+#include "../util/row_buffer.h"
+#include "../util/sparse_rows.h"
+#include "hnsw_index.h"
+#include "linear_svm.h"
+#include "nearest_neighbors.h"
 
 /**
  * This is meant to be a generic classifier that could potentially be
  * implemented using Support Vector Machines, Neural Networks, Decision Trees,
  * or whatever classifier you fancy. Currently the classifier is implemented
- * using k-nearest-neighbors.
+ * using k-nearest-neighbors, searched exactly or, when the settings enable
+ * it, through an approximate hnsw_index for large sets of samples, or using
+ * a linear SVM whose cost does not depend on the number of samples at all.
+ *
+ * A linear SVM classifier keeps only its weights once trained, so changing
+ * its backend or its training settings afterwards has no effect until it is
+ * trained again.
+ *
+ * A nearest neighbor classifier can be updated without training it again:
+ * added samples are inserted into the index, and removed samples are only
+ * left out of searches, keeping the indices of the others. The changes since
+ * a binary model file was saved or loaded can be appended to it as a delta,
+ * which is applied the same way when the file is loaded.
  */
 class classifier {
 
    public:
    struct settings {
+      // how samples are classified
+      enum backend_type { nearest_neighbor_backend, linear_svm_backend };
+      backend_type backend;
+
       int neighbors;
-      settings() : neighbors(5) { }
-      settings(const settings &s) { }
+
+      // optional approximate neighbor search, exact when disabled
+      hnsw_index::settings index;
+
+      // training of the linear SVM backend
+      linear_svm::settings svm;
+
+      settings() : backend(nearest_neighbor_backend), neighbors(5) { }
 
       protected:
       // Class serialization
@@ -44,12 +75,53 @@ class classifier {
 
    protected:
    settings my_settings;
-   cv::KNearest nearest_neighbors;
+   nearest_neighbors neighbors;
+
+   // approximate neighbor search, empty unless enabled in the settings
+   hnsw_index index;
+
+   // the weights of the linear SVM backend, empty unless it is selected
+   linear_svm svm;
+
    cv::Mat samples;
    cv::Mat responses;
 
+   // used instead of samples when trained on sparse feature vectors, the
+   // approximate index only covers dense samples
+   sparse_rows sparse_samples;
+
+   // the binary model file the samples were loaded from, if any
+   std::shared_ptr<const model_file> mapped_file;
+
+   // storage that added samples and responses are appended to, holding a
+   // copy of the samples once the first ones are added
+   row_buffer sample_rows;
+   row_buffer response_rows;
+   row_buffer offset_rows;
+   row_buffer column_rows;
+   row_buffer value_rows;
+
+   // the samples that were removed, in the order they were removed
+   std::vector<int> removed_samples;
+
+   // the binary model file the classifier was last saved to or loaded
+   // from, and how many samples and removals it holds. Deltas can only be
+   // appended to that file, and training again forgets it.
+   mutable std::string saved_path;
+   mutable int saved_rows = 0;
+   mutable int saved_removals = 0;
+
    void train();
 
+   // (Re)builds the approximate neighbor index over the samples
+   void build_index();
+
+   // Forgets the added and removed samples and the file they would be
+   // appended to, or only the removed ones by leaving them out of the
+   // samples for good
+   void clear_updates();
+   void drop_removed();
+
    public:
    // Update the settings for classification
    void set_settings(const settings &s);
@@ -57,9 +129,41 @@ class classifier {
 
    // Trains a classifier with a set of samples and responses
    void train(const cv::Mat &s, const cv::Mat &r);
+   void train(const sparse_rows &s, const cv::Mat &r);
+
+   // Adds samples and their responses to a nearest neighbor classifier,
+   // the same kind of samples it was trained on
+   void add(const cv::Mat &s, const cv::Mat &r);
+   void add(const sparse_rows &s, const cv::Mat &r);
+
+   // Removes samples from a nearest neighbor classifier by their index in
+   // the order they were trained on and added. Removing a sample again does
+   // nothing.
+   void remove(const std::vector<int> &indices);
+
+   // The samples including removed ones, which keep their indices
+   int size() const { return neighbors.size(); }
 
-   // Classifies samples and returns their corresponding labels
+   // Classifies samples and returns their corresponding labels. Dense and
+   // sparse samples can be classified whichever kind it was trained on.
    std::vector<float> classify(const cv::Mat &samples) const;
+   std::vector<float> classify(const sparse_rows &samples) const;
+
+   // Also gives the indices of the nearest samples of each query and their
+   // squared distances, nearest first, as nearest_neighbors::find_nearest
+   // does. Both are left empty for a linear SVM.
+   std::vector<float> classify(const cv::Mat &samples, cv::Mat &indices, cv::Mat &distances) const;
+
+   // Saves to or loads from a binary model file, which is much faster to
+   // load than a text archive since the samples are mapped, not parsed
+   void save_binary(const std::string &path) const;
+   void load_binary(const std::string &path);
+
+   // Appends the samples added and removed since the classifier was saved
+   // to or loaded from a binary model file to the end of that file. Throws
+   // if path is not the file it was last saved to or loaded from, or it was
+   // trained again since.
+   void append_delta(const std::string &path) const;
 
    protected:
    // Class serialization
@@ -75,27 +179,94 @@ class classifier {
  * classifier by building a list of samples.
  */
 struct classifier_factory {
+   // the samples and responses added so far
    cv::Mat samples;
    cv::Mat responses;
+
+   // the samples added so far as sparse feature vectors, a factory holds
+   // either dense or sparse samples
+   sparse_rows sparse_samples;
    
    void add_feature_vector(const std::vector<double> &vector, float response);
+   void add_feature_vector(const sparse_vector &vector, float response);
+
+   // Make room for a total number of samples ahead of time
+   void reserve(int rows, int cols);
    
    classifier create_classifier(const classifier::settings &s = classifier::settings());
+
+   protected:
+   row_buffer sample_rows;
+   row_buffer response_rows;
+
+   // the offsets, columns, and values of the sparse samples
+   row_buffer offset_rows;
+   row_buffer column_rows;
+   row_buffer value_rows;
 };
 
 template<class archive>
 void classifier::serialize(archive &ar, const unsigned int version) {
+   if (archive::is_loading::value) {
+      clear_updates();
+   }
    ar &my_settings;
    ar &samples;
    ar &responses;
+   if (version > 0) {
+      ar &index;
+   }
+   if (version > 1) {
+      ar &sparse_samples;
+   }
+   if (version > 2) {
+      ar &svm;
+   }
+   if (version > 3) {
+      ar &removed_samples;
+   } else {
+      removed_samples.clear();
+   }
    if (archive::is_loading::value) {
-      train();
+      // An SVM was saved without samples and has nothing else to set up
+      if (my_settings.backend == settings::linear_svm_backend) {
+         neighbors = nearest_neighbors();
+         index = hnsw_index();
+         return;
+      }
+
+      // The graph was saved with the samples, so it only needs to refer to
+      // them again
+      if (!sparse_samples.empty()) {
+         neighbors.train(sparse_samples, responses);
+      } else {
+         neighbors.train(samples, responses);
+      }
+      if (version > 0) {
+         index.attach(samples);
+      } else {
+         build_index();
+      }
+      for (int i = 0; i < removed_samples.size(); i++) {
+         neighbors.remove(removed_samples[i]);
+         index.remove(removed_samples[i]);
+      }
    }
 }
 
 template<class archive>
 void classifier::settings::serialize(archive &ar, const unsigned int version) {
    ar &neighbors;
+   if (version > 0) {
+      ar &index;
+   }
+   if (version > 1) {
+      ar &backend;
+      ar &svm;
+   }
 }
 
+BOOST_CLASS_VERSION(classifier::settings, 2)
+BOOST_CLASS_VERSION(classifier, 4)
+
 
@@ -0,0 +1,388 @@
+/**
+ * OpenCV image classifier
+ *
+ * Richie Steigerwald
+ *
+ * Copyright 2013 Richie Steigerwald <richie.steigerwald@gmail.com>
+ * This work is free. You can redistribute it and/or modify it under the
+ * terms of the Do What The Fuck You Want To Public License, Version 2,
+ * as published by Sam Hocevar. See http://www.wtfpl.net/ for more details.
+ */
+
+#include "hnsw_index.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <thread>
+
+using namespace std;
+
+// rows of queries handed to a thread at a time
+static const int query_block = 32;
+
+namespace {
+   // The visit each node was last seen in by the searches of one thread.
+   // The marks outlive a search and are only cleared when the visit count
+   // wraps, so a query costs as much as the nodes it visits rather than a
+   // mark for every sample.
+   struct visit_marks {
+      vector<unsigned> visited;
+      unsigned visit = 0;
+
+      // Makes room for the marks of rows nodes
+      void reserve(int rows) {
+         if (visited.size() < rows) visited.resize(rows, 0);
+      }
+   };
+
+   thread_local visit_marks this_thread_marks;
+}
+
+int *hnsw_index::links(int node, int level) {
+   if (level == 0) return &base_links[node * (1 + capacity(0))];
+   return &upper_links[upper_offset[node] + (level - 1) * (1 + capacity(1))];
+}
+
+const int *hnsw_index::links(int node, int level) const {
+   return const_cast<hnsw_index *>(this)->links(node, level);
+}
+
+/**
+ * The squared distance from a point to a sample
+ */
+float hnsw_index::distance(const float *a, int node) const {
+   const float *b = points.ptr<float>(node);
+   float sum = 0;
+   for (int i = 0; i < points.cols; i++) {
+      float diff = a[i] - b[i];
+      sum += diff * diff;
+   }
+   return sum;
+}
+
+/**
+ * Explores one layer of the graph outward from a set of nodes
+ * @param[in]     point    the point being searched for
+ * @param[in,out] found    the nodes to start from, then the ef nearest nodes
+ *                         found, as a heap with the furthest on top
+ * @param[in]     ef       the number of nodes to keep
+ * @param[in]     level    the layer to explore
+ * @param[in,out] visited  the visit each node was last seen in
+ * @param[in,out] visit    the number of the previous visit
+ */
+void hnsw_index::search_layer(const float *point, vector<candidate> &found, int ef, int level,
+      vector<unsigned> &visited, unsigned &visit) const {
+   if (++visit == 0) {
+      fill(visited.begin(), visited.end(), 0);
+      visit = 1;
+   }
+
+   priority_queue<candidate, vector<candidate>, greater<candidate> > frontier(found.begin(), found.end());
+   make_heap(found.begin(), found.end());
+   for (int i = 0; i < found.size(); i++) {
+      visited[found[i].second] = visit;
+   }
+
+   while (!frontier.empty()) {
+      candidate closest = frontier.top();
+      if (found.size() >= ef && closest.first > found.front().first) break;
+      frontier.pop();
+
+      const int *neighbors = links(closest.second, level);
+      for (int i = 1; i <= neighbors[0]; i++) {
+         int neighbor = neighbors[i];
+         if (visited[neighbor] == visit) continue;
+         visited[neighbor] = visit;
+
+         float d = distance(point, neighbor);
+         if (found.size() < ef || d < found.front().first) {
+            frontier.push(candidate(d, neighbor));
+            found.push_back(candidate(d, neighbor));
+            push_heap(found.begin(), found.end());
+            if (found.size() > ef) {
+               pop_heap(found.begin(), found.end());
+               found.pop_back();
+            }
+         }
+      }
+   }
+}
+
+/**
+ * Picks the neighbors of a node from candidates, nearest first, skipping any
+ * candidate that is closer to an already picked neighbor than to the node so
+ * that the links spread out in every direction
+ * @param[in,out] found  the candidates with their distances to the node, then
+ *                       the picked neighbors
+ * @param[in]     count  the most neighbors to pick
+ */
+void hnsw_index::select_neighbors(vector<candidate> &found, int count) const {
+   sort(found.begin(), found.end());
+   vector<candidate> selected;
+   for (int i = 0; i < found.size() && selected.size() < count; i++) {
+      const float *point = points.ptr<float>(found[i].second);
+      bool diverse = true;
+      for (int j = 0; j < selected.size() && diverse; j++) {
+         diverse = distance(point, selected[j].second) >= found[i].first;
+      }
+      if (diverse) selected.push_back(found[i]);
+   }
+   found.swap(selected);
+}
+
+/**
+ * Links a node to a new neighbor, dropping its least useful links when it
+ * has no room left
+ */
+void hnsw_index::connect(int node, int neighbor, float d, int level) {
+   int *own = links(node, level);
+   if (own[0] < capacity(level)) {
+      own[++own[0]] = neighbor;
+      return;
+   }
+
+   const float *point = points.ptr<float>(node);
+   vector<candidate> found(1, candidate(d, neighbor));
+   for (int i = 1; i <= own[0]; i++) {
+      found.push_back(candidate(distance(point, own[i]), own[i]));
+   }
+   select_neighbors(found, capacity(level));
+   own[0] = found.size();
+   for (int i = 0; i < found.size(); i++) {
+      own[i + 1] = found[i].second;
+   }
+}
+
+/**
+ * Adds a sample to every layer up to its level
+ */
+void hnsw_index::insert(int node, int level, vector<unsigned> &visited, unsigned &visit) {
+   if (entry_point < 0) {
+      entry_point = node;
+      top_level = level;
+      return;
+   }
+
+   const float *point = points.ptr<float>(node);
+   vector<candidate> found(1, candidate(distance(point, entry_point), entry_point));
+
+   // Only the closest node matters on layers this node is not part of
+   for (int l = top_level; l > level; l--) {
+      search_layer(point, found, 1, l, visited, visit);
+   }
+
+   for (int l = min(level, top_level); l >= 0; l--) {
+      search_layer(point, found, my_settings.construction, l, visited, visit);
+
+      vector<candidate> selected = found;
+      select_neighbors(selected, my_settings.connections);
+      int *own = links(node, l);
+      own[0] = selected.size();
+      for (int i = 0; i < selected.size(); i++) {
+         own[i + 1] = selected[i].second;
+         connect(selected[i].second, node, selected[i].first, l);
+      }
+   }
+
+   if (level > top_level) {
+      entry_point = node;
+      top_level = level;
+   }
+}
+
+/**
+ * Builds the graph by inserting the samples one at a time
+ * @param[in]  p  the samples, one per row
+ * @param[in]  s  the shape of the graph
+ */
+void hnsw_index::build(const cv::Mat &p, const settings &s) {
+   my_settings = s;
+   levels.clear();
+   base_links.clear();
+   upper_offset.clear();
+   upper_links.clear();
+   removed.clear();
+   entry_point = top_level = -1;
+   points.release();
+
+   if (my_settings.connections < 2 || p.rows == 0) return;
+   attach(p);
+
+   cv::RNG rng(points.rows);
+   add_nodes(0, rng);
+}
+
+/**
+ * Inserts every sample from the first one not yet in the graph
+ * @param[in]      first  the first new sample
+ * @param[in,out]  rng    draws the level of each new node
+ */
+void hnsw_index::add_nodes(int first, cv::RNG &rng) {
+   // Levels are drawn from an exponential distribution so that each layer
+   // holds about 1 / connections of the nodes of the layer below it
+   const int rows = points.rows;
+   const double scale = 1 / log((double)my_settings.connections);
+   levels.resize(rows);
+   upper_offset.resize(rows, -1);
+   removed.resize(rows, 0);
+   for (int i = first; i < rows; i++) {
+      levels[i] = (int)(-log(1 - rng.uniform(0., 1.)) * scale);
+      if (levels[i] > 0) {
+         upper_offset[i] = upper_links.size();
+         upper_links.resize(upper_links.size() + levels[i] * (1 + capacity(1)), 0);
+      }
+   }
+   base_links.resize(rows * (1 + capacity(0)), 0);
+
+   visit_marks &marks = this_thread_marks;
+   marks.reserve(rows);
+   for (int i = first; i < rows; i++) {
+      insert(i, levels[i], marks.visited, marks.visit);
+   }
+}
+
+/**
+ * Inserts new samples into a built graph, the way build inserted the others
+ * @param[in]  p  the samples the graph was built over followed by new ones
+ */
+void hnsw_index::add(const cv::Mat &p) {
+   if (my_settings.connections < 2) return;
+   if (empty()) {
+      build(p, my_settings);
+      return;
+   }
+
+   const int first = levels.size();
+   CV_Assert(p.rows >= first);
+   if (p.type() == CV_32F && p.isContinuous()) {
+      points = p;
+   } else {
+      p.convertTo(points, CV_32F);
+   }
+
+   cv::RNG rng(points.rows);
+   add_nodes(first, rng);
+}
+
+/**
+ * Marks a sample as removed. It keeps its links so the graph stays connected.
+ */
+void hnsw_index::remove(int node) {
+   if (node >= 0 && node < removed.size()) removed[node] = 1;
+}
+
+/**
+ * Refers to the samples of a loaded index, which must be the ones it was
+ * built over
+ */
+void hnsw_index::attach(const cv::Mat &p) {
+   if (p.empty() || (p.type() == CV_32F && p.isContinuous())) {
+      points = p;
+   } else {
+      p.convertTo(points, CV_32F);
+   }
+   CV_Assert(empty() || points.rows == levels.size());
+   removed.assign(levels.size(), 0);
+}
+
+/**
+ * Searches the graph for the nearest samples of every query
+ * @param[in]  queries    the queries, one per row, with as many columns as the samples
+ * @param[in]  k          the number of neighbors to find
+ * @param[out] indices    CV_32S, the sample indices of each query's neighbors,
+ *                        -1 past the last one found
+ * @param[out] distances  CV_32F, the squared distances of each query's neighbors
+ */
+void hnsw_index::find_nearest(const cv::Mat &queries, int k, cv::Mat &indices,
+      cv::Mat &distances) const {
+   CV_Assert(!empty() && k > 0 && queries.cols == points.cols);
+   k = min(k, points.rows);
+
+   cv::Mat q = queries;
+   if (q.type() != CV_32F) queries.convertTo(q, CV_32F);
+
+   indices.create(q.rows, k, CV_32S);
+   distances.create(q.rows, k, CV_32F);
+   const int ef = max(my_settings.search, k);
+
+   int blocks = (q.rows + query_block - 1) / query_block;
+   int thread_count = min<int>(blocks, max(1u, thread::hardware_concurrency()));
+   atomic<int> next_block(0);
+   auto search = [&] {
+      visit_marks &marks = this_thread_marks;
+      marks.reserve(points.rows);
+      vector<candidate> found;
+
+      int block;
+      while ((block = next_block++) < blocks) {
+         int last = min((block + 1) * query_block, q.rows);
+         for (int row = block * query_block; row < last; row++) {
+            const float *point = q.ptr<float>(row);
+            found.assign(1, candidate(distance(point, entry_point), entry_point));
+            for (int l = top_level; l > 0; l--) {
+               search_layer(point, found, 1, l, marks.visited, marks.visit);
+            }
+            search_layer(point, found, ef, 0, marks.visited, marks.visit);
+            sort(found.begin(), found.end());
+
+            int *nearest = indices.ptr<int>(row);
+            float *nearest_distances = distances.ptr<float>(row);
+            int j = 0;
+            for (int i = 0; i < found.size() && j < k; i++) {
+               if (removed[found[i].second]) continue;
+               nearest[j] = found[i].second;
+               nearest_distances[j++] = found[i].first;
+            }
+            for (; j < k; j++) {
+               nearest[j] = -1;
+               nearest_distances[j] = 0;
+            }
+         }
+      }
+   };
+
+   vector<thread> threads;
+   for (int i = 1; i < thread_count; i++) {
+      threads.push_back(thread(search));
+   }
+   search();
+   for (int i = 0; i < threads.size(); i++) {
+      threads[i].join();
+   }
+}
+
+/**
+ * Adds the graph to a binary model file
+ * @param[in]  writer  the model file being written
+ * @param[in]  prefix  prepended to the name of every block
+ */
+void hnsw_index::save(model_writer &writer, const string &prefix) const {
+   writer.add_object(prefix + "settings", my_settings);
+   writer.add(prefix + "levels", int_row(levels));
+   writer.add(prefix + "base_links", int_row(base_links));
+   writer.add(prefix + "upper_offset", int_row(upper_offset));
+   writer.add(prefix + "upper_links", int_row(upper_links));
+   cv::Mat entry = (cv::Mat_<int>(1, 2) << entry_point, top_level);
+   writer.add(prefix + "entry", entry.clone());
+}
+
+/**
+ * Loads a graph saved with save. The samples still need to be attached.
+ * @param[in]  file    the mapped model file
+ * @param[in]  prefix  prepended to the name of every block
+ */
+void hnsw_index::load(const model_file &file, const string &prefix) {
+   file.get_object(prefix + "settings", my_settings);
+   int_vector(file.get(prefix + "levels"), levels);
+   int_vector(file.get(prefix + "base_links"), base_links);
+   int_vector(file.get(prefix + "upper_offset"), upper_offset);
+   int_vector(file.get(prefix + "upper_links"), upper_links);
+   cv::Mat entry = file.get(prefix + "entry");
+   entry_point = entry.at<int>(0, 0);
+   top_level = entry.at<int>(0, 1);
+   removed.assign(levels.size(), 0);
+   points.release();
+}
@@ -0,0 +1,145 @@
+/**
+ * OpenCV image classifier
+ *
+ * Richie Steigerwald
+ *
+ * Copyright 2013 Richie Steigerwald <richie.steigerwald@gmail.com>
+ * This work is free. You can redistribute it and/or modify it under the
+ * terms of the Do What The Fuck You Want To Public License, Version 2,
+ * as published by Sam Hocevar. See http://www.wtfpl.net/ for more details.
+ */
+
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/serialization/vector.hpp>
+
+#include "../util/model_file.h"
+
+/**
+ * An approximate nearest neighbor index over row samples, built as a
+ * hierarchical navigable small world graph. Every sample is a node linked to
+ * a few of its nearest samples, and a sparse subset of the nodes also forms
+ * coarser graphs layered above it. A search walks greedily down the coarse
+ * layers and then explores the bottom layer from the closest node found,
+ * keeping a fixed number of candidates, so its cost grows with the log of the
+ * number of samples instead of linearly.
+ *
+ * The index refers to the samples rather than copying them, so they have to
+ * be attached again after the index is loaded. Samples can be added to a
+ * built graph one at a time, and removed ones stay in the graph so that
+ * searches can still pass through them, but are left out of the results.
+ */
+class hnsw_index {
+
+   public:
+      struct settings {
+         // links per node on the upper layers and twice as many on the
+         // bottom layer, 0 disables the index
+         int connections = 0;
+
+         // candidates kept while inserting a sample, more builds a better
+         // graph more slowly
+         int construction = 100;
+
+         // candidates kept while searching, more gives better recall at the
+         // cost of latency
+         int search = 64;
+
+         friend class boost::serialization::access;
+         template<class archive>
+         void serialize(archive &ar, const unsigned int version) {
+            ar &connections;
+            ar &construction;
+            ar &search;
+         }
+      };
+
+   protected:
+      typedef std::pair<float, int> candidate;
+
+      settings my_settings;
+
+      // CV_32F, one row per sample, shared with whoever built the index
+      cv::Mat points;
+
+      // the highest layer of each node
+      std::vector<int> levels;
+
+      // the bottom layer links of each node: a count followed by room for
+      // 2 * connections links
+      std::vector<int> base_links;
+
+      // the links of each node on every layer above the bottom one, each a
+      // count followed by room for connections links, starting at the node's
+      // upper offset, -1 for nodes only on the bottom layer
+      std::vector<int> upper_offset;
+      std::vector<int> upper_links;
+
+      int entry_point = -1;
+      int top_level = -1;
+
+      // nonzero for nodes that were removed, not saved with the graph
+      std::vector<unsigned char> removed;
+
+      int capacity(int level) const { return level ? my_settings.connections : 2 * my_settings.connections; }
+      int *links(int node, int level);
+      const int *links(int node, int level) const;
+
+      float distance(const float *a, int node) const;
+      void search_layer(const float *point, std::vector<candidate> &found, int ef, int level,
+            std::vector<unsigned> &visited, unsigned &visit) const;
+      void select_neighbors(std::vector<candidate> &found, int count) const;
+      void connect(int node, int neighbor, float distance, int level);
+      void insert(int node, int level, std::vector<unsigned> &visited, unsigned &visit);
+      void add_nodes(int first, cv::RNG &rng);
+
+      friend class boost::serialization::access;
+      template<class archive>
+      void serialize(archive &ar, const unsigned int version) {
+         ar &my_settings;
+         ar &levels;
+         ar &base_links;
+         ar &upper_offset;
+         ar &upper_links;
+         ar &entry_point;
+         ar &top_level;
+      }
+
+   public:
+      // Builds the graph over a set of row-samples
+      void build(const cv::Mat &points, const settings &s);
+
+      // Refers to the samples the index was built over, after it was loaded
+      void attach(const cv::Mat &points);
+
+      // Refers to samples that extend the ones in the graph, and inserts the
+      // new rows into it
+      void add(const cv::Mat &points);
+
+      // Leaves a sample out of every search from now on
+      void remove(int node);
+
+      // Changes the settings that don't need the graph to be rebuilt
+      void set_search(int search) { my_settings.search = search; }
+
+      bool empty() const { return levels.empty(); }
+      const settings &get_settings() const { return my_settings; }
+
+      // Finds up to k of the nearest samples of each query row, nearest
+      // first, like nearest_neighbors::find_nearest
+      void find_nearest(const cv::Mat &queries, int k, cv::Mat &indices,
+            cv::Mat &distances) const;
+
+      // Saves or loads the graph as blocks of a binary model file, with every
+      // block name starting with prefix
+      void save(model_writer &writer, const std::string &prefix) const;
+      void load(const model_file &file, const std::string &prefix);
+};
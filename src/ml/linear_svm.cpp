@@ -0,0 +1,291 @@
+/**
+ * OpenCV image classifier
+ *
+ * Richie Steigerwald
+ *
+ * Copyright 2013 Richie Steigerwald <richie.steigerwald@gmail.com>
+ * This work is free. You can redistribute it and/or modify it under the
+ * terms of the Do What The Fuck You Want To Public License, Version 2,
+ * as published by Sam Hocevar. See http://www.wtfpl.net/ for more details.
+ */
+
+#include "linear_svm.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <thread>
+
+using namespace std;
+
+namespace {
+   double squared_norm(const float *x, int n) {
+      double sum = 0;
+      for (int j = 0; j < n; j++) {
+         sum += (double)x[j] * x[j];
+      }
+      return sum;
+   }
+
+   // Dense CV_32F rows, as seen by the solver
+   struct dense_rows {
+      cv::Mat m;
+
+      int size() const { return m.rows; }
+      int cols() const { return m.cols; }
+
+      double dot(int i, const double *w) const {
+         const float *x = m.ptr<float>(i);
+         double sum = 0;
+         for (int j = 0; j < m.cols; j++) {
+            sum += w[j] * x[j];
+         }
+         return sum;
+      }
+
+      void add(int i, double a, double *w) const {
+         const float *x = m.ptr<float>(i);
+         for (int j = 0; j < m.cols; j++) {
+            w[j] += a * x[j];
+         }
+      }
+
+      double row_norm(int i) const { return squared_norm(m.ptr<float>(i), m.cols); }
+   };
+
+   // Sparse rows, touching only their non-zero entries
+   struct sparse_view {
+      const sparse_rows &m;
+
+      int size() const { return m.rows(); }
+      int cols() const { return m.cols; }
+
+      double dot(int i, const double *w) const {
+         const int *columns = m.row_columns(i);
+         const float *values = m.row_values(i);
+         double sum = 0;
+         for (int j = 0, n = m.row_size(i); j < n; j++) {
+            sum += w[columns[j]] * values[j];
+         }
+         return sum;
+      }
+
+      void add(int i, double a, double *w) const {
+         const int *columns = m.row_columns(i);
+         const float *values = m.row_values(i);
+         for (int j = 0, n = m.row_size(i); j < n; j++) {
+            w[columns[j]] += a * values[j];
+         }
+      }
+
+      double row_norm(int i) const { return squared_norm(m.row_values(i), m.row_size(i)); }
+   };
+
+   /**
+    * Trains one class against the rest with dual coordinate descent on the
+    * squared hinge loss. The bias is learned as the weight of an extra
+    * feature that is always one.
+    * @param[in]  samples   the training samples
+    * @param[in]  y         +1 for samples of the class, -1 for the rest
+    * @param[in]  s         the solver settings
+    * @param[in]  seed      seeds the order the samples are visited in
+    * @param[out] w         the weights, followed by the bias
+    */
+   template<class rows>
+   void solve(const rows &samples, const vector<signed char> &y,
+         const linear_svm::settings &s, int seed, vector<double> &w) {
+      const int n = samples.size();
+      const int bias = samples.cols();
+      const double diagonal = 0.5 / s.c;
+
+      w.assign(bias + 1, 0);
+      vector<double> alpha(n, 0), q(n);
+      vector<int> order(n);
+      for (int i = 0; i < n; i++) {
+         q[i] = samples.row_norm(i) + 1 + diagonal;
+         order[i] = i;
+      }
+
+      cv::RNG rng(seed);
+      for (int iteration = 0; iteration < s.iterations; iteration++) {
+         for (int i = n - 1; i > 0; i--) {
+            swap(order[i], order[rng.uniform(0, i + 1)]);
+         }
+
+         double max_gradient = -numeric_limits<double>::infinity();
+         double min_gradient = numeric_limits<double>::infinity();
+         for (int k = 0; k < n; k++) {
+            int i = order[k];
+            double g = y[i] * (samples.dot(i, &w[0]) + w[bias]) - 1 + diagonal * alpha[i];
+
+            // alpha can't go below zero, so only a negative gradient moves it there
+            double projected = alpha[i] == 0 ? min(g, 0.) : g;
+            max_gradient = max(max_gradient, projected);
+            min_gradient = min(min_gradient, projected);
+            if (fabs(projected) < 1e-12) continue;
+
+            double previous = alpha[i];
+            alpha[i] = max(alpha[i] - g / q[i], 0.);
+            double step = (alpha[i] - previous) * y[i];
+            samples.add(i, step, &w[0]);
+            w[bias] += step;
+         }
+
+         if (max_gradient - min_gradient <= s.tolerance) break;
+      }
+   }
+}
+
+/**
+ * Trains a weight row for every distinct response
+ * @param[in]  samples    the samples, either dense_rows or a sparse_view
+ * @param[in]  responses  the response of each sample
+ */
+template<class rows>
+void linear_svm::train_rows(const rows &samples, const cv::Mat &responses) {
+   cv::Mat r;
+   responses.convertTo(r, CV_32F);
+   r = r.reshape(1, 1);
+   CV_Assert(r.cols == samples.size());
+
+   vector<float> classes(r.ptr<float>(0), r.ptr<float>(0) + r.cols);
+   sort(classes.begin(), classes.end());
+   classes.erase(unique(classes.begin(), classes.end()), classes.end());
+
+   const int count = classes.size();
+   weights.create(count, samples.cols(), CV_32F);
+   biases.create(1, count, CV_32F);
+   labels = cv::Mat(classes, true).reshape(1, 1);
+   if (count == 0) return;
+
+   // Classes are handed out to threads as they finish
+   int thread_count = min<int>(count, max(1u, thread::hardware_concurrency()));
+   atomic<int> next_class(0);
+   auto train_classes = [&] {
+      vector<signed char> y(samples.size());
+      vector<double> w;
+      int c;
+      while ((c = next_class++) < count) {
+         for (int i = 0; i < y.size(); i++) {
+            y[i] = r.at<float>(0, i) == classes[c] ? 1 : -1;
+         }
+         solve(samples, y, my_settings, c + 1, w);
+
+         float *row = weights.ptr<float>(c);
+         for (int j = 0; j < weights.cols; j++) {
+            row[j] = w[j];
+         }
+         biases.at<float>(0, c) = w[weights.cols];
+      }
+   };
+
+   vector<thread> threads;
+   for (int i = 1; i < thread_count; i++) {
+      threads.push_back(thread(train_classes));
+   }
+   train_classes();
+   for (int i = 0; i < threads.size(); i++) {
+      threads[i].join();
+   }
+}
+
+void linear_svm::train(const cv::Mat &samples, const cv::Mat &responses, const settings &s) {
+   my_settings = s;
+   dense_rows view;
+   if (samples.type() == CV_32F) {
+      view.m = samples;
+   } else {
+      samples.convertTo(view.m, CV_32F);
+   }
+   train_rows(view, responses);
+}
+
+void linear_svm::train(const sparse_rows &samples, const cv::Mat &responses, const settings &s) {
+   my_settings = s;
+   sparse_view view = { samples };
+   train_rows(view, responses);
+}
+
+/**
+ * Picks the label of the highest scoring class of each row, the first one
+ * on a tie
+ * @param[in]  scores  one row per query, one column per class
+ */
+vector<float> linear_svm::best_labels(const cv::Mat &scores) const {
+   vector<float> result(scores.rows);
+   const float *bias = biases.ptr<float>(0);
+   for (int q = 0; q < scores.rows; q++) {
+      const float *score = scores.ptr<float>(q);
+      int best = 0;
+      for (int c = 1; c < scores.cols; c++) {
+         if (score[c] + bias[c] > score[best] + bias[best]) best = c;
+      }
+      result[q] = labels.at<float>(0, best);
+   }
+   return result;
+}
+
+/**
+ * Scores every query against every class with a single matrix product
+ * @param[in]  queries  the queries, one per row, with as many columns as the samples
+ * @return  the label of each query
+ */
+vector<float> linear_svm::predict(const cv::Mat &queries) const {
+   CV_Assert(!empty() && queries.cols == weights.cols);
+
+   cv::Mat q = queries;
+   if (q.type() != CV_32F) queries.convertTo(q, CV_32F);
+
+   cv::Mat scores;
+   cv::gemm(q, weights, 1.0, cv::Mat(), 0.0, scores, cv::GEMM_2_T);
+   return best_labels(scores);
+}
+
+/**
+ * Scores every sparse query against every class, touching only the weights
+ * of its non-zero entries
+ * @param[in]  queries  the queries, with as many columns as the samples
+ * @return  the label of each query
+ */
+vector<float> linear_svm::predict(const sparse_rows &queries) const {
+   CV_Assert(!empty() && queries.cols == weights.cols);
+
+   cv::Mat scores = cv::Mat::zeros(queries.rows(), weights.rows, CV_32F);
+   for (int q = 0; q < queries.rows(); q++) {
+      const int *columns = queries.row_columns(q);
+      const float *values = queries.row_values(q);
+      float *score = scores.ptr<float>(q);
+      for (int c = 0; c < weights.rows; c++) {
+         const float *w = weights.ptr<float>(c);
+         for (int j = 0, n = queries.row_size(q); j < n; j++) {
+            score[c] += w[columns[j]] * values[j];
+         }
+      }
+   }
+   return best_labels(scores);
+}
+
+/**
+ * Adds the weights to a binary model file
+ * @param[in]  writer  the model file being written
+ * @param[in]  prefix  prepended to the name of every block
+ */
+void linear_svm::save(model_writer &writer, const string &prefix) const {
+   writer.add_object(prefix + "settings", my_settings);
+   writer.add(prefix + "weights", weights);
+   writer.add(prefix + "biases", biases);
+   writer.add(prefix + "labels", labels);
+}
+
+/**
+ * Loads weights saved with save. They stay in the mapped file.
+ * @param[in]  file    the mapped model file
+ * @param[in]  prefix  prepended to the name of every block
+ */
+void linear_svm::load(const model_file &file, const string &prefix) {
+   file.get_object(prefix + "settings", my_settings);
+   weights = file.get(prefix + "weights");
+   biases = file.get(prefix + "biases");
+   labels = file.get(prefix + "labels");
+}
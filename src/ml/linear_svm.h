@@ -0,0 +1,100 @@
+/**
+ * OpenCV image classifier
+ *
+ * Richie Steigerwald
+ *
+ * Copyright 2013 Richie Steigerwald <richie.steigerwald@gmail.com>
+ * This work is free. You can redistribute it and/or modify it under the
+ * terms of the Do What The Fuck You Want To Public License, Version 2,
+ * as published by Sam Hocevar. See http://www.wtfpl.net/ for more details.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/archive/text_iarchive.hpp>
+
+#include "../cv/serialize_cvmat.h"
+#include "../util/model_file.h"
+#include "../util/sparse_rows.h"
+
+/**
+ * A linear support vector machine for any number of classes, trained one
+ * class against the rest. Each class gets a weight row and a bias, and a
+ * sample is labeled with the class whose row scores it highest, so
+ * classifying costs one matrix-vector product no matter how many samples it
+ * was trained on. Only the weights are kept after training.
+ *
+ * Every class is trained with dual coordinate descent on the squared hinge
+ * loss, which needs one pass over the samples per iteration and no kernel
+ * matrix. The classes are trained on separate threads.
+ */
+class linear_svm {
+
+   public:
+      struct settings {
+         // cost of a margin violation, larger fits the training samples more
+         // closely and takes longer to train
+         double c = 1;
+
+         // passes over the samples per class at most
+         int iterations = 1000;
+
+         // training stops once no projected gradient is further than this
+         // from the others
+         double tolerance = 0.1;
+
+         friend class boost::serialization::access;
+         template<class archive>
+         void serialize(archive &ar, const unsigned int version) {
+            ar &c;
+            ar &iterations;
+            ar &tolerance;
+         }
+      };
+
+   protected:
+      settings my_settings;
+
+      // CV_32F, one row of weights per class
+      cv::Mat weights;
+
+      // CV_32F, the bias and the response of each class, one column each
+      cv::Mat biases;
+      cv::Mat labels;
+
+      template<class rows>
+      void train_rows(const rows &samples, const cv::Mat &responses);
+      std::vector<float> best_labels(const cv::Mat &scores) const;
+
+      friend class boost::serialization::access;
+      template<class archive>
+      void serialize(archive &ar, const unsigned int version) {
+         ar &my_settings;
+         ar &weights;
+         ar &biases;
+         ar &labels;
+      }
+
+   public:
+      // Trains on row-samples and the response of each one
+      void train(const cv::Mat &samples, const cv::Mat &responses, const settings &s);
+      void train(const sparse_rows &samples, const cv::Mat &responses, const settings &s);
+
+      bool empty() const { return weights.empty(); }
+      const settings &get_settings() const { return my_settings; }
+
+      // Gives each query row the label of the class that scores it highest
+      std::vector<float> predict(const cv::Mat &queries) const;
+      std::vector<float> predict(const sparse_rows &queries) const;
+
+      // Saves or loads the weights as blocks of a binary model file, with
+      // every block name starting with prefix
+      void save(model_writer &writer, const std::string &prefix) const;
+      void load(const model_file &file, const std::string &prefix);
+};
@@ -0,0 +1,433 @@
+/**
+ * OpenCV image classifier
+ *
+ * Richie Steigerwald
+ *
+ * Copyright 2013 Richie Steigerwald <richie.steigerwald@gmail.com>
+ * This work is free. You can redistribute it and/or modify it under the
+ * terms of the Do What The Fuck You Want To Public License, Version 2,
+ * as published by Sam Hocevar. See http://www.wtfpl.net/ for more details.
+ */
+
+#include "nearest_neighbors.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <utility>
+
+using namespace std;
+
+namespace {
+   // rows of queries and of samples compared at a time
+   const int query_block = 32;
+   const int sample_block = 256;
+
+   // A sample found for a query, ordered so that the heap top is the one to
+   // drop first: the furthest, and of equally far ones the earliest
+   typedef pair<float, int> neighbor;
+   inline bool nearer(const neighbor &a, const neighbor &b) {
+      return a.first < b.first || (a.first == b.first && a.second > b.second);
+   }
+
+   /**
+    * The squared distance between two rows, summed exactly like cv::KNearest
+    * so that the same samples come out nearest
+    */
+   inline float squared_distance(const float *u, const float *v, int dimensions) {
+      double sum = 0;
+      int t = 0;
+      for (; t <= dimensions - 4; t += 4) {
+         double t0 = u[t] - v[t], t1 = u[t+1] - v[t+1];
+         double t2 = u[t+2] - v[t+2], t3 = u[t+3] - v[t+3];
+         sum += t0*t0 + t1*t1 + t2*t2 + t3*t3;
+      }
+      for (; t < dimensions; t++) {
+         double t0 = u[t] - v[t];
+         sum += t0*t0;
+      }
+      return (float)sum;
+   }
+
+   double norm(const float *row, int dimensions) {
+      double sum = 0;
+      for (int i = 0; i < dimensions; i++) {
+         sum += (double)row[i] * row[i];
+      }
+      return sqrt(sum);
+   }
+
+   // Keeps a candidate if it is nearer than the furthest of the k in the heap
+   inline void offer(vector<neighbor> &heap, const neighbor &candidate, int k) {
+      if (heap.size() < k) {
+         heap.push_back(candidate);
+         push_heap(heap.begin(), heap.end(), nearer);
+      } else if (nearer(candidate, heap.front())) {
+         pop_heap(heap.begin(), heap.end(), nearer);
+         heap.back() = candidate;
+         push_heap(heap.begin(), heap.end(), nearer);
+      }
+   }
+
+   // |a|^2 + |b|^2 - 2ab with ab from a single precision product over the
+   // given number of dimensions is off from the exact squared distance by
+   // at most this much, so a sample whose estimate is further than the
+   // furthest neighbor by more can't be among the nearest
+   inline double estimate_error(double query_norm, double sample_norm, int dimensions) {
+      return 2 * (dimensions + 2) * FLT_EPSILON * query_norm * sample_norm
+            + 1e-12 * (query_norm + sample_norm) * (query_norm + sample_norm);
+   }
+
+   // |a - b| >= ||a| - |b||, so a sample whose norm is too far from the
+   // query's can't beat the furthest neighbor. The margins keep rounding
+   // from skipping a tie.
+   inline bool too_far(double query_norm, double sample_norm, float furthest) {
+      double bound = query_norm - sample_norm;
+      double scale = query_norm + sample_norm;
+      return bound * bound > furthest * (1 + 1e-5) + 1e-12 * scale * scale;
+   }
+
+   vector<float> response_vector(const cv::Mat &r) {
+      cv::Mat r32;
+      r.convertTo(r32, CV_32F);
+      r32 = r32.reshape(1, 1);
+      return vector<float>(r32.ptr<float>(0), r32.ptr<float>(0) + r32.cols);
+   }
+
+   // Hands out blocks of query rows to threads as they finish
+   void for_each_block(int rows, const function<void(int, int)> &search) {
+      int blocks = (rows + query_block - 1) / query_block;
+      int thread_count = min<int>(blocks, max(1u, thread::hardware_concurrency()));
+      atomic<int> next_block(0);
+      auto work = [&] {
+         int block;
+         while ((block = next_block++) < blocks) {
+            int first = block * query_block;
+            search(first, min(first + query_block, rows));
+         }
+      };
+
+      vector<thread> threads;
+      for (int i = 1; i < thread_count; i++) {
+         threads.push_back(thread(work));
+      }
+      work();
+      for (int i = 0; i < threads.size(); i++) {
+         threads[i].join();
+      }
+   }
+
+   // Orders responses by their bits, which is how cv::KNearest sorts them
+   // before voting
+   inline int response_bits(float response) {
+      int bits;
+      memcpy(&bits, &response, sizeof(bits));
+      return bits;
+   }
+}
+
+/**
+ * Keeps the samples and responses and computes the norm of every sample
+ * @param[in]  s  the samples, one per row
+ * @param[in]  r  the response of each sample
+ */
+void nearest_neighbors::train(const cv::Mat &s, const cv::Mat &r) {
+   CV_Assert(s.empty() || (s.channels() == 1 && (int)r.total() == s.rows));
+
+   if (s.empty()) {
+      samples.release();
+   } else if (s.type() == CV_32F && s.isContinuous()) {
+      samples = s;
+   } else {
+      s.convertTo(samples, CV_32F);
+   }
+   sparse_samples = sparse_rows();
+   responses = response_vector(r);
+
+   norms.clear();
+   removed.clear();
+   add_norms();
+}
+
+/**
+ * Keeps sparse samples and responses and computes the norm of every sample
+ * @param[in]  s  the samples, one per sparse row
+ * @param[in]  r  the response of each sample
+ */
+void nearest_neighbors::train(const sparse_rows &s, const cv::Mat &r) {
+   CV_Assert((int)r.total() == s.rows());
+
+   samples.release();
+   sparse_samples = s;
+   responses = response_vector(r);
+
+   norms.clear();
+   removed.clear();
+   add_norms();
+}
+
+/**
+ * Computes the norms of the samples that don't have one yet
+ */
+void nearest_neighbors::add_norms() {
+   const int first = norms.size();
+   norms.resize(size());
+   removed.resize(size(), 0);
+   for (int i = first; i < size(); i++) {
+      norms[i] = sparse() ? norm(sparse_samples.row_values(i), sparse_samples.row_size(i))
+                          : norm(samples.ptr<float>(i), samples.cols);
+   }
+}
+
+/**
+ * Refers to samples that start with the ones trained on, so only the new
+ * ones need their norms computed
+ * @param[in]  s  the samples trained on followed by new ones
+ * @param[in]  r  the response of each sample
+ */
+void nearest_neighbors::add(const cv::Mat &s, const cv::Mat &r) {
+   CV_Assert(!sparse() && s.rows >= size() && (empty() || s.cols == samples.cols));
+   CV_Assert((int)r.total() == s.rows);
+
+   if (s.type() == CV_32F && s.isContinuous()) {
+      samples = s;
+   } else {
+      s.convertTo(samples, CV_32F);
+   }
+   responses = response_vector(r);
+   add_norms();
+}
+
+void nearest_neighbors::add(const sparse_rows &s, const cv::Mat &r) {
+   CV_Assert((sparse() || samples.empty()) && s.rows() >= size());
+   CV_Assert((int)r.total() == s.rows());
+
+   sparse_samples = s;
+   responses = response_vector(r);
+   add_norms();
+}
+
+void nearest_neighbors::remove(int sample) {
+   if (sample >= 0 && sample < removed.size()) removed[sample] = 1;
+}
+
+/**
+ * Finds the nearest samples of a block of queries
+ * @param[in]  queries    all of the queries
+ * @param[in]  first      the first query of the block
+ * @param[in]  last       one past the last query of the block
+ * @param[in]  k          the number of neighbors to find
+ * @param[out] indices    k sample indices per query, starting at query first
+ * @param[out] distances  k squared distances per query, starting at query first
+ */
+void nearest_neighbors::search_block(const cv::Mat &queries, int first, int last, int k,
+      int *indices, float *distances) const {
+   const int dimensions = samples.cols;
+   const int count = last - first;
+
+   vector<vector<neighbor> > heaps(count);
+   vector<double> query_norms(count);
+   for (int q = 0; q < count; q++) {
+      heaps[q].reserve(k);
+      query_norms[q] = norm(queries.ptr<float>(first + q), dimensions);
+   }
+
+   // The dot products of the block of queries with a block of samples come
+   // from one matrix multiplication, and only the samples whose estimated
+   // distance could beat a query's furthest neighbor are compared exactly
+   const cv::Mat query_rows = queries.rowRange(first, last);
+   cv::Mat dots;
+   for (int block = 0; block < samples.rows; block += sample_block) {
+      int block_end = min(block + sample_block, samples.rows);
+      cv::gemm(query_rows, samples.rowRange(block, block_end), 1, cv::Mat(), 0, dots,
+            cv::GEMM_2_T);
+
+      for (int q = 0; q < count; q++) {
+         const float *query = queries.ptr<float>(first + q);
+         const float *query_dots = dots.ptr<float>(q);
+         vector<neighbor> &heap = heaps[q];
+
+         for (int i = block; i < block_end; i++) {
+            if (removed[i]) continue;
+            if (heap.size() == k) {
+               double estimate = query_norms[q] * query_norms[q] + norms[i] * norms[i]
+                     - 2. * query_dots[i - block];
+               double furthest = heap.front().first;
+               if (estimate - estimate_error(query_norms[q], norms[i], dimensions)
+                     > furthest * (1 + 1e-5)) continue;
+            }
+
+            neighbor candidate(squared_distance(query, samples.ptr<float>(i), dimensions), i);
+            offer(heap, candidate, k);
+         }
+      }
+   }
+
+   for (int q = 0; q < count; q++) {
+      sort_heap(heaps[q].begin(), heaps[q].end(), nearer);
+      for (int j = 0; j < k; j++) {
+         distances[q * k + j] = j < heaps[q].size() ? heaps[q][j].first : 0;
+         indices[q * k + j] = j < heaps[q].size() ? heaps[q][j].second : -1;
+      }
+   }
+}
+
+/**
+ * Finds the nearest sparse samples of a block of sparse queries
+ * @param[in]  queries    all of the queries
+ * @param[in]  first      the first query of the block
+ * @param[in]  last       one past the last query of the block
+ * @param[in]  k          the number of neighbors to find
+ * @param[out] indices    k sample indices per query, starting at query first
+ * @param[out] distances  k squared distances per query, starting at query first
+ */
+void nearest_neighbors::search_sparse_block(const sparse_rows &queries, int first, int last, int k,
+      int *indices, float *distances) const {
+   vector<float> query(sparse_samples.cols, 0.f);
+   vector<neighbor> heap;
+   heap.reserve(k);
+
+   for (int q = first; q < last; q++) {
+      const int *query_columns = queries.row_columns(q);
+      const float *query_values = queries.row_values(q);
+      const int query_size = queries.row_size(q);
+      for (int j = 0; j < query_size; j++) {
+         query[query_columns[j]] = query_values[j];
+      }
+      double query_norm = norm(query_values, query_size);
+
+      heap.clear();
+      for (int i = 0; i < sparse_samples.rows(); i++) {
+         if (removed[i]) continue;
+         if (heap.size() == k && too_far(query_norm, norms[i], heap.front().first)) continue;
+
+         const int *columns = sparse_samples.row_columns(i);
+         const float *values = sparse_samples.row_values(i);
+         double dot = 0;
+         for (int j = 0, size = sparse_samples.row_size(i); j < size; j++) {
+            dot += (double)query[columns[j]] * values[j];
+         }
+         double distance = query_norm * query_norm + norms[i] * norms[i] - 2 * dot;
+         offer(heap, neighbor((float)max(distance, 0.), i), k);
+      }
+
+      // Clear the query out again so the row can be reused
+      for (int j = 0; j < query_size; j++) {
+         query[query_columns[j]] = 0;
+      }
+
+      sort_heap(heap.begin(), heap.end(), nearer);
+      for (int j = 0; j < k; j++) {
+         distances[(q - first) * k + j] = j < heap.size() ? heap[j].first : 0;
+         indices[(q - first) * k + j] = j < heap.size() ? heap[j].second : -1;
+      }
+   }
+}
+
+/**
+ * Finds the nearest samples of every query
+ * @param[in]  queries    the queries, one per row, with as many columns as the samples
+ * @param[in]  k          the number of neighbors to find
+ * @param[out] indices    CV_32S, the sample indices of each query's neighbors
+ * @param[out] distances  CV_32F, the squared distances of each query's neighbors
+ */
+void nearest_neighbors::find_nearest(const cv::Mat &queries, int k, cv::Mat &indices,
+      cv::Mat &distances) const {
+   if (sparse()) {
+      find_nearest(sparse_rows::compress(queries), k, indices, distances);
+      return;
+   }
+
+   CV_Assert(!empty() && k > 0 && queries.cols == samples.cols);
+   k = min(k, samples.rows);
+
+   cv::Mat q = queries;
+   if (q.type() != CV_32F) queries.convertTo(q, CV_32F);
+
+   indices.create(q.rows, k, CV_32S);
+   distances.create(q.rows, k, CV_32F);
+
+   for_each_block(q.rows, [&](int first, int last) {
+      search_block(q, first, last, k, indices.ptr<int>(first), distances.ptr<float>(first));
+   });
+}
+
+/**
+ * Finds the nearest samples of every sparse query
+ * @param[in]  queries    the queries, with as many columns as the samples
+ * @param[in]  k          the number of neighbors to find
+ * @param[out] indices    CV_32S, the sample indices of each query's neighbors
+ * @param[out] distances  CV_32F, the squared distances of each query's neighbors
+ */
+void nearest_neighbors::find_nearest(const sparse_rows &queries, int k, cv::Mat &indices,
+      cv::Mat &distances) const {
+   if (!sparse()) {
+      find_nearest(queries.dense(), k, indices, distances);
+      return;
+   }
+
+   CV_Assert(!empty() && k > 0 && queries.cols == sparse_samples.cols);
+   k = min(k, sparse_samples.rows());
+
+   indices.create(queries.rows(), k, CV_32S);
+   distances.create(queries.rows(), k, CV_32F);
+
+   for_each_block(queries.rows(), [&](int first, int last) {
+      search_sparse_block(queries, first, last, k, indices.ptr<int>(first), distances.ptr<float>(first));
+   });
+}
+
+/**
+ * Votes on the response of every query
+ * @param[in]  queries  the queries, one per row
+ * @param[in]  k        the number of neighbors that vote
+ * @return  the most common response among each query's neighbors
+ */
+vector<float> nearest_neighbors::predict(const cv::Mat &queries, int k) const {
+   cv::Mat indices, distances;
+   find_nearest(queries, k, indices, distances);
+   return vote(indices);
+}
+
+vector<float> nearest_neighbors::predict(const sparse_rows &queries, int k) const {
+   cv::Mat indices, distances;
+   find_nearest(queries, k, indices, distances);
+   return vote(indices);
+}
+
+/**
+ * Votes on the response of every row of neighbors
+ * @param[in]  indices  CV_32S, the sample indices of the neighbors of each query
+ * @return  the most common response among each row of neighbors
+ */
+vector<float> nearest_neighbors::vote(const cv::Mat &indices) const {
+   vector<float> labels(indices.rows);
+   vector<float> votes;
+   for (int q = 0; q < indices.rows; q++) {
+      const int *nearest = indices.ptr<int>(q);
+      votes.clear();
+      for (int j = 0; j < indices.cols; j++) {
+         if (nearest[j] >= 0) votes.push_back(responses[nearest[j]]);
+      }
+      sort(votes.begin(), votes.end(), [](float a, float b) {
+         return response_bits(a) < response_bits(b);
+      });
+
+      // The longest run wins, the first one on a tie
+      int best_count = 0, run_start = 0;
+      for (int j = 1; j <= votes.size(); j++) {
+         if (j == votes.size() || response_bits(votes[j]) != response_bits(votes[j - 1])) {
+            if (j - run_start > best_count) {
+               best_count = j - run_start;
+               labels[q] = votes[j - 1];
+            }
+            run_start = j;
+         }
+      }
+   }
+   return labels;
+}
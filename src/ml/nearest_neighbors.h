@@ -0,0 +1,101 @@
+/**
+ * OpenCV image classifier
+ *
+ * Richie Steigerwald
+ *
+ * Copyright 2013 Richie Steigerwald <richie.steigerwald@gmail.com>
+ * This work is free. You can redistribute it and/or modify it under the
+ * terms of the Do What The Fuck You Want To Public License, Version 2,
+ * as published by Sam Hocevar. See http://www.wtfpl.net/ for more details.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "../util/sparse_rows.h"
+
+/**
+ * Exact k-nearest-neighbor search over row samples, giving the same answers
+ * as cv::KNearest. Distances are squared euclidean distances accumulated in
+ * double precision in the same order cv::KNearest uses, and ties are broken
+ * the same way: among equally distant samples the later ones are nearer, and
+ * a tied vote goes to the smallest response.
+ *
+ * Queries are processed in blocks against blocks of samples so both stay in
+ * cache, each query keeps a bounded heap of its k best samples, and blocks of
+ * queries are spread over threads. The L2 norm of every sample is kept, and
+ * the dot products of a block of queries with a block of samples come from
+ * one single precision matrix multiplication, which estimates every distance
+ * to within a known rounding error. Only the samples whose estimate could
+ * put them among the k nearest have their distance computed exactly, so the
+ * answers don't change.
+ *
+ * Samples can also be sparse rows, which only store their non-zero entries.
+ * Each query is then spread into a dense row once, and its distance to a
+ * sample is |a|^2 + |b|^2 - 2ab with the dot product taken over the non-zero
+ * entries of the sample, so the cost of a comparison grows with the number
+ * of non-zeros instead of the number of columns. Rounding of that expansion
+ * can order nearly equal distances differently than cv::KNearest would.
+ *
+ * Samples can be added after training, which only computes the norms of the
+ * new ones, and removed, which leaves them out of every search.
+ */
+class nearest_neighbors {
+   // CV_32F, one continuous row per sample, shared with the caller
+   cv::Mat samples;
+
+   // used instead of samples when trained on sparse rows
+   sparse_rows sparse_samples;
+
+   std::vector<float> responses;
+   std::vector<double> norms;
+
+   // nonzero for samples that were removed
+   std::vector<unsigned char> removed;
+
+   void add_norms();
+
+   void search_block(const cv::Mat &queries, int first, int last, int k,
+         int *indices, float *distances) const;
+   void search_sparse_block(const sparse_rows &queries, int first, int last, int k,
+         int *indices, float *distances) const;
+
+   public:
+   // Indexes a set of samples and their responses. The samples are used in
+   // place when they are continuous CV_32F rows.
+   void train(const cv::Mat &samples, const cv::Mat &responses);
+   void train(const sparse_rows &samples, const cv::Mat &responses);
+
+   // Refers to samples and responses that extend the ones trained on
+   void add(const cv::Mat &samples, const cv::Mat &responses);
+   void add(const sparse_rows &samples, const cv::Mat &responses);
+
+   // Leaves a sample out of every search from now on
+   void remove(int sample);
+   bool is_removed(int sample) const { return removed[sample] != 0; }
+
+   bool empty() const { return size() == 0; }
+   bool sparse() const { return !sparse_samples.empty(); }
+   int size() const { return sparse() ? sparse_samples.rows() : samples.rows; }
+
+   // Finds the k nearest samples of each query row, nearest first. Rows of
+   // indices and distances hold min(k, size()) entries, with indices of -1
+   // at the end when too many samples were removed.
+   // Dense and sparse queries are both compared against whichever kind of
+   // samples were trained on.
+   void find_nearest(const cv::Mat &queries, int k, cv::Mat &indices,
+         cv::Mat &distances) const;
+   void find_nearest(const sparse_rows &queries, int k, cv::Mat &indices,
+         cv::Mat &distances) const;
+
+   // Gives each query row the most common response of its k nearest samples
+   std::vector<float> predict(const cv::Mat &queries, int k) const;
+   std::vector<float> predict(const sparse_rows &queries, int k) const;
+
+   // Gives each row of sample indices the most common response among them,
+   // ignoring negative indices
+   std::vector<float> vote(const cv::Mat &indices) const;
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/**
+ * A blocking first-in first-out queue with a fixed capacity, used to hand
+ * work from one pipeline stage to the next. Producers block while the queue
+ * is full so a slow consumer holds back the stages in front of it. Once the
+ * queue is closed, pushes fail and pops drain the remaining items.
+ */
+template<class T>
+class bounded_queue {
+   std::deque<T> items;
+   size_t capacity;
+   bool closed;
+
+   std::mutex lock;
+   std::condition_variable not_full;
+   std::condition_variable not_empty;
+
+   public:
+   explicit bounded_queue(size_t capacity) : capacity(capacity ? capacity : 1), closed(false) { }
+
+   // Adds an item, waiting for space. Returns false if the queue was closed.
+   bool push(T item) {
+      std::unique_lock<std::mutex> guard(lock);
+      not_full.wait(guard, [this] { return closed || items.size() < capacity; });
+      if (closed) return false;
+      items.push_back(std::move(item));
+      not_empty.notify_one();
+      return true;
+   }
+
+   // Removes an item, waiting for one. Returns false once the queue is closed
+   // and empty.
+   bool pop(T &item) {
+      std::unique_lock<std::mutex> guard(lock);
+      not_empty.wait(guard, [this] { return closed || !items.empty(); });
+      if (items.empty()) return false;
+      item = std::move(items.front());
+      items.pop_front();
+      not_full.notify_one();
+      return true;
+   }
+
+   // Removes an item only if one is ready. Returns false instead of waiting.
+   bool try_pop(T &item) {
+      std::lock_guard<std::mutex> guard(lock);
+      if (items.empty()) return false;
+      item = std::move(items.front());
+      items.pop_front();
+      not_full.notify_one();
+      return true;
+   }
+
+   // Wakes up every waiting thread and refuses further items
+   void close() {
+      std::lock_guard<std::mutex> guard(lock);
+      closed = true;
+      not_full.notify_all();
+      not_empty.notify_all();
+   }
+};
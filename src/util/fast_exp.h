@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// The smallest argument fast_exp takes, whose result is 2^-126
+const float fast_exp_min = -87.33654f;
+
+/**
+ * exp(x) in single precision, to a relative error of about 1e-7, for x
+ * from fast_exp_min up to 88. It has no branches and makes no calls, so
+ * unlike std::exp a loop over an array of values can be vectorized by the
+ * compiler. Smaller arguments have to be clamped by the caller, best in a
+ * loop of its own since the comparison keeps a loop from vectorizing.
+ *
+ * x is split into n ln 2 + f with n an integer and |f| <= ln 2 / 2, taking
+ * off n ln 2 in two parts so f keeps its precision. e^f comes from the
+ * polynomial Cephes uses for expf, and 2^n is built directly in the exponent
+ * bits of the result.
+ */
+inline float fast_exp(float x) {
+   // Rounds to the nearest integer with a truncation of a positive number
+   int n = (int)(x * 1.44269504f + 126.5f) - 126;
+   float f = x - n * 0.693359375f + n * 2.12194440e-4f;
+
+   float p = 1.9875691500e-4f;
+   p = p * f + 1.3981999507e-3f;
+   p = p * f + 8.3334519073e-3f;
+   p = p * f + 4.1665795894e-2f;
+   p = p * f + 1.6666665459e-1f;
+   p = p * f + 5.0000001201e-1f;
+   p = p * f * f + f + 1.f;
+
+   int32_t bits = (n + 127) << 23;
+   float scale;
+   std::memcpy(&scale, &bits, sizeof(scale));
+   return p * scale;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+/**
+ * Number of bits that differ between two bit strings, such as binary
+ * descriptors. Bytes are compared eight at a time with a popcount. That is
+ * only a hardware instruction when the compiler targets a CPU that has one,
+ * as with -mpopcnt or -march=native on x86; otherwise it is a call into the
+ * compiler's runtime, which is still faster than counting byte by byte.
+ */
+inline int hamming_distance(const unsigned char *a, const unsigned char *b, int bytes) {
+   int distance = 0;
+   int i = 0;
+   for (; i + 8 <= bytes; i += 8) {
+      uint64_t x, y;
+      memcpy(&x, a + i, 8);
+      memcpy(&y, b + i, 8);
+      distance += __builtin_popcountll(x ^ y);
+   }
+   for (; i < bytes; i++) {
+      distance += __builtin_popcount(a[i] ^ b[i]);
+   }
+   return distance;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * 64 bit FNV-1a hash of a block of bytes. Hashing a second block with the
+ * hash of the first as the seed hashes both of them together. It is only
+ * meant to tell contents apart for caching, not to resist tampering.
+ */
+const uint64_t hash_seed = 14695981039346656037ULL;
+
+inline uint64_t hash_bytes(const void *data, size_t size, uint64_t seed = hash_seed) {
+   const unsigned char *bytes = (const unsigned char *)data;
+   uint64_t hash = seed;
+   for (size_t i = 0; i < size; i++) {
+      hash = (hash ^ bytes[i]) * 1099511628211ULL;
+   }
+   return hash;
+}
+
+template<class T>
+inline uint64_t hash_value(const T &value, uint64_t seed = hash_seed) {
+   return hash_bytes(&value, sizeof(value), seed);
+}
@@ -0,0 +1,221 @@
+#include "model_file.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static uint64_t aligned(uint64_t offset) {
+   return (offset + model_format::alignment - 1) / model_format::alignment * model_format::alignment;
+}
+
+/**
+ * Adds a matrix to be written
+ * @param[in]  name  the name the matrix is looked up by, shorter than 32 characters
+ * @param[in]  m     the matrix, which must not change until the file is written
+ */
+void model_writer::add(const string &name, const cv::Mat &m) {
+   if (name.size() >= sizeof(model_format::block().name)) {
+      throw runtime_error("Model block name too long: " + name);
+   }
+   blocks.push_back(make_pair(name, m));
+}
+
+/**
+ * Writes the header, the block table, and then every block
+ * @param[in]  path  the file to write
+ */
+void model_writer::write(const string &path) const {
+   ofstream out(path.c_str(), ios::binary | ios::trunc);
+   if (!out) {
+      throw runtime_error("Could not open model file for writing: " + path);
+   }
+   write(out, 0);
+   if (!out) {
+      throw runtime_error("Could not write model file: " + path);
+   }
+}
+
+/**
+ * Pads an existing model file to the next aligned offset and writes another
+ * model there
+ * @param[in]  path  the file to append to
+ */
+void model_writer::append(const string &path) const {
+   fstream out(path.c_str(), ios::binary | ios::in | ios::out | ios::ate);
+   if (!out || !model_file::is_model_file(path)) {
+      throw runtime_error("Not a model file to append to: " + path);
+   }
+
+   static const char padding[model_format::alignment] = { 0 };
+   uint64_t size = out.tellp();
+   out.write(padding, aligned(size) - size);
+   write(out, aligned(size));
+   if (!out) {
+      throw runtime_error("Could not append to model file: " + path);
+   }
+}
+
+/**
+ * Writes the header, the block table, and then every block
+ * @param[in]  out    the stream, positioned at start
+ * @param[in]  start  where the model starts in the file, aligned
+ */
+void model_writer::write(ostream &out, uint64_t start) const {
+   model_format::header header;
+   memcpy(header.magic, model_format::magic, sizeof(header.magic));
+   header.version = model_format::version;
+   header.blocks = blocks.size();
+
+   vector<model_format::block> table(blocks.size());
+   uint64_t offset = aligned(sizeof(header) + table.size() * sizeof(model_format::block));
+   for (int i = 0; i < blocks.size(); i++) {
+      const cv::Mat &m = blocks[i].second;
+      memset(&table[i], 0, sizeof(table[i]));
+      strncpy(table[i].name, blocks[i].first.c_str(), sizeof(table[i].name) - 1);
+      table[i].rows = m.rows;
+      table[i].cols = m.cols;
+      table[i].type = m.type();
+      table[i].offset = offset;
+      offset = aligned(offset + m.total() * m.elemSize());
+   }
+
+   out.write((const char *)&header, sizeof(header));
+   if (!table.empty()) {
+      out.write((const char *)&table[0], table.size() * sizeof(table[0]));
+   }
+
+   static const char padding[model_format::alignment] = { 0 };
+   for (int i = 0; i < blocks.size(); i++) {
+      out.write(padding, start + table[i].offset - (uint64_t)out.tellp());
+
+      // Rows are written one at a time so submatrices don't need a copy
+      const cv::Mat &m = blocks[i].second;
+      for (int row = 0; row < m.rows; row++) {
+         out.write((const char *)m.ptr(row), m.cols * m.elemSize());
+      }
+   }
+}
+
+struct model_file::mapping {
+   void *data;
+   size_t size;
+
+   mapping(void *data, size_t size) : data(data), size(size) { }
+   ~mapping() { munmap(data, size); }
+};
+
+/**
+ * Maps a whole file
+ */
+shared_ptr<model_file::mapping> model_file::map_file(const string &path) {
+   int fd = open(path.c_str(), O_RDONLY);
+   if (fd < 0) {
+      throw runtime_error("Could not open model file: " + path);
+   }
+
+   struct stat info;
+   if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(model_format::header)) {
+      close(fd);
+      throw runtime_error("Not a model file: " + path);
+   }
+
+   // Private and writable so that matrices over the mapping can be modified
+   // in place without touching the file
+   void *data = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED) {
+      throw runtime_error("Could not map model file: " + path);
+   }
+   return make_shared<mapping>(data, info.st_size);
+}
+
+/**
+ * Maps a model file and finds the blocks of its first model
+ * @param[in]  path  the file written by model_writer
+ */
+model_file::model_file(const string &path) {
+   *this = model_file(map_file(path), 0, path);
+}
+
+/**
+ * Finds the blocks of the model starting at an offset of a mapped file
+ * @param[in]  m      the mapped file
+ * @param[in]  start  the aligned offset of the model's header
+ * @param[in]  path   the name of the file, for errors
+ */
+model_file::model_file(const shared_ptr<mapping> &m, uint64_t start, const string &path) : map(m) {
+   if (start + sizeof(model_format::header) > map->size) {
+      throw runtime_error("Truncated model file: " + path);
+   }
+
+   unsigned char *bytes = (unsigned char *)map->data + start;
+   const model_format::header *header = (const model_format::header *)bytes;
+   if (memcmp(header->magic, model_format::magic, sizeof(header->magic)) != 0) {
+      throw runtime_error("Not a model file: " + path);
+   }
+   if (header->version > model_format::version) {
+      throw runtime_error("Unsupported model file version: " + path);
+   }
+
+   const uint64_t table_end = sizeof(*header) + (uint64_t)header->blocks * sizeof(model_format::block);
+   end = start + table_end;
+   if (end > map->size) {
+      throw runtime_error("Truncated model file: " + path);
+   }
+
+   const model_format::block *table = (const model_format::block *)(bytes + sizeof(*header));
+   for (int i = 0; i < header->blocks; i++) {
+      const model_format::block &b = table[i];
+      string name(b.name, strnlen(b.name, sizeof(b.name)));
+
+      cv::Mat m;
+      if (b.rows > 0 && b.cols > 0) {
+         m = cv::Mat(b.rows, b.cols, b.type, bytes + b.offset);
+         end = max<uint64_t>(end, start + b.offset + m.total() * m.elemSize());
+         if (end > map->size) {
+            throw runtime_error("Truncated model file: " + path);
+         }
+      }
+      blocks[name] = m;
+   }
+}
+
+/**
+ * Reads the models of a file one after the other
+ * @param[in]  path  the file written by model_writer, maybe appended to
+ */
+vector<model_file> model_file::read_all(const string &path) {
+   shared_ptr<mapping> m = map_file(path);
+   vector<model_file> models(1, model_file(m, 0, path));
+   while (aligned(models.back().end) < m->size) {
+      models.push_back(model_file(m, aligned(models.back().end), path));
+   }
+   return models;
+}
+
+/**
+ * Checks the magic number at the start of a file
+ */
+bool model_file::is_model_file(const string &path) {
+   ifstream in(path.c_str(), ios::binary);
+   char magic[sizeof(model_format::magic)];
+   return in.read(magic, sizeof(magic)) && memcmp(magic, model_format::magic, sizeof(magic)) == 0;
+}
+
+/**
+ * Looks up a block by name
+ */
+cv::Mat model_file::get(const string &name) const {
+   std::map<string, cv::Mat>::const_iterator block = blocks.find(name);
+   if (block == blocks.end()) {
+      throw runtime_error("Model file has no block: " + name);
+   }
+   return block->second;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/archive/text_iarchive.hpp>
+
+/**
+ * A versioned binary container of named matrices, used to save models that
+ * must load quickly. The file starts with a header and a table of blocks,
+ * and every block holds the raw, continuous elements of one matrix starting
+ * at a 64 byte aligned offset. Small objects with no large arrays, such as
+ * settings, are stored as text archives inside a block of bytes.
+ *
+ * Loading maps the file into memory and returns matrices that are headers
+ * over the mapping, so nothing is parsed or copied. The mapping is private,
+ * so writing to one of those matrices never changes the file.
+ *
+ * More models can be appended to a file, each one starting at the next
+ * aligned offset with its own header and block offsets relative to it, so
+ * that a model can be updated by appending what changed. Opening a file
+ * reads its first model, and read_all reads every one of them.
+ */
+namespace model_format {
+   const char magic[8] = { 'B', 'O', 'F', 'M', 'O', 'D', 'E', 'L' };
+   const uint32_t version = 1;
+   const size_t alignment = 64;
+
+   struct header {
+      char magic[8];
+      uint32_t version;
+      uint32_t blocks;
+   };
+
+   struct block {
+      char name[32];
+      int32_t rows;
+      int32_t cols;
+      int32_t type;
+      int32_t reserved;
+      uint64_t offset;
+   };
+}
+
+class model_writer {
+   std::vector<std::pair<std::string, cv::Mat> > blocks;
+
+   public:
+   // Adds a matrix to be written under a unique name
+   void add(const std::string &name, const cv::Mat &m);
+
+   // Adds a serializable object, stored as a text archive
+   template<class T>
+   void add_object(const std::string &name, const T &object) {
+      std::ostringstream stream;
+      {
+         boost::archive::text_oarchive oa(stream);
+         oa << object;
+      }
+      std::string text = stream.str();
+      add(name, cv::Mat(1, text.size(), CV_8U, (void *)text.data()).clone());
+   }
+
+   // Writes every block to a file, throws std::runtime_error on failure
+   void write(const std::string &path) const;
+
+   // Writes every block as another model at the end of an existing file
+   void append(const std::string &path) const;
+
+   protected:
+   void write(std::ostream &out, uint64_t start) const;
+};
+
+class model_file {
+   // unmaps the file once the last copy of a model_file is gone
+   struct mapping;
+   std::shared_ptr<mapping> map;
+
+   std::map<std::string, cv::Mat> blocks;
+
+   // one past the last byte of this model within the file
+   uint64_t end;
+
+   static std::shared_ptr<mapping> map_file(const std::string &path);
+   model_file(const std::shared_ptr<mapping> &map, uint64_t start, const std::string &path);
+
+   public:
+   // Maps a file written by model_writer, throws std::runtime_error if it
+   // cannot be read or is not a model file
+   explicit model_file(const std::string &path);
+
+   // Maps a file and reads every model written or appended to it, in order
+   static std::vector<model_file> read_all(const std::string &path);
+
+   // Whether a file starts with the model file header
+   static bool is_model_file(const std::string &path);
+
+   bool has(const std::string &name) const { return blocks.count(name) > 0; }
+
+   // A header over the block of a name, valid while this model_file or a
+   // copy of it exists. Throws std::runtime_error if there is no such block.
+   cv::Mat get(const std::string &name) const;
+
+   // Reads back an object added with model_writer::add_object
+   template<class T>
+   void get_object(const std::string &name, T &object) const {
+      cv::Mat bytes = get(name);
+      std::istringstream stream(std::string((const char *)bytes.data, bytes.cols));
+      boost::archive::text_iarchive ia(stream);
+      ia >> object;
+   }
+};
+
+// A row over the ints of a vector from first on, to add to a model_writer.
+// The vector must not change until the file is written.
+inline cv::Mat int_row(const std::vector<int> &values, size_t first = 0) {
+   if (first >= values.size()) return cv::Mat();
+   return cv::Mat(1, values.size() - first, CV_32S, (void *)&values[first]);
+}
+
+// Copies the ints of a block back into a vector
+inline void int_vector(const cv::Mat &block, std::vector<int> &values) {
+   values.clear();
+   if (!block.empty()) values.assign(block.ptr<int>(0), block.ptr<int>(0) + block.total());
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+
+#include <opencv2/core/core.hpp>
+
+/**
+ * A matrix that rows are appended to one at a time or in blocks. Storage
+ * grows geometrically, so appending is amortized O(row) instead of copying
+ * everything accumulated so far, and mat() is a header over the rows added
+ * without any copy. Copies of a buffer never share storage, so appending to
+ * one cannot overwrite rows of another.
+ */
+class row_buffer {
+   cv::Mat storage;
+   int count;
+
+   // Makes room for one more block of rows, at least doubling the capacity
+   void grow(int rows, int cols, int type) {
+      if (storage.data != NULL && count + rows <= storage.rows) return;
+      assert(storage.data == NULL || (cols == storage.cols && type == storage.type()));
+
+      cv::Mat larger(std::max(std::max(count + rows, 2 * storage.rows), 16), cols, type);
+      if (count) {
+         storage.rowRange(0, count).copyTo(larger.rowRange(0, count));
+      }
+      storage = larger;
+   }
+
+   public:
+   row_buffer() : count(0) { }
+   row_buffer(const row_buffer &b) : count(b.count) {
+      if (count) b.mat().copyTo(storage);
+   }
+   row_buffer &operator=(const row_buffer &b) {
+      if (this != &b) {
+         count = b.count;
+         storage = count ? b.mat().clone() : cv::Mat();
+      }
+      return *this;
+   }
+
+   int rows() const { return count; }
+   bool empty() const { return count == 0; }
+
+   // Makes room for a total number of rows so no reallocation happens
+   void reserve(int rows, int cols, int type) {
+      if (rows > count) grow(rows - count, cols, type);
+   }
+
+   // Appends a block of rows
+   void append(const cv::Mat &rows) {
+      if (rows.rows == 0) return;
+      grow(rows.rows, rows.cols, rows.type());
+      rows.copyTo(storage.rowRange(count, count + rows.rows));
+      count += rows.rows;
+   }
+
+   // Appends one row and returns it to be filled in
+   template<class T>
+   T *append_row(int cols, int type) {
+      grow(1, cols, type);
+      return storage.ptr<T>(count++);
+   }
+
+   // The rows appended so far
+   cv::Mat mat() const { return count ? storage.rowRange(0, count) : cv::Mat(); }
+};
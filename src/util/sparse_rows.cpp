@@ -0,0 +1,71 @@
+#include "sparse_rows.h"
+
+using namespace std;
+
+// Copies a vector into a single column matrix
+template<class T>
+static cv::Mat column(const vector<T> &values, int type) {
+   return values.empty() ? cv::Mat(0, 1, type) : cv::Mat(values.size(), 1, type, (void *)&values[0]).clone();
+}
+
+/**
+ * Keeps the non-zero entries of dense rows
+ * @param[in]  dense  the rows, of any single channel type
+ * @return  the same rows in compressed form
+ */
+sparse_rows sparse_rows::compress(const cv::Mat &dense) {
+   cv::Mat m = dense;
+   if (m.type() != CV_32F) dense.convertTo(m, CV_32F);
+
+   vector<int> offsets(1, 0), columns;
+   vector<float> values;
+   for (int row = 0; row < m.rows; row++) {
+      const float *entries = m.ptr<float>(row);
+      for (int col = 0; col < m.cols; col++) {
+         if (entries[col] != 0) {
+            columns.push_back(col);
+            values.push_back(entries[col]);
+         }
+      }
+      offsets.push_back(columns.size());
+   }
+
+   sparse_rows s;
+   s.cols = m.cols;
+   s.offsets = column(offsets, CV_32S);
+   s.columns = column(columns, CV_32S);
+   s.values = column(values, CV_32F);
+   return s;
+}
+
+/**
+ * Expands the rows back into a dense CV_32F matrix
+ */
+cv::Mat sparse_rows::dense() const {
+   cv::Mat m = cv::Mat::zeros(rows(), cols, CV_32F);
+   for (int row = 0; row < rows(); row++) {
+      float *entries = m.ptr<float>(row);
+      const int *row_cols = row_columns(row);
+      const float *row_vals = row_values(row);
+      for (int i = 0; i < row_size(row); i++) {
+         entries[row_cols[i]] = row_vals[i];
+      }
+   }
+   return m;
+}
+
+/**
+ * Copies the rows from first up to last
+ * @param[in]  first  the first row to copy
+ * @param[in]  last   one past the last row to copy
+ */
+sparse_rows sparse_rows::slice(int first, int last) const {
+   CV_Assert(0 <= first && first <= last && last <= rows());
+
+   sparse_rows s;
+   s.cols = cols;
+   offsets.rowRange(first, last + 1).convertTo(s.offsets, CV_32S, 1, -offset(first));
+   s.columns = columns.rowRange(offset(first), offset(last)).clone();
+   s.values = values.rowRange(offset(first), offset(last)).clone();
+   return s;
+}
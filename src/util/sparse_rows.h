@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include <boost/serialization/access.hpp>
+
+/**
+ * One row of a sparse matrix: the columns of its non-zero entries in
+ * increasing order and their values
+ */
+struct sparse_vector {
+   // the number of columns, zero or not
+   int size = 0;
+
+   std::vector<int> columns;
+   std::vector<float> values;
+
+   int nonzeros() const { return columns.size(); }
+};
+
+/**
+ * Rows of a sparse matrix in compressed sparse row form. The columns and
+ * values of the non-zero entries of every row are stored one row after
+ * another, and offsets holds where each row starts plus where the last one
+ * ends. Each matrix is a single continuous column so that it can be mapped
+ * from a model file or handed out by a row_buffer without a copy.
+ *
+ * Serializing needs the cv::Mat serializer from serialize_cvmat.h.
+ */
+struct sparse_rows {
+   // the number of columns of every row
+   int cols = 0;
+
+   // CV_32S, rows + 1 entries
+   cv::Mat offsets;
+
+   // CV_32S and CV_32F, one entry per non-zero
+   cv::Mat columns;
+   cv::Mat values;
+
+   int rows() const { return offsets.rows > 0 ? offsets.rows - 1 : 0; }
+   bool empty() const { return rows() == 0; }
+   int nonzeros() const { return values.rows; }
+
+   // The non-zero entries of a row
+   int row_size(int row) const { return offset(row + 1) - offset(row); }
+   const int *row_columns(int row) const { return (const int *)columns.data + offset(row); }
+   const float *row_values(int row) const { return (const float *)values.data + offset(row); }
+
+   // Converts from and to dense CV_32F rows
+   static sparse_rows compress(const cv::Mat &dense);
+   cv::Mat dense() const;
+
+   // Copies a range of rows, with their offsets starting from zero again
+   sparse_rows slice(int first, int last) const;
+
+   protected:
+   int offset(int row) const { return ((const int *)offsets.data)[row]; }
+
+   friend class boost::serialization::access;
+   template<class archive>
+   void serialize(archive &ar, const unsigned int version) {
+      ar &cols;
+      ar &offsets;
+      ar &columns;
+      ar &values;
+   }
+};
@@ -0,0 +1,224 @@
+#include "stage_stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+   const int bucket_count = 128;
+
+   // buckets per doubling of the latency
+   const int bucket_resolution = 4;
+
+   struct histogram {
+      uint64_t count = 0;
+      uint64_t items = 0;
+      uint64_t bytes = 0;
+      double seconds = 0;
+      double max = 0;
+      uint64_t buckets[bucket_count] = {};
+
+      void add(const histogram &h) {
+         count += h.count;
+         items += h.items;
+         bytes += h.bytes;
+         seconds += h.seconds;
+         max = std::max(max, h.max);
+         for (int b = 0; b < bucket_count; b++) {
+            buckets[b] += h.buckets[b];
+         }
+      }
+   };
+
+   // Bucket 0 holds everything under a microsecond, bucket b > 0 up to
+   // 2^(b / bucket_resolution) microseconds
+   int bucket(double seconds) {
+      double microseconds = seconds * 1e6;
+      if (microseconds < 1) return 0;
+      return min(bucket_count - 1, 1 + (int)(bucket_resolution * log2(microseconds)));
+   }
+
+   double bucket_limit(int b) {
+      return exp2((double)b / bucket_resolution) * 1e-6;
+   }
+
+   /**
+    * Estimates a percentile as the upper limit of the bucket it falls in
+    * @param[in]  h  the histogram
+    * @param[in]  q  the fraction of runs at or below the percentile
+    */
+   double percentile(const histogram &h, double q) {
+      uint64_t rank = max<uint64_t>(1, (uint64_t)ceil(q * h.count)), seen = 0;
+      for (int b = 0; b < bucket_count; b++) {
+         seen += h.buckets[b];
+         if (seen >= rank) return min(bucket_limit(b), h.max);
+      }
+      return h.max;
+   }
+
+   // The histograms of one thread. Only its thread records into them, the
+   // lock is for taking summaries.
+   struct thread_stats {
+      mutex lock;
+      map<const char *, histogram> stages;
+   };
+
+   // Every live thread that recorded something, and what threads that have
+   // since exited recorded
+   struct registry {
+      mutex lock;
+      vector<shared_ptr<thread_stats> > threads;
+      map<string, histogram> retired;
+   };
+
+   registry &all_threads() {
+      static registry r;
+      return r;
+   }
+
+   // Registers the histograms of a thread on first use and retires them
+   // when the thread exits
+   struct thread_handle {
+      shared_ptr<thread_stats> stats;
+
+      thread_stats &get() {
+         if (!stats) {
+            stats = make_shared<thread_stats>();
+            registry &r = all_threads();
+            lock_guard<mutex> guard(r.lock);
+            r.threads.push_back(stats);
+         }
+         return *stats;
+      }
+
+      ~thread_handle() {
+         if (!stats) return;
+         registry &r = all_threads();
+         lock_guard<mutex> guard(r.lock);
+         for (auto s = stats->stages.begin(); s != stats->stages.end(); s++) {
+            r.retired[s->first].add(s->second);
+         }
+         r.threads.erase(find(r.threads.begin(), r.threads.end(), stats));
+      }
+   };
+
+   thread_local thread_handle this_thread_stats;
+
+   // Escapes a stage name for a JSON string or a Prometheus label
+   string quoted(const string &s) {
+      string out = "\"";
+      for (int i = 0; i < s.size(); i++) {
+         if (s[i] == '"' || s[i] == '\\') out += '\\';
+         out += s[i];
+      }
+      return out + "\"";
+   }
+}
+
+void stage_stats::record(const char *stage, double seconds, uint64_t items, uint64_t bytes) {
+   thread_stats &mine = this_thread_stats.get();
+   lock_guard<mutex> guard(mine.lock);
+   histogram &h = mine.stages[stage];
+   h.count++;
+   h.items += items;
+   h.bytes += bytes;
+   h.seconds += seconds;
+   h.max = max(h.max, seconds);
+   h.buckets[bucket(seconds)]++;
+}
+
+/**
+ * Adds up the histograms of every thread by stage name, since the same name
+ * can have a different address in every translation unit
+ */
+vector<stage_summary> stage_stats::summary() {
+   registry &r = all_threads();
+   lock_guard<mutex> guard(r.lock);
+
+   map<string, histogram> merged = r.retired;
+   for (int t = 0; t < r.threads.size(); t++) {
+      lock_guard<mutex> thread_guard(r.threads[t]->lock);
+      const map<const char *, histogram> &stages = r.threads[t]->stages;
+      for (auto s = stages.begin(); s != stages.end(); s++) {
+         merged[s->first].add(s->second);
+      }
+   }
+
+   vector<stage_summary> result;
+   for (auto s = merged.begin(); s != merged.end(); s++) {
+      stage_summary summary;
+      summary.stage = s->first;
+      summary.count = s->second.count;
+      summary.seconds = s->second.seconds;
+      summary.p50 = percentile(s->second, 0.5);
+      summary.p99 = percentile(s->second, 0.99);
+      summary.max = s->second.max;
+      summary.items = s->second.items;
+      summary.bytes = s->second.bytes;
+      result.push_back(summary);
+   }
+   return result;
+}
+
+void stage_stats::reset() {
+   registry &r = all_threads();
+   lock_guard<mutex> guard(r.lock);
+   r.retired.clear();
+   for (int t = 0; t < r.threads.size(); t++) {
+      lock_guard<mutex> thread_guard(r.threads[t]->lock);
+      r.threads[t]->stages.clear();
+   }
+}
+
+string stage_stats::json() {
+   vector<stage_summary> stages = summary();
+   ostringstream out;
+   out << "{\"stages\": [";
+   for (int i = 0; i < stages.size(); i++) {
+      const stage_summary &s = stages[i];
+      out << (i ? ",\n  " : "\n  ")
+          << "{\"stage\": " << quoted(s.stage) << ", \"count\": " << s.count
+          << ", \"seconds\": " << s.seconds << ", \"p50\": " << s.p50 << ", \"p99\": " << s.p99
+          << ", \"max\": " << s.max << ", \"items\": " << s.items << ", \"bytes\": " << s.bytes << "}";
+   }
+   out << "\n]}\n";
+   return out.str();
+}
+
+string stage_stats::prometheus() {
+   vector<stage_summary> stages = summary();
+   ostringstream out;
+   out << "# HELP imclass_stage_seconds Latency of each stage.\n"
+       << "# TYPE imclass_stage_seconds summary\n";
+   for (int i = 0; i < stages.size(); i++) {
+      const stage_summary &s = stages[i];
+      string label = "stage=" + quoted(s.stage);
+      out << "imclass_stage_seconds{" << label << ",quantile=\"0.5\"} " << s.p50 << "\n"
+          << "imclass_stage_seconds{" << label << ",quantile=\"0.99\"} " << s.p99 << "\n"
+          << "imclass_stage_seconds_sum{" << label << "} " << s.seconds << "\n"
+          << "imclass_stage_seconds_count{" << label << "} " << s.count << "\n";
+   }
+   out << "# HELP imclass_stage_items_total Descriptors, images or samples processed by each stage.\n"
+       << "# TYPE imclass_stage_items_total counter\n";
+   for (int i = 0; i < stages.size(); i++) {
+      out << "imclass_stage_items_total{stage=" << quoted(stages[i].stage) << "} " << stages[i].items << "\n";
+   }
+   out << "# HELP imclass_stage_bytes_total Bytes read by each stage.\n"
+       << "# TYPE imclass_stage_bytes_total counter\n";
+   for (int i = 0; i < stages.size(); i++) {
+      out << "imclass_stage_bytes_total{stage=" << quoted(stages[i].stage) << "} " << stages[i].bytes << "\n";
+   }
+   return out.str();
+}
+
+string stage_stats::dump(const string &format) {
+   if (format == "json") return json();
+   if (format == "prometheus") return prometheus();
+   throw invalid_argument("Unknown stats format: " + format);
+}
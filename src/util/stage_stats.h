@@ -0,0 +1,92 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// What was recorded of one stage, over every thread
+struct stage_summary {
+   std::string stage;
+
+   // times the stage ran and the seconds it took in total
+   uint64_t count = 0;
+   double seconds = 0;
+
+   // latency percentiles and the slowest run, in seconds
+   double p50 = 0;
+   double p99 = 0;
+   double max = 0;
+
+   // descriptors, images or samples processed and bytes read
+   uint64_t items = 0;
+   uint64_t bytes = 0;
+};
+
+/**
+ * Latency histograms of the stages of the library: decoding, detecting and
+ * describing features, encoding feature vectors, clustering and
+ * classifying. Every thread records into its own histograms, which are only
+ * merged when a summary is taken, so threads recording never wait on each
+ * other. Latencies fall into buckets a quarter of a doubling wide, which
+ * bounds the error of the percentiles to about 19%.
+ *
+ * The library records through stage_timer, which is compiled out unless
+ * INSTRUMENTATION is defined.
+ */
+class stage_stats {
+   public:
+      // Records one run of a stage on the calling thread. The name is kept
+      // by pointer, so it has to be a string literal.
+      static void record(const char *stage, double seconds, uint64_t items = 0, uint64_t bytes = 0);
+
+      // Merges the histograms of every thread, sorted by stage
+      static std::vector<stage_summary> summary();
+
+      // Forgets everything recorded so far
+      static void reset();
+
+      // The summary as JSON or in the Prometheus text format
+      static std::string json();
+      static std::string prometheus();
+
+      // The summary in a format named "json" or "prometheus". Throws
+      // std::invalid_argument for any other name.
+      static std::string dump(const std::string &format);
+};
+
+#ifdef INSTRUMENTATION
+
+// Records the time from its construction to its destruction as one run of
+// a stage
+class stage_timer {
+   const char *stage;
+   uint64_t items;
+   uint64_t bytes;
+   std::chrono::steady_clock::time_point start;
+
+   public:
+      explicit stage_timer(const char *s, uint64_t i = 0, uint64_t b = 0)
+            : stage(s), items(i), bytes(b), start(std::chrono::steady_clock::now()) { }
+
+      ~stage_timer() {
+         std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+         stage_stats::record(stage, elapsed.count(), items, bytes);
+      }
+
+      // Counts more items or bytes once they are known
+      void add(uint64_t i, uint64_t b = 0) {
+         items += i;
+         bytes += b;
+      }
+};
+
+#else
+
+class stage_timer {
+   public:
+      explicit stage_timer(const char *, uint64_t = 0, uint64_t = 0) { }
+      void add(uint64_t, uint64_t = 0) { }
+};
+
+#endif
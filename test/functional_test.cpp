@@ -11,22 +11,59 @@
 
 #include <opencv2/core/core.hpp> // Mat
 #include <opencv2/highgui/highgui.hpp> // imread
+#include <opencv2/ml/ml.hpp> // KNearest
 #include <opencv2/nonfree/features2d.hpp> // SURF
 
 #include "cv/visual_vocabulary.h"
 #include "cv/bag_of_features.h"
+#include "cv/feature_extractor.h"
+#include "cv/feature_pipeline.h"
+#include "cv/kmeans.h"
+#include "ml/batch_classifier.h"
 #include "ml/classifier.h"
+#include "util/fast_exp.h"
+#include "util/hamming.h"
+#include "util/stage_stats.h"
 #include "files.hpp"
 
 #include <UnitTest++.h>
 
 #include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <thread>
 
 using namespace std;
 
 list<string> images;
 
 float row_standard_deviation(cv::Mat matrix);
+float cross_validate(const classifier::settings &settings);
+
+/**
+ * The SURF features of every test image, computed once through the feature
+ * pipeline and shared by the tests that only need some features to work
+ * with, along with the label of each image, taken from its directory, and a
+ * vocabulary with the default settings
+ */
+struct image_set {
+   vector<feature_pipeline::image_features> features;
+   vector<float> labels;
+
+   // the descriptors of every image, one after the other
+   cv::Mat descriptors;
+
+   visual_vocabulary vocab;
+
+   // A bag of features over the vocabulary with the default settings
+   bag_of_features bof() const {
+      bag_of_features b;
+      b.set_vocabulary(vocab);
+      return b;
+   }
+};
+
+const image_set &test_images();
 
 /**
  * This test ensures that the images we are testing actually have keypoints and
@@ -97,20 +134,7 @@ TEST(CheckDescriptors) {
  */
 TEST(CheckVisualVocabulary) {
    visual_vocabulary_factory vv_fact; 
-   cv::SurfFeatureDetector detector(200);
-   cv::SurfDescriptorExtractor extractor;
-
-   vector<cv::KeyPoint> keypoints;
-   cv::Mat descriptors;
-
-   // Compute features for each image and add to the descriptor list
-   for (list<string>::iterator image = images.begin(); image != images.end(); image++) {
-      cv::Mat grayscale_image = cv::imread(*image, CV_LOAD_IMAGE_GRAYSCALE);
-
-      detector.detect(grayscale_image, keypoints);
-      extractor.compute(grayscale_image, keypoints, descriptors);
-      vv_fact.add_descriptors(descriptors);
-   }
+   vv_fact.add_descriptors(test_images().descriptors);
 
    // Generate a visual vocabulary
    visual_vocabulary vocab = vv_fact.compute_visual_vocabulary(visual_vocabulary::settings());
@@ -132,20 +156,100 @@ TEST(CheckVisualVocabulary) {
    CHECK(row_standard_deviation(vocab.centroids) > 0.1);
 }
 
+/**
+ * This test ensures that a vocabulary trained with mini-batch k-means on a
+ * bounded sample of the descriptors still has variety
+ */
+TEST(MiniBatchVisualVocabulary) {
+   visual_vocabulary::settings settings;
+   settings.minibatch = true;
+   settings.reservoir_size = 2000;
+   settings.batch_size = 500;
+   settings.batch_iterations = 100;
+
+   visual_vocabulary_factory vv_fact(settings);
+   vv_fact.add_descriptors(test_images().descriptors);
+
+   // Generate a visual vocabulary
+   visual_vocabulary vocab = vv_fact.compute_visual_vocabulary();
+
+   CHECK(vocab.centroids.rows == settings.size);
+   CHECK(row_standard_deviation(vocab.centroids) > 0.1);
+}
+
+/**
+ * This test checks that skipping distances with Hamerly's bounds still
+ * leaves every descriptor with its nearest center, as plain Lloyd
+ * iterations would, and that the clustering is about as compact as the one
+ * from cv::kmeans
+ */
+TEST(HamerlyKMeans) {
+   const cv::Mat &all_descriptors = test_images().descriptors;
+
+   const int k = 100;
+   const double epsilon = 0.001;
+   cv::TermCriteria criteria(CV_TERMCRIT_ITER | CV_TERMCRIT_EPS, 100, epsilon);
+   cv::Mat opencv_labels, opencv_centers, hamerly_labels, hamerly_centers;
+
+   double opencv_compactness = cv::kmeans(all_descriptors, k, opencv_labels, criteria, 5,
+         cv::KMEANS_PP_CENTERS, opencv_centers);
+   double hamerly_compactness = hamerly_kmeans(all_descriptors, k, hamerly_labels, criteria, 5,
+         hamerly_centers);
+
+   CHECK(hamerly_centers.rows == k);
+   CHECK(hamerly_labels.rows == all_descriptors.rows);
+
+   // The labels were last assigned before the centers moved by at most
+   // epsilon, so the center of a descriptor may have become further than
+   // its nearest one by twice that
+   int misassigned = 0;
+   for (int i = 0; i < all_descriptors.rows; i++) {
+      double nearest = numeric_limits<double>::infinity();
+      for (int c = 0; c < k; c++) {
+         nearest = min(nearest, cv::norm(all_descriptors.row(i), hamerly_centers.row(c)));
+      }
+      double assigned = cv::norm(all_descriptors.row(i),
+            hamerly_centers.row(hamerly_labels.at<int>(i)));
+      if (assigned > nearest + 2 * epsilon + 1e-5) misassigned++;
+   }
+   CHECK_EQUAL(0, misassigned);
+
+   // Both find local minima from random seeds, so only expect similar quality
+   CHECK(hamerly_compactness < 1.1 * opencv_compactness);
+}
 
 /**
  * This test checks to see if the generated bags of words are actually
  * interesting
  */
 TEST(ComputeFeatures) {
-   visual_vocabulary_factory vv_fact; 
+   const image_set &set = test_images();
+   bag_of_features bof = set.bof();
+
+   classifier_factory fact;
+   
+   for (int i = 0; i < set.features.size(); i++) {
+      fact.add_feature_vector(bof.mat_feature_vector(set.features[i].keypoints, set.features[i].descriptors),0);
+   }
+   
+   CHECK(row_standard_deviation(fact.samples) > 1);
+}
+
+/**
+ * This test checks that the threaded feature pipeline produces the same
+ * features, in the same order, as computing them one image at a time, and
+ * that it doesn't run ahead of its output
+ */
+TEST(FeaturePipeline) {
+   visual_vocabulary_factory vv_fact;
    cv::SurfFeatureDetector detector(200);
    cv::SurfDescriptorExtractor extractor;
 
    vector<vector<cv::KeyPoint> > keypoints_list;
    vector<cv::Mat > descriptors_list;
+   vector<cv::Size> size_list;
 
-   // Compute features for each image and add to the descriptor list
+   // Compute features for each image one at a time
    for (list<string>::iterator image = images.begin(); image != images.end(); image++) {
       vector<cv::KeyPoint> keypoints;
       cv::Mat descriptors;
@@ -156,64 +260,528 @@ TEST(ComputeFeatures) {
       extractor.compute(grayscale_image, keypoints, descriptors);
       keypoints_list.push_back(keypoints);
       descriptors_list.push_back(descriptors);
+      size_list.push_back(grayscale_image.size());
 
       vv_fact.add_descriptors(descriptors);
    }
 
-   // Generate a visual vocabulary
    visual_vocabulary vocab = vv_fact.compute_visual_vocabulary(visual_vocabulary::settings());
+   bag_of_features bof;
+   bof.set_vocabulary(vocab);
+
+   // Use small queues and several threads so stages have to wait on each other
+   feature_pipeline::settings settings;
+   settings.feature_threads = 4;
+   settings.queue_capacity = 2;
+   feature_pipeline pipeline(settings);
+   pipeline.set_encoder(bof);
+
+   vector<feature_pipeline::image_features> results =
+      pipeline.run(vector<string>(images.begin(), images.end()));
+
+   CHECK(results.size() == images.size());
+   list<string>::iterator image = images.begin();
+   for (int i = 0; i < results.size(); i++, image++) {
+      CHECK(results[i].file == *image);
+      CHECK(results[i].size == size_list[i]);
+      CHECK(results[i].keypoints.size() == keypoints_list[i].size());
+      CHECK(cv::norm(results[i].descriptors, descriptors_list[i], cv::NORM_L1) == 0);
+      CHECK(results[i].feature_vector == bof.feature_vector(keypoints_list[i], descriptors_list[i], size_list[i]));
+   }
+
+   // Files are only taken from a source while the images in flight fit in
+   // the queue capacity plus one per thread, here without an encoder
+   settings.decode_threads = 1;
+   feature_pipeline bounded(settings);
+   size_t in_flight = settings.queue_capacity + settings.decode_threads + settings.feature_threads;
+   size_t listed = 0, delivered = 0;
+   bounded.run([&](string &file) {
+      if (listed == images.size()) return false;
+      file = results[listed++].file;
+      return true;
+   }, [&](feature_pipeline::image_features &features) {
+      CHECK(listed <= delivered + in_flight);
+      delivered++;
+   });
+   CHECK_EQUAL(delivered, images.size());
+}
 
-   // Compute bag of features representation for each image
+/**
+ * This test runs the feature pipeline twice with a cache, and checks that the
+ * second run gives the same features from the cache, and that changing the
+ * encoder recomputes only the feature vectors
+ */
+TEST(FeatureCache) {
+   vector<string> files(images.begin(), images.end());
+   const string directory = "/tmp/test_feature_cache";
+   boost::filesystem::remove_all(directory);
+
+   // Build a vocabulary from an uncached run
+   feature_pipeline plain;
+   vector<feature_pipeline::image_features> expected = plain.run(files);
+   visual_vocabulary_factory vv_fact;
+   for (int i = 0; i < expected.size(); i++) {
+      vv_fact.add_descriptors(expected[i].descriptors);
+   }
+   visual_vocabulary vocab = vv_fact.compute_visual_vocabulary(visual_vocabulary::settings());
    bag_of_features bof;
-   bof.set_vocabulary(vocab); 
+   bof.set_vocabulary(vocab);
+
+   feature_pipeline::settings settings;
+   settings.cache_directory = directory;
+   feature_pipeline pipeline(settings);
+   pipeline.set_encoder(bof);
+
+   vector<feature_pipeline::image_features> first = pipeline.run(files);
+   stage_stats::reset();
+   vector<feature_pipeline::image_features> second = pipeline.run(files);
+
+#ifdef INSTRUMENTATION
+   // The second run finds everything in the cache, so it neither decodes
+   // nor describes nor encodes any image
+   vector<stage_summary> stages = stage_stats::summary();
+   for (int i = 0; i < stages.size(); i++) {
+      CHECK(stages[i].stage != "decode" && stages[i].stage != "detect_describe" &&
+            stages[i].stage != "describe" && stages[i].stage != "encode");
+   }
+#endif
+
+   CHECK(second.size() == expected.size());
+   for (int i = 0; i < second.size(); i++) {
+      CHECK(second[i].size == expected[i].size);
+      CHECK(second[i].keypoints.size() == expected[i].keypoints.size());
+      for (int k = 0; k < second[i].keypoints.size(); k++) {
+         CHECK(second[i].keypoints[k].pt == expected[i].keypoints[k].pt);
+      }
+      CHECK(cv::norm(second[i].descriptors, expected[i].descriptors, cv::NORM_L1) == 0);
+      CHECK(second[i].feature_vector == first[i].feature_vector);
+   }
 
-   classifier_factory fact;
-   
-   for (int i = 0; i < keypoints_list.size(); i++) {
-      fact.add_feature_vector(bof.mat_feature_vector(keypoints_list[i], descriptors_list[i]),0);
+   // A different encoder has to miss the cached feature vectors
+   struct bag_of_features::settings bof_settings;
+   bof_settings.spatial_pyramid_depth = 2;
+   bof.set_settings(bof_settings);
+   pipeline.set_encoder(bof);
+   vector<feature_pipeline::image_features> third = pipeline.run(files);
+   for (int i = 0; i < third.size(); i++) {
+      CHECK(third[i].feature_vector ==
+            bof.feature_vector(expected[i].keypoints, expected[i].descriptors, expected[i].size));
+   }
+
+   // So does a sparse encoder
+   pipeline.set_encoder(bof, true);
+   vector<feature_pipeline::image_features> sparse = pipeline.run(files);
+   for (int i = 0; i < sparse.size(); i++) {
+      CHECK(sparse[i].sparse_feature_vector.size == (int)third[i].feature_vector.size());
    }
-   
-   CHECK(row_standard_deviation(fact.samples) > 1);
 }
 
 /**
- * This test checks to see that the classifier classifies all of the training
- * data correctly
+ * This test walks a small directory tree, and checks that the pipeline gives
+ * the same results when its files come from a source one at a time
  */
-TEST(ClassifierResponses) {
-   visual_vocabulary_factory vv_fact; 
-   cv::SurfFeatureDetector detector(200);
-   cv::SurfDescriptorExtractor extractor;
+TEST(FileWalker) {
+   boost::filesystem::path root("/tmp/test_walk");
+   boost::filesystem::remove_all(root);
+   boost::filesystem::create_directories(root / "a" / "b");
+   const char *names[] = { "a/one.png", "a/b/two.PNG", "three.Jpg", "four.txt", "a/five" };
+   for (int i = 0; i < 5; i++) {
+      std::ofstream((root / names[i]).string().c_str()) << i;
+   }
+
+   // Extensions match regardless of case, and only files are listed
+   vector<string> extensions;
+   extensions.push_back(".png");
+   extensions.push_back(".jpg");
+   list<string> found = get_files_recursive(root.string(), extensions);
+   CHECK_EQUAL(found.size(), 3);
+   CHECK_EQUAL(get_files_recursive(root.string(), ".PNG").size(), 2);
+
+   // A walker hands out the same files in the same order
+   file_walker walker(root.string(), extensions);
+   string file;
+   for (list<string>::iterator f = found.begin(); f != found.end(); f++) {
+      CHECK(walker.next(file) && file == *f);
+   }
+   CHECK(!walker.next(file));
+
+   // Results from a source come back in the order it produced the files
+   vector<string> files(images.begin(), images.end());
+   files.resize(min<size_t>(files.size(), 8));
+   feature_pipeline pipeline;
+   vector<feature_pipeline::image_features> expected = pipeline.run(files);
+
+   size_t next = 0;
+   vector<feature_pipeline::image_features> results;
+   pipeline.run([&](string &f) {
+      if (next == files.size()) return false;
+      f = files[next++];
+      return true;
+   }, [&](feature_pipeline::image_features &features) {
+      results.push_back(features);
+   });
+
+   CHECK(results.size() == expected.size());
+   for (int i = 0; i < results.size() && i < expected.size(); i++) {
+      CHECK(results[i].file == expected[i].file);
+      CHECK(results[i].keypoints.size() == expected[i].keypoints.size());
+   }
+}
 
+/**
+ * This test checks that images are scaled down to fit the maximum size, and
+ * that the pipeline finds their keypoints in the scaled image
+ */
+TEST(ImageScaling) {
+   vector<string> files(images.begin(), images.end());
+   files.resize(min<size_t>(files.size(), 4));
+
+   image_scaling none;
+   cv::Mat full = cv::imread(files[0], CV_LOAD_IMAGE_GRAYSCALE);
+   CHECK(cv::norm(none.read(files[0]), full, cv::NORM_L1) == 0);
+
+   image_scaling half;
+   half.max_dimension = max(full.cols, full.rows) / 2;
+   cv::Mat scaled = half.read(files[0]);
+   CHECK_EQUAL(max(scaled.cols, scaled.rows), half.max_dimension);
+   CHECK(abs(scaled.cols * full.rows - scaled.rows * full.cols) <= max(full.cols, full.rows));
+
+   // A fixed scale applies to every image
+   image_scaling quarter;
+   quarter.scale = 0.25;
+   CHECK(quarter.read(files[0]).size() == cv::Size(lround(full.cols * 0.25), lround(full.rows * 0.25)));
+
+   feature_pipeline::settings settings;
+   settings.scaling = half;
+   feature_pipeline pipeline(settings);
+   vector<feature_pipeline::image_features> results = pipeline.run(files);
+   for (int i = 0; i < results.size(); i++) {
+      CHECK(max(results[i].size.width, results[i].size.height) <= half.max_dimension);
+      for (int j = 0; j < results[i].keypoints.size(); j++) {
+         cv::Point2f pt = results[i].keypoints[j].pt;
+         CHECK(pt.x >= 0 && pt.x < results[i].size.width && pt.y >= 0 && pt.y < results[i].size.height);
+      }
+   }
+}
+
+/**
+ * This test builds a vocabulary of binary words from ORB descriptors, and
+ * checks that their feature vectors still tell the images apart
+ */
+TEST(BinaryFeatures) {
+   cv::Ptr<feature_extractor> orb = feature_extractor::create("orb");
+   CHECK(orb->binary() && !feature_extractor::create("surf")->binary());
+
+   visual_vocabulary_factory vv_fact;
    vector<vector<cv::KeyPoint> > keypoints_list;
    vector<cv::Mat > descriptors_list;
-
-   // Compute keypoints and descriptors for every image
+   vector<cv::Size> size_list;
    for (list<string>::iterator image = images.begin(); image != images.end(); image++) {
       vector<cv::KeyPoint> keypoints;
       cv::Mat descriptors;
 
       cv::Mat grayscale_image = cv::imread(*image, CV_LOAD_IMAGE_GRAYSCALE);
-
-      detector.detect(grayscale_image, keypoints);
-      extractor.compute(grayscale_image, keypoints, descriptors);
+      orb->extract(grayscale_image, keypoints, descriptors);
+      CHECK(descriptors.empty() || descriptors.type() == CV_8U);
       keypoints_list.push_back(keypoints);
       descriptors_list.push_back(descriptors);
+      size_list.push_back(grayscale_image.size());
 
       vv_fact.add_descriptors(descriptors);
    }
 
-   // Generate a visual vocabulary
-   visual_vocabulary vocab = vv_fact.compute_visual_vocabulary(visual_vocabulary::settings());
+   struct visual_vocabulary::settings vv_settings;
+   vv_settings.size = 100;
+   visual_vocabulary vocab = vv_fact.compute_visual_vocabulary(vv_settings);
+   CHECK(vocab.binary());
+   CHECK_EQUAL(vocab.centroids.rows, 100);
+
+   // The popcount distance should agree with OpenCV's
+   const cv::Mat &d = descriptors_list[0];
+   for (int i = 0; i < min(d.rows, 20); i++) {
+      CHECK_EQUAL(hamming_distance(d.ptr(i), vocab.centroids.ptr(0), d.cols),
+                  (int)cv::norm(d.row(i), vocab.centroids.row(0), cv::NORM_HAMMING));
+   }
+
+   // Every image should be its own nearest neighbor
+   bag_of_features bof;
+   bof.set_vocabulary(vocab);
+   classifier_factory fact;
+   for (int i = 0; i < keypoints_list.size(); i++) {
+      fact.add_feature_vector(bof.feature_vector(keypoints_list[i], descriptors_list[i], size_list[i]), i);
+   }
+   classifier::settings settings;
+   settings.neighbors = 1;
+   vector<float> responses = fact.create_classifier(settings).classify(fact.samples);
+   int matched = 0;
+   for (int i = 0; i < responses.size(); i++) {
+      matched += responses[i] == i;
+   }
+   CHECK((float)matched / responses.size() > 0.9);
+
+   // The pipeline gives the same descriptors
+   feature_pipeline::settings pipeline_settings;
+   pipeline_settings.features = "orb";
+   feature_pipeline pipeline(pipeline_settings);
+   vector<string> files(images.begin(), images.end());
+   files.resize(min<size_t>(files.size(), 4));
+   vector<feature_pipeline::image_features> results = pipeline.run(files);
+   for (int i = 0; i < results.size(); i++) {
+      CHECK(cv::norm(results[i].descriptors, descriptors_list[i], cv::NORM_HAMMING) == 0);
+   }
+}
+
+/**
+ * Dense features should lay the same grid over every image of a size, and
+ * describe every point of it.
+ */
+TEST(DenseFeatures) {
+   dense_grid grid;
+   grid.stride = 10;
+   grid.scales.push_back(24);
+   grid.margin = 40;
+
+   // 40 pixels of border on each side leave 2 by 3 points, 2 scales each
+   vector<cv::KeyPoint> points = grid.keypoints(cv::Size(100, 110));
+   CHECK_EQUAL(points.size(), 12);
+   for (int i = 0; i < points.size(); i++) {
+      CHECK(points[i].pt.x >= 40 && points[i].pt.x < 100 - 40);
+      CHECK(points[i].pt.y >= 40 && points[i].pt.y < 110 - 40);
+   }
+   CHECK(grid.keypoints(cv::Size(40, 40)).empty());
+
+   // The default margin keeps every descriptor inside the image
+   grid.margin = 0;
+   cv::Ptr<feature_extractor> dense = feature_extractor::create("dense-surf", grid);
+   CHECK(!dense->binary() && dense->name() != feature_extractor::create("dense-surf")->name());
 
-   // Compute bag of features representation for each image
+   for (list<string>::iterator image = images.begin(); image != images.end(); image++) {
+      cv::Mat grayscale_image = cv::imread(*image, CV_LOAD_IMAGE_GRAYSCALE);
+      vector<cv::KeyPoint> keypoints;
+      cv::Mat descriptors;
+      dense->extract(grayscale_image, keypoints, descriptors);
+
+      CHECK_EQUAL(keypoints.size(), grid.keypoints(grayscale_image.size()).size());
+      CHECK_EQUAL(descriptors.rows, (int)keypoints.size());
+   }
+}
+
+/**
+ * This test compares hard and soft assignment. Hard assignment should only
+ * ever vote for one visual word per descriptor, and soft assignment should
+ * spread the same votes over more words.
+ */
+TEST(AssignmentKernels) {
+   const image_set &set = test_images();
+
+   bag_of_features hard_bof, soft_bof;
+   struct bag_of_features::settings hard_settings, soft_settings;
+   hard_settings.soft_kernel = false;
+   soft_settings.soft_kernel = true;
+   hard_bof.set_vocabulary(set.vocab);
+   hard_bof.set_settings(hard_settings);
+   soft_bof.set_vocabulary(set.vocab);
+   soft_bof.set_settings(soft_settings);
+
+   for (int i = 0; i < set.features.size(); i++) {
+      const feature_pipeline::image_features &f = set.features[i];
+      vector<double> hard_fv = hard_bof.feature_vector(f.keypoints, f.descriptors);
+      vector<double> soft_fv = soft_bof.feature_vector(f.keypoints, f.descriptors);
+      CHECK_EQUAL(hard_fv.size(), soft_fv.size());
+
+      // Histograms add up to their number of bins, so each descriptor adds
+      // size / rows. Each descriptor votes for exactly one word, so every
+      // bin holds a whole number of votes and they add up to the number of
+      // descriptors.
+      double votes = 0, soft_total = 0;
+      int hard_words = 0, soft_words = 0;
+      for (int j = 0; j < hard_fv.size(); j++) {
+         double bin_votes = hard_fv[j] * f.descriptors.rows / hard_fv.size();
+         CHECK_CLOSE(bin_votes, floor(bin_votes + 0.5), 1e-6);
+         votes += bin_votes;
+         soft_total += soft_fv[j];
+         hard_words += hard_fv[j] > 0;
+         soft_words += soft_fv[j] > 0;
+      }
+      CHECK_CLOSE(votes, f.descriptors.rows, 1e-6);
+      CHECK(hard_words > 0 && hard_words <= f.descriptors.rows);
+      CHECK_CLOSE(soft_total, soft_fv.size(), 1e-3);
+      CHECK(soft_words >= hard_words);
+   }
+}
+
+/**
+ * The fast exponential should stay within single precision of std::exp.
+ * Soft assignment constrained to every word should match the unconstrained
+ * kind, and constrained to a few words should only weight those, the same
+ * way in dense and sparse feature vectors.
+ */
+TEST(SoftAssignment) {
+   for (float x = fast_exp_min; x < 0; x += 0.01f) {
+      CHECK_CLOSE(fast_exp(x), exp((double)x), 1e-6 * exp((double)x));
+   }
+   CHECK_EQUAL(fast_exp(0), 1);
+
+   cv::RNG rng(1);
+   cv::Mat samples(2000, 64, CV_32F);
+   rng.fill(samples, cv::RNG::UNIFORM, 0, 1);
+   visual_vocabulary_factory vv_fact;
+   vv_fact.add_descriptors(samples);
+   struct visual_vocabulary::settings vv_settings;
+   vv_settings.size = 50;
    bag_of_features bof;
-   bof.set_vocabulary(vocab); 
+   bof.set_vocabulary(vv_fact.compute_visual_vocabulary(vv_settings));
+
+   cv::Size size(100, 100);
+   cv::Mat descriptors = samples.rowRange(0, 200);
+   vector<cv::KeyPoint> keypoints;
+   for (int i = 0; i < descriptors.rows; i++) {
+      keypoints.push_back(cv::KeyPoint(rng.uniform(0.f, 100.f), rng.uniform(0.f, 100.f), 16));
+   }
+
+   struct bag_of_features::settings soft_settings;
+   soft_settings.soft_kernel = true;
+   soft_settings.spatial_pyramid_depth = 2;
+   bof.set_settings(soft_settings);
+   vector<double> full = bof.feature_vector(keypoints, descriptors, size);
+   vector<double> single = bof.feature_vector(vector<cv::KeyPoint>(1, keypoints[0]), descriptors.row(0), size);
+
+   soft_settings.soft_neighbors = vv_settings.size;
+   bof.set_settings(soft_settings);
+   vector<double> constrained = bof.feature_vector(keypoints, descriptors, size);
+   CHECK_EQUAL(constrained.size(), full.size());
+   for (int i = 0; i < full.size(); i++) {
+      CHECK_CLOSE(constrained[i], full[i], 1e-4 * max(1., fabs(full[i])));
+   }
+
+   soft_settings.soft_neighbors = 3;
+   bof.set_settings(soft_settings);
+   vector<double> nearest = bof.feature_vector(vector<cv::KeyPoint>(1, keypoints[0]), descriptors.row(0), size);
+   int single_bins = 0, nearest_bins = 0;
+   for (int i = 0; i < single.size(); i++) {
+      single_bins += single[i] > 0;
+      nearest_bins += nearest[i] > 0;
+   }
+   CHECK_EQUAL(single_bins, 2 * vv_settings.size);
+   CHECK_EQUAL(nearest_bins, 2 * 3);
+
+   vector<double> dense = bof.feature_vector(keypoints, descriptors, size);
+   sparse_vector sparse = bof.sparse_feature_vector(keypoints, descriptors, size);
+   CHECK_EQUAL(sparse.size, (int)dense.size());
+   vector<double> expanded(sparse.size, 0);
+   for (int i = 0; i < sparse.columns.size(); i++) {
+      expanded[sparse.columns[i]] = sparse.values[i];
+   }
+   for (int i = 0; i < dense.size(); i++) {
+      CHECK_CLOSE(expanded[i], dense[i], 1e-4 * max(1., fabs(dense[i])));
+   }
+}
+
+/**
+ * This test checks that the spatial pyramid levels agree with each other.
+ * With two levels the weights are equal, so the whole image histogram should
+ * be the sum of the histograms of its four cells.
+ */
+TEST(SpatialPyramid) {
+   const image_set &set = test_images();
+   const visual_vocabulary &vocab = set.vocab;
+   int words = vocab.centroids.rows;
+
+   bag_of_features bof;
+   struct bag_of_features::settings settings;
+   settings.spatial_pyramid_depth = 2;
+   bof.set_vocabulary(vocab);
+   bof.set_settings(settings);
+
+   for (int i = 0; i < set.features.size(); i++) {
+      const feature_pipeline::image_features &f = set.features[i];
+      vector<double> fv = bof.feature_vector(f.keypoints, f.descriptors, f.size);
+      CHECK(fv.size() == words * 5);
+
+      for (int word = 0; word < words; word++) {
+         double cells = fv[words + word] + fv[2 * words + word] + fv[3 * words + word] + fv[4 * words + word];
+         CHECK_CLOSE(fv[word], cells, 1e-6);
+      }
+   }
+}
+
+/**
+ * This test compares nearest word lookups through the vocabulary index with
+ * an exact scan of the vocabulary. The index can miss the nearest word, but
+ * never find one nearer than the scan, and the distance it gives has to be
+ * the distance to the word it found.
+ */
+TEST(VocabularyIndex) {
+   visual_vocabulary_factory vv_fact;
+   vv_fact.add_descriptors(test_images().descriptors);
+
+   // Generate a visual vocabulary with an index
+   visual_vocabulary::settings vv_settings;
+   vv_settings.index.branching = 8;
+   vv_settings.index.checks = 64;
+   visual_vocabulary vocab = vv_fact.compute_visual_vocabulary(vv_settings);
+   CHECK(!vocab.index.empty());
+
+   // Use the descriptors of the last image as queries
+   const cv::Mat &descriptors = test_images().features.back().descriptors;
+   int found = 0, index_word, exact_word;
+   float index_distance;
+   for (int i = 0; i < descriptors.rows; i++) {
+      const float *point = descriptors.ptr<float>(i);
+
+      CHECK_EQUAL(vocab.index.nearest(point, 1, &index_word, &index_distance), 1);
+      float exact_distance = numeric_limits<float>::infinity();
+      for (int word = 0; word < vocab.centroids.rows; word++) {
+         float distance = cv::norm(descriptors.row(i), vocab.centroids.row(word), cv::NORM_L2SQR);
+         if (distance < exact_distance) {
+            exact_distance = distance;
+            exact_word = word;
+         }
+      }
+
+      float tolerance = 1e-4 * max(1.f, exact_distance);
+      float word_distance = cv::norm(descriptors.row(i), vocab.centroids.row(index_word), cv::NORM_L2SQR);
+      CHECK_CLOSE(index_distance, word_distance, tolerance);
+      CHECK(index_distance >= exact_distance - tolerance);
+      found += index_word == exact_word;
+   }
+
+   CHECK((float)found / descriptors.rows > 0.5);
+
+   // The index should survive a round trip through an archive
+   std::fstream fs;
+   fs.open("/tmp/test_index.vv", std::fstream::out);
+   boost::archive::text_oarchive oa(fs);
+   oa << vocab;
+   fs.close();
+
+   visual_vocabulary loaded;
+   fs.open("/tmp/test_index.vv", std::fstream::in);
+   boost::archive::text_iarchive ia(fs);
+   ia >> loaded;
+   CHECK(!loaded.index.empty());
+
+   // And through a binary model file, mapped rather than parsed
+   vocab.save_binary("/tmp/test_index.bin");
+   visual_vocabulary mapped;
+   mapped.load_binary("/tmp/test_index.bin");
+   CHECK(!mapped.index.empty());
+   CHECK(cv::norm(vocab.centroids, mapped.centroids, cv::NORM_INF) == 0);
+   CHECK(cv::norm(vocab.centroid_norms, mapped.centroid_norms, cv::NORM_INF) == 0);
+}
+
+/**
+ * This test checks to see that the classifier classifies all of the training
+ * data correctly
+ */
+TEST(ClassifierResponses) {
+   const image_set &set = test_images();
+   bag_of_features bof = set.bof();
 
    classifier_factory fact;
    
-   for (int i = 0; i < keypoints_list.size(); i++) {
-      fact.add_feature_vector(bof.mat_feature_vector(keypoints_list[i], descriptors_list[i]),i);
+   for (int i = 0; i < set.features.size(); i++) {
+      fact.add_feature_vector(bof.mat_feature_vector(set.features[i].keypoints, set.features[i].descriptors),i);
    }
 
    // Create a classifier that searches for only one
@@ -244,83 +812,454 @@ TEST(ClassifierResponses) {
    for (int i = 0; i < responses.size(); i++) {
       CHECK(i == responses[i]);
    }
+
+   // Asking for fewer neighbors than it was trained for reuses the trained
+   // classifier, and must still find each sample itself
+   settings.neighbors = 3;
+   cls.set_settings(settings);
+   settings.neighbors = 1;
+   cls.set_settings(settings);
+   CHECK(cls.get_settings().neighbors == 1);
+   responses = cls.classify(fact.samples);
+   for (int i = 0; i < responses.size(); i++) {
+      CHECK(i == responses[i]);
+   }
+
+   // Round trip through a binary model file as well
+   cls.save_binary("/tmp/test.bin");
+   classifier mapped;
+   mapped.load_binary("/tmp/test.bin");
+   responses = mapped.classify(fact.samples);
+   for (int i = 0; i < responses.size(); i++) {
+      CHECK(i == responses[i]);
+   }
 }
 
 /**
- * This test checks to see whether or not the classification process is
- * accurate using cross-validation
+ * This test checks that the classifier's own neighbor search gives the same
+ * labels as cv::KNearest
  */
-TEST(ClassifierAccuracy) {
-   visual_vocabulary_factory vv_fact; 
-   cv::SurfFeatureDetector detector(200);
-   cv::SurfDescriptorExtractor extractor;
+TEST(NearestNeighbors) {
+   const image_set &set = test_images();
+   bag_of_features bof = set.bof();
+
+   // Train on every other image and query with the rest, with a few labels
+   // so that votes can tie
+   classifier_factory fact, queries;
+   for (int i = 0; i < set.features.size(); i++) {
+      vector<double> fv = bof.feature_vector(set.features[i].keypoints, set.features[i].descriptors);
+      (i % 2 ? queries : fact).add_feature_vector(fv, i % 3);
+   }
 
-   map<string, float> labels;
-   float max_label = 0;
-   vector<float> label_list;
-   // Construct the list of labels corresponding to each image
-   for (list<string>::iterator image = images.begin(); image != images.end(); image++) {
-      boost::filesystem::path p(*image);
-      string label = p.parent_path().leaf().string();
-      if (labels.find(label) == labels.end()) {
-         labels[label] = max_label++;
+   for (int k = 1; k <= 7; k += 2) {
+      classifier::settings settings;
+      settings.neighbors = k;
+      classifier cls = fact.create_classifier(settings);
+
+      cv::KNearest knn;
+      knn.train(fact.samples, fact.responses, cv::Mat(), false, k);
+      cv::Mat expected(queries.samples.rows, 1, CV_32F);
+
+      vector<float> responses = cls.classify(queries.samples);
+      knn.find_nearest(queries.samples, k, &expected);
+
+      CHECK_EQUAL(responses.size(), (size_t)queries.samples.rows);
+      for (int i = 0; i < responses.size(); i++) {
+         CHECK(responses[i] == expected.at<float>(i, 0));
       }
-      label_list.push_back(labels[label]);
    }
+}
 
-   vector<vector<cv::KeyPoint> > keypoints_list;
-   vector<cv::Mat > descriptors_list;
+/**
+ * This test compares the labels the classifier gives through its approximate
+ * neighbor index with the labels of the exact search, and checks that the
+ * index survives being saved and loaded
+ */
+TEST(ClassifierIndex) {
+   const image_set &set = test_images();
+   bag_of_features bof = set.bof();
 
-   // Compute keypoints and descriptors for every image
-   for (list<string>::iterator image = images.begin(); image != images.end(); image++) {
-      vector<cv::KeyPoint> keypoints;
-      cv::Mat descriptors;
+   classifier_factory fact;
+   for (int i = 0; i < set.features.size(); i++) {
+      fact.add_feature_vector(bof.feature_vector(set.features[i].keypoints, set.features[i].descriptors), i);
+   }
 
-      cv::Mat grayscale_image = cv::imread(*image, CV_LOAD_IMAGE_GRAYSCALE);
+   classifier::settings settings;
+   settings.neighbors = 1;
+   classifier exact = fact.create_classifier(settings);
+   settings.index.connections = 8;
+   settings.index.search = 32;
+   classifier indexed = fact.create_classifier(settings);
 
-      detector.detect(grayscale_image, keypoints);
-      extractor.compute(grayscale_image, keypoints, descriptors);
-      keypoints_list.push_back(keypoints);
-      descriptors_list.push_back(descriptors);
+   vector<float> expected = exact.classify(fact.samples);
+   vector<float> responses = indexed.classify(fact.samples);
+   CHECK_EQUAL(responses.size(), expected.size());
 
-      vv_fact.add_descriptors(descriptors);
+   int found = 0;
+   for (int i = 0; i < responses.size(); i++) {
+      found += responses[i] == expected[i];
    }
+   CHECK((float)found / responses.size() > 0.9);
 
-   // Generate a visual vocabulary
-   visual_vocabulary vocab = vv_fact.compute_visual_vocabulary(visual_vocabulary::settings());
+   // Changing only the search width keeps the graph
+   settings.index.search = 64;
+   indexed.set_settings(settings);
+   responses = indexed.classify(fact.samples);
+   int wider = 0;
+   for (int i = 0; i < responses.size(); i++) {
+      wider += responses[i] == expected[i];
+   }
+   CHECK((float)wider / responses.size() > 0.9);
 
-   // Compute bag of features representation for one image
-   bag_of_features bof;
-   bof.set_vocabulary(vocab); 
+   // The index should give the same labels after a round trip through an
+   // archive and through a binary model file
 
-   // Create a few folds for the data
-   int num_folds = 5;
-   std::vector<classifier_factory> factories(num_folds);
-   std::vector<classifier_factory> folds(num_folds);
-   for (int i = 0; i < keypoints_list.size(); i++) {
-      vector<double> fv = bof.feature_vector(keypoints_list[i], descriptors_list[i]); 
-      for (int j = 0; j < factories.size(); j++) {
-         if (j == i % num_folds) {
-            folds[j].add_feature_vector(fv, label_list[i]);
-         } else {
-            factories[j].add_feature_vector(fv, label_list[i]);
-         }
+   std::fstream fs;
+   fs.open("/tmp/test_index.cls", std::fstream::out);
+   boost::archive::text_oarchive oa(fs);
+   oa << indexed;
+   fs.close();
+
+   classifier loaded;
+   fs.open("/tmp/test_index.cls", std::fstream::in);
+   boost::archive::text_iarchive ia(fs);
+   ia >> loaded;
+   CHECK(loaded.get_settings().index.connections == 8);
+   CHECK(loaded.classify(fact.samples) == responses);
+
+   indexed.save_binary("/tmp/test_index.bin");
+   classifier mapped;
+   mapped.load_binary("/tmp/test_index.bin");
+   CHECK(mapped.classify(fact.samples) == responses);
+}
+
+/**
+ * This test checks that sparse feature vectors hold the same bins as the
+ * dense ones, and that a classifier trained on them gives the same labels
+ */
+TEST(SparseFeatures) {
+   const image_set &set = test_images();
+   bag_of_features bof = set.bof();
+
+   struct bag_of_features::settings bof_settings;
+   bof_settings.spatial_pyramid_depth = 2;
+   bof.set_settings(bof_settings);
+
+   classifier_factory dense, sparse;
+   int nonzeros = 0;
+   for (int i = 0; i < set.features.size(); i++) {
+      vector<double> fv = bof.feature_vector(set.features[i].keypoints, set.features[i].descriptors);
+      sparse_vector sfv = bof.sparse_feature_vector(set.features[i].keypoints, set.features[i].descriptors);
+      CHECK_EQUAL(fv.size(), sfv.size);
+
+      // Every non-zero bin should be there, with the same value
+      vector<float> expanded(sfv.size, 0.f);
+      for (int j = 0; j < sfv.nonzeros(); j++) {
+         expanded[sfv.columns[j]] = sfv.values[j];
+      }
+      for (int j = 0; j < fv.size(); j++) {
+         CHECK_CLOSE(fv[j], expanded[j], 1e-4 * max(1., fabs(fv[j])));
       }
+
+      // Hard assignment puts each descriptor into one bin of each level
+      CHECK(sfv.nonzeros() <= 2 * set.features[i].descriptors.rows);
+      nonzeros += sfv.nonzeros();
+
+      dense.add_feature_vector(fv, i);
+      sparse.add_feature_vector(sfv, i);
    }
+   CHECK_EQUAL(sparse.sparse_samples.nonzeros(), nonzeros);
+   CHECK(cv::norm(sparse.sparse_samples.dense(), dense.samples, cv::NORM_INF) < 1e-3);
 
-   // Create and test classifiers for each fold
-   int total_correct = 0;
-   for (int j = 0; j < factories.size(); j++) {
-      classifier cls = factories[j].create_classifier();
-      std::vector<float> responses = cls.classify(folds[j].samples);
-      for (int i = 0; i < responses.size(); i++) {
-         total_correct += (responses[i] == folds[j].responses.at<float>(i,0));
-      }
+   // Each sample should still be its own nearest neighbor
+   classifier::settings settings;
+   settings.neighbors = 1;
+   classifier cls = sparse.create_classifier(settings);
+   vector<float> responses = cls.classify(sparse.sparse_samples);
+   for (int i = 0; i < responses.size(); i++) {
+      CHECK(i == responses[i]);
+   }
+
+   // Dense queries against sparse samples and the other way around
+   CHECK(cls.classify(dense.samples) == responses);
+   classifier dense_cls = dense.create_classifier(settings);
+   CHECK(dense_cls.classify(sparse.sparse_samples) == responses);
+
+   // Round trip through an archive and a binary model file
+   std::fstream fs;
+   fs.open("/tmp/test_sparse.cls", std::fstream::out);
+   boost::archive::text_oarchive oa(fs);
+   oa << cls;
+   fs.close();
+
+   classifier loaded;
+   fs.open("/tmp/test_sparse.cls", std::fstream::in);
+   boost::archive::text_iarchive ia(fs);
+   ia >> loaded;
+   CHECK(loaded.classify(sparse.sparse_samples) == responses);
+
+   cls.save_binary("/tmp/test_sparse.bin");
+   classifier mapped;
+   mapped.load_binary("/tmp/test_sparse.bin");
+   CHECK(mapped.classify(sparse.sparse_samples) == responses);
+}
+
+/**
+ * This test checks the linear SVM backend with cross-validation, and that a
+ * saved SVM classifier holds only its weights
+ */
+TEST(LinearSVM) {
+   const image_set &set = test_images();
+   bag_of_features bof = set.bof();
+
+   classifier_factory all;
+   for (int i = 0; i < set.features.size(); i++) {
+      all.add_feature_vector(bof.feature_vector(set.features[i].keypoints, set.features[i].descriptors),
+            set.labels[i]);
    }
 
+   classifier::settings settings;
+   settings.backend = classifier::settings::linear_svm_backend;
+
+   // For two class, hopefully better than random
+   CHECK(cross_validate(settings) > 0.5);
+
+   // Sparse queries should get the same labels as dense ones
+   classifier cls = all.create_classifier(settings);
+   vector<float> responses = cls.classify(all.samples);
+   CHECK(cls.classify(sparse_rows::compress(all.samples)) == responses);
+
+   // The saved classifier should not need the samples
+   std::fstream fs;
+   fs.open("/tmp/test_svm.cls", std::fstream::out);
+   boost::archive::text_oarchive oa(fs);
+   oa << cls;
+   fs.close();
+
+   classifier loaded;
+   fs.open("/tmp/test_svm.cls", std::fstream::in);
+   boost::archive::text_iarchive ia(fs);
+   ia >> loaded;
+   CHECK(loaded.get_settings().backend == classifier::settings::linear_svm_backend);
+   CHECK(loaded.classify(all.samples) == responses);
+
+   cls.save_binary("/tmp/test_svm.bin");
+   classifier mapped;
+   mapped.load_binary("/tmp/test_svm.bin");
+   CHECK(mapped.classify(all.samples) == responses);
+
+   model_file file("/tmp/test_svm.bin");
+   CHECK(file.get("samples").empty());
+
+   // Without its samples, a trained SVM can't switch to nearest neighbors
+   // and keeps classifying with its weights
+   classifier::settings switched = settings;
+   switched.backend = classifier::settings::nearest_neighbor_backend;
+   switched.svm.c = 10 * settings.svm.c;
+   cls.set_settings(switched);
+   CHECK(cls.get_settings().backend == classifier::settings::linear_svm_backend);
+   CHECK_EQUAL(cls.get_settings().svm.c, settings.svm.c);
+   CHECK(cls.classify(all.samples) == responses);
+}
+
+/**
+ * This test checks that a classifier updated with added and removed samples
+ * labels like one trained on them from the start, and that the updates can
+ * be appended to its model file
+ */
+TEST(IncrementalClassifier) {
+   const image_set &set = test_images();
+   bag_of_features bof = set.bof();
+
+   // Start from the first half of the samples
+   int half = set.features.size() / 2;
+   classifier_factory all, first;
+   for (int i = 0; i < set.features.size(); i++) {
+      vector<double> fv = bof.feature_vector(set.features[i].keypoints, set.features[i].descriptors);
+      all.add_feature_vector(fv, i);
+      if (i < half) first.add_feature_vector(fv, i);
+   }
+   cv::Mat rest = all.samples.rowRange(half, all.samples.rows);
+   cv::Mat rest_responses = all.responses.rowRange(half, all.responses.rows);
+
+   classifier::settings settings;
+   settings.neighbors = 1;
+   classifier cls = first.create_classifier(settings);
+   cls.save_binary("/tmp/test_incremental.bin");
+
+   // Adding the rest should label like training on everything
+   cls.add(rest, rest_responses);
+   CHECK_EQUAL(cls.size(), all.samples.rows);
+   vector<float> expected = all.create_classifier(settings).classify(all.samples);
+   CHECK(cls.classify(all.samples) == expected);
+
+   // A removed sample is no longer its own nearest neighbor
+   vector<int> removed;
+   removed.push_back(0);
+   removed.push_back(half);
+   cls.remove(removed);
+   vector<float> responses = cls.classify(all.samples);
+   CHECK(responses[0] != 0 && responses[half] != half);
+   CHECK_EQUAL(cls.size(), all.samples.rows);
+
+   // Removing a sample twice only records it once
+   cls.remove(removed);
+   CHECK(cls.classify(all.samples) == responses);
+
+   // The changes can only go to the file the classifier was saved to
+   CHECK_THROW(cls.append_delta("/tmp/test_incremental_other.bin"), std::runtime_error);
+
+   // The changes are appended to the file and applied when it is loaded
+   cls.append_delta("/tmp/test_incremental.bin");
+   vector<model_file> models = model_file::read_all("/tmp/test_incremental.bin");
+   CHECK_EQUAL(models.size(), 2);
+   CHECK_EQUAL((int)models[1].get("removed").total(), (int)removed.size());
+   classifier mapped;
+   mapped.load_binary("/tmp/test_incremental.bin");
+   CHECK_EQUAL(mapped.size(), all.samples.rows);
+   CHECK(mapped.classify(all.samples) == responses);
+
+   // Once trained on other samples, the classifier has nothing to append to
+   // the file it was loaded from
+   mapped.train(rest, rest_responses);
+   mapped.add(rest, rest_responses);
+   CHECK_THROW(mapped.append_delta("/tmp/test_incremental.bin"), std::runtime_error);
+
+   // Samples inserted into the index should be found about as well as ones
+   // it was built with
+   settings.index.connections = 8;
+   settings.index.search = 32;
+   classifier indexed = first.create_classifier(settings);
+   indexed.add(rest, rest_responses);
+   vector<float> indexed_responses = indexed.classify(all.samples);
+   int found = 0;
+   for (int i = 0; i < indexed_responses.size(); i++) {
+      found += indexed_responses[i] == expected[i];
+   }
+   CHECK((float)found / indexed_responses.size() > 0.9);
+}
+
+/**
+ * This test checks to see whether or not the classification process is
+ * accurate using cross-validation
+ */
+TEST(ClassifierAccuracy) {
+   float accuracy = cross_validate(classifier::settings());
+
    // For two class, hopefully better than random
-   std::cout << ((float)total_correct / label_list.size()) << std::endl;
-   CHECK((float)total_correct / label_list.size() > 0.5);
+   std::cout << accuracy << std::endl;
+   CHECK(accuracy > 0.5);
+}
+
+/**
+ * Classifying a batch of files or of decoded images, or the files of a
+ * source, should give every image the same label as classifying its feature
+ * vector alone, and leave out the files that can't be read.
+ */
+TEST(BatchClassifier) {
+   vector<string> files(images.begin(), images.end());
+   files.resize(min<size_t>(files.size(), 20));
+
+   feature_pipeline::settings pipeline_settings;
+   feature_pipeline pipeline(pipeline_settings);
+   vector<feature_pipeline::image_features> features = pipeline.run(files);
+
+   visual_vocabulary_factory vv_fact;
+   for (int i = 0; i < features.size(); i++) {
+      vv_fact.add_descriptors(features[i].descriptors);
+   }
+   struct visual_vocabulary::settings vv_settings;
+   vv_settings.size = 100;
+   bag_of_features bof;
+   bof.set_vocabulary(vv_fact.compute_visual_vocabulary(vv_settings));
+
+   classifier_factory fact;
+   for (int i = 0; i < features.size(); i++) {
+      fact.add_feature_vector(bof.feature_vector(features[i].keypoints, features[i].descriptors,
+            features[i].size), i);
+   }
+   classifier::settings settings;
+   settings.neighbors = 1;
+   classifier cls = fact.create_classifier(settings);
+   vector<float> expected = cls.classify(fact.samples);
+
+   batch_classifier batch(bof, cls, pipeline_settings);
+   vector<cv::Mat> decoded;
+   for (int i = 0; i < files.size(); i++) {
+      decoded.push_back(cv::imread(files[i], CV_LOAD_IMAGE_GRAYSCALE));
+   }
+   files.push_back("missing.png");
+   decoded.push_back(cv::Mat());
+
+   batch_classifier::result by_file = batch.classify(files, true);
+   batch_classifier::result by_image = batch.classify(decoded);
+   CHECK_EQUAL(by_file.labels.size(), files.size());
+   CHECK_EQUAL(by_image.labels.size(), files.size());
+   CHECK(!by_file.classified.back() && !by_image.classified.back());
+   CHECK(by_image.neighbors.empty());
+
+   // Each image is its own nearest sample
+   CHECK_EQUAL(by_file.neighbors.rows, (int)files.size());
+   CHECK_EQUAL(by_file.neighbors.at<int>(files.size() - 1, 0), -1);
+   for (int i = 0; i < expected.size(); i++) {
+      CHECK(by_file.classified[i] && by_image.classified[i]);
+      CHECK_EQUAL(by_file.labels[i], expected[i]);
+      CHECK_EQUAL(by_image.labels[i], expected[i]);
+      CHECK_EQUAL(by_file.distances.at<float>(i, 0), 0);
+   }
+   CHECK(by_file.encode_seconds > 0 && by_file.classify_seconds > 0);
+
+   // Files from a source are answered in order, in batches of any size
+   size_t next_file = 0, answered = 0;
+   batch.classify([&](string &file) {
+      if (next_file == files.size()) return false;
+      file = files[next_file++];
+      return true;
+   }, [&](const string &file, bool classified, float label) {
+      CHECK_EQUAL(file, files[answered]);
+      CHECK_EQUAL(classified, (bool)by_file.classified[answered]);
+      if (classified) CHECK_EQUAL(label, expected[answered]);
+      answered++;
+   }, 4);
+   CHECK_EQUAL(answered, files.size());
+}
+
+/**
+ * Stage statistics should add up what every thread recorded, and place the
+ * percentiles within a bucket of the real ones.
+ */
+TEST(StageStats) {
+   stage_stats::reset();
+
+   vector<thread> threads;
+   for (int t = 0; t < 4; t++) {
+      threads.push_back(thread([] {
+         for (int i = 1; i <= 100; i++) {
+            stage_stats::record("test", i * 1e-3, 2, 10);
+         }
+      }));
+   }
+   for (int t = 0; t < threads.size(); t++) {
+      threads[t].join();
+   }
+
+   vector<stage_summary> stages = stage_stats::summary();
+   CHECK_EQUAL(stages.size(), 1);
+   CHECK_EQUAL(stages[0].stage, "test");
+   CHECK_EQUAL(stages[0].count, 400);
+   CHECK_EQUAL(stages[0].items, 800);
+   CHECK_EQUAL(stages[0].bytes, 4000);
+   CHECK_CLOSE(stages[0].seconds, 4 * 5.05, 1e-9);
+   CHECK_CLOSE(stages[0].max, 0.1, 1e-12);
+   CHECK(stages[0].p50 >= 0.05 && stages[0].p50 <= 0.05 * 1.2);
+   CHECK(stages[0].p99 >= 0.099 && stages[0].p99 <= 0.1);
+
+   CHECK(stage_stats::json().find("\"stage\": \"test\"") != string::npos);
+   CHECK(stage_stats::prometheus().find("imclass_stage_seconds_count{stage=\"test\"} 400") != string::npos);
+   CHECK_THROW(stage_stats::dump("xml"), invalid_argument);
+
+   stage_stats::reset();
+   CHECK(stage_stats::summary().empty());
 }
 
 
@@ -363,3 +1302,69 @@ float row_standard_deviation(cv::Mat matrix) {
    cv::pow(std_dev, 0.5, std_dev);
    return cv::norm(std_dev);
 }
+
+/**
+ * Trains classifiers on all but one of five folds of the test images and
+ * classifies the fold left out
+ * @param[in]  settings  the settings of the classifiers
+ * @return  the fraction of the images that got their own label
+ */
+float cross_validate(const classifier::settings &settings) {
+   const image_set &set = test_images();
+   bag_of_features bof = set.bof();
+   const vector<float> &label_list = set.labels;
+
+   // Create a few folds for the data
+   int num_folds = 5;
+   std::vector<classifier_factory> factories(num_folds);
+   std::vector<classifier_factory> folds(num_folds);
+   for (int i = 0; i < set.features.size(); i++) {
+      vector<double> fv = bof.feature_vector(set.features[i].keypoints, set.features[i].descriptors); 
+      for (int j = 0; j < factories.size(); j++) {
+         if (j == i % num_folds) {
+            folds[j].add_feature_vector(fv, label_list[i]);
+         } else {
+            factories[j].add_feature_vector(fv, label_list[i]);
+         }
+      }
+   }
+
+   // Create and test classifiers for each fold
+   int total_correct = 0;
+   for (int j = 0; j < factories.size(); j++) {
+      classifier cls = factories[j].create_classifier(settings);
+      std::vector<float> responses = cls.classify(folds[j].samples);
+      for (int i = 0; i < responses.size(); i++) {
+         total_correct += (responses[i] == folds[j].responses.at<float>(i,0));
+      }
+   }
+   return (float)total_correct / label_list.size();
+}
+
+image_set load_test_images() {
+   image_set set;
+   feature_pipeline pipeline;
+   set.features = pipeline.run(vector<string>(images.begin(), images.end()));
+
+   map<string, float> labels;
+   for (int i = 0; i < set.features.size(); i++) {
+      string label = boost::filesystem::path(set.features[i].file).parent_path().leaf().string();
+      if (labels.find(label) == labels.end()) {
+         float next = labels.size();
+         labels[label] = next;
+      }
+      set.labels.push_back(labels[label]);
+      set.descriptors.push_back(set.features[i].descriptors);
+   }
+
+   visual_vocabulary_factory vv_fact;
+   vv_fact.add_descriptors(set.descriptors);
+   set.vocab = vv_fact.compute_visual_vocabulary(visual_vocabulary::settings());
+   return set;
+}
+
+// Computed by the first test that asks for it
+const image_set &test_images() {
+   static image_set set = load_test_images();
+   return set;
+}